@@ -2,8 +2,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "ogr_api.h"
 #include "ogr_srs_api.h"
@@ -19,6 +34,8 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include <zlib.h>
+
 #if defined(__linux__)
 #define VFRSYSNAME "Linux"
 #else
@@ -59,15 +76,89 @@
 
 #define VFRDEFAULT_FONTDESC "Courier New 12"
 
+#define VFRMERC_ORIGIN 20037508.342789244 // half the web mercator world width (m)
+#define VFRTILE_SIZE 256
+#define VFRTILE_MAXZ 24
+#define VFRTILE_BUFFER 8 // px read around each tile, for strokes/points on the edge
+#define VFRENV_MEETS(a, b) ((a)->MaxX >= (b)->MinX && (a)->MinX <= (b)->MaxX && \
+    (a)->MaxY >= (b)->MinY && (a)->MinY <= (b)->MaxY)
+
+typedef enum {VFRFORMAT_AUTO, VFRFORMAT_SVG, VFRFORMAT_PNG, VFRFORMAT_PNG24,
+    VFRFORMAT_TIFF} vfr_format_t;
+#define VFRFORMAT_SVG_S "svg"
+#define VFRFORMAT_PNG_S "png" // ARGB32, transparent background
+#define VFRFORMAT_PNG24_S "png24" // RGB24, white background
+#define VFRFORMAT_TIFF_S "tiff" // RGBA, transparent background (always banded)
+
+#define VFRBAND_HEIGHT 256 // default band height (px) for banded rendering
+#define VFRBAND_ZBUF 65536 // compressed image data buffered before writing
+
+#define VFRCACHE_MAGIC "VFRCACHE"
+#define VFRCACHE_VERSION 1
+#define VFRCACHE_BYTEORDER 0x01020304
+#define VFRCACHE_QMAX 4294967295.0 // coordinates are quantised to 32 bits per layer
+
 typedef enum {VFRPLACE_NONE, VFRPLACE_AUTO, VFRPLACE_CENTER, VFRPLACE_POINT,
-    VFRPLACE_LINE} vfr_label_place_t;
+    VFRPLACE_LINE, VFRPLACE_INSIDE} vfr_label_place_t;
+
+#define VFRPOLE_PRECISION 1.0 // px, for VFRPLACE_INSIDE anchors
+
+// what to do w/ (non-point) features smaller than a pixel (draw, as
+// before, unless asked)
+typedef enum {VFRSUBPX_DRAW, VFRSUBPX_DOT, VFRSUBPX_CULL} vfr_subpx_t;
+#define VFRSUBPX_DOT_S "dot"
+#define VFRSUBPX_CULL_S "cull"
+#define VFRSUBPX_DRAW_S "draw"
+
+// how label halos are drawn
+typedef enum {VFRHALO_HULL, VFRHALO_OUTLINE} vfr_halo_t;
+#define VFRHALO_HULL_S "hull" // convex hull around the text
+#define VFRHALO_OUTLINE_S "outline" // glyph outlines, stroked
+
+#define VFRLUA_FEATURE_MT "vfr.feature" // metatable for feature proxies
+#define VFRLUA_FEATURE "vfr.feature.proxy" // registry key of the layer's proxy
+#define VFRLUA_FEATURE_BATCH "vfr.feature.batch" // registry key of the layer's batch proxies
+#define VFRLUA_BATCH 1024 // features per vfrFeatureStyleBatch call
+#define VFRPIPE_SLOTS 1024 // features in flight in the render pipeline
+#define VFRPIPE_SPINS 256 // polls of a slot before yielding
+
+#define VFRLUA_STYLE_KEYS "vfr.style.keys" // registry key of the style key names
+#define VFRSTYLE_MEMO_MAX 256 // class styles kept per lua state
+#define VFRRAMP_COLOR(k) ((k) == VFRKEY_STROKE || (k) == VFRKEY_FILL || \
+    (k) == VFRKEY_LABEL_FILL || (k) == VFRKEY_LABEL_HALO_FILL)
+#define VFRRAMP_NUMBER(k) ((k) == VFRKEY_SIZE || (k) == VFRKEY_FILL_OPACITY || \
+    (k) == VFRKEY_STROKE_OPACITY || (k) == VFRKEY_LABEL_OPACITY || (k) == VFRKEY_LABEL_HALO_SIZE)
+
+// style table keys, in the order they're registered
+typedef enum {VFRKEY_NONE, VFRKEY_STROKE, VFRKEY_FILL, VFRKEY_FILL_OPACITY,
+    VFRKEY_STROKE_OPACITY, VFRKEY_SIZE, VFRKEY_SIMPLIFY, VFRKEY_SUBPIXEL,
+    VFRKEY_LABEL_PLACE, VFRKEY_LABEL_FONTDESC, VFRKEY_LABEL_FIELD, VFRKEY_LABEL_TEXT,
+    VFRKEY_LABEL_FILL, VFRKEY_LABEL_OPACITY, VFRKEY_LABEL_WIDTH, VFRKEY_LABEL_XOFFSET,
+    VFRKEY_LABEL_YOFFSET, VFRKEY_LABEL_ROTATE, VFRKEY_FILL_PATTERN, VFRKEY_FILL_ROTATE,
+    VFRKEY_FILL_SCALE, VFRKEY_LABEL_HALO_FILL, VFRKEY_LABEL_HALO_SIZE, VFRKEY_LABEL_HALO,
+    VFRKEY_LABEL_PRIORITY, VFRKEY_LABEL_OVERLAP, VFRKEY_CLASS, VFRKEY_R, VFRKEY_G,
+    VFRKEY_B, VFRKEY_COUNT} vfr_style_key_t;
+
+static const char *vfr_style_keys[VFRKEY_COUNT] = {NULL, "stroke", "fill", "fill_opacity",
+    "stroke_opacity", "size", "simplify", "subpixel",
+    "label_place", "label_fontdesc", "label_field", "label_text",
+    "label_fill", "label_opacity", "label_width", "label_xoffset",
+    "label_yoffset", "label_rotate", "fill_pattern", "fill_rotate",
+    "fill_scale", "label_halo_fill", "label_halo_size", "label_halo",
+    "label_priority", "label_overlap", "_vfr_class", "r", "g",
+    "b"};
+
+// what vfrFeatureStyle gets instead of a table of fields
+typedef struct vfr_luaftr_s {
+    OGRFeatureH ftr; // NULL outside vfrFeatureStyle calls
+    const char *fldmask; // fields read (NULL for all)
+} vfr_luaftr_t;
 
 // TODO: map config object (w/h, bgcolor...) w/ access to datasrc and then available in ftr style fn
 // TODO: check srs'es
 // TODO: hatches, other fills
 // TODO: explicitly reset default in synch
 // TODO: style dashes, hashes (patterns)
-// TODO: ranges on numeric fields? (e.g. _vfr_layer_ranges...)
 typedef struct vfr_style_s {
     uint64_t fill;
     int fill_opacity;
@@ -90,23 +181,519 @@ typedef struct vfr_style_s {
     uint64_t label_halo_fill;
     double label_rotate;
     double label_width; // width for wrapping (in ems? or points?)
+    double simplify; // simplification tolerance (in px, 0 = off)
+    vfr_subpx_t subpixel;
+    double label_priority; // labels w/ higher priority are placed first
+    vfr_halo_t label_halo;
 } vfr_style_t;
 
+// a class style (see lua_feature_style)
+typedef struct vfr_style_memo_s {
+    const void *tbl; // the style table
+    int ref; // registry reference keeping tbl alive
+    vfr_style_t style;
+} vfr_style_memo_t;
+
+typedef struct vfr_style_memos_s {
+    vfr_style_memo_t entries[VFRSTYLE_MEMO_MAX];
+    int n;
+    int last;
+    vfr_style_t base; // default style, from vfr_style
+} vfr_style_memos_t;
+
+// a color or number interpolated over a rule's field
+typedef struct vfr_ramp_s {
+    int key; // style key (VFRKEY_)
+    double from[3]; // r, g, b (or the number, in [0])
+    double to[3];
+} vfr_ramp_t;
+
+// a compiled vfr_rules entry
+typedef struct vfr_rule_s {
+    char *layer; // NULL for any layer
+    char *field; // NULL for no field test
+    char *eqstr; // field must equal this (if not NULL)
+    double eqnum; // field must equal this (if haseq)
+    int haseq;
+    double min; // min <= field < max
+    double max;
+    int numeric; // the field must be a number
+    vfr_ramp_t *ramps;
+    int nramps;
+    double rampmin;
+    double rampmax;
+    vfr_style_t style; // resolved against vfr_style
+    int active; // applies to the current layer
+    int fldidx; // field's index in the current layer
+} vfr_rule_t;
+
+typedef struct vfr_rules_s {
+    vfr_rule_t *rules;
+    int n;
+    int fallback; // vfrFeatureStyle(Batch) is defined
+} vfr_rules_t;
+
+// cache file header. offsets are from the start of the file, and
+// everything's in the byte order of the machine that built it
+typedef struct vfr_cache_hdr_s {
+    char magic[8]; // VFRCACHE_MAGIC
+    uint32_t version; // VFRCACHE_VERSION
+    uint32_t byteorder; // VFRCACHE_BYTEORDER
+    uint64_t size; // of the whole file
+    uint64_t layers; // vfr_cache_lhdr_t[nlayers]
+    uint32_t nlayers;
+    uint32_t pad;
+} vfr_cache_hdr_t;
+
+// a cached layer. coordinates are fixed point: x = origin[0] + q*scale[0]
+typedef struct vfr_cache_lhdr_s {
+    uint64_t name;
+    uint64_t srs; // wkt, 0 if none
+    int32_t geomtype; // OGRwkbGeometryType of the layer
+    uint32_t nftrs;
+    uint32_t nparts;
+    uint32_t nrings;
+    uint32_t npts;
+    uint32_t nfields;
+    double ext[4]; // minx, miny, maxx, maxy
+    double origin[2];
+    double scale[2];
+    uint64_t fids; // int64_t[nftrs]
+    uint64_t bboxes; // uint32_t[4*nftrs]: minx, miny, maxx, maxy of each feature
+    uint64_t gtypes; // uint8_t[nftrs]: OGRwkbGeometryType, 0 = no geometry
+    uint64_t ftrparts; // uint32_t[nftrs+1]: first part of each feature
+    uint64_t parttypes; // uint8_t[nparts]: wkbPoint, wkbLineString or wkbPolygon
+    uint64_t partrings; // uint32_t[nparts+1]: first ring of each part
+    uint64_t ringpts; // uint32_t[nrings+1]: first point of each ring
+    uint64_t pts; // uint32_t[2*npts]: x, y
+    uint64_t fields; // vfr_cache_field_t[nfields]
+} vfr_cache_lhdr_t;
+
+// a cached attribute column
+typedef struct vfr_cache_field_s {
+    uint64_t name;
+    int32_t type; // OFTInteger, OFTInteger64, OFTReal or OFTString
+    uint32_t pad;
+    uint64_t nulls; // uint8_t[(nftrs+7)/8]: a set bit is a null (or unset) value
+    uint64_t data; // int32_t, int64_t or double[nftrs], or uint32_t[nftrs+1] into strs
+    uint64_t strs; // nul terminated strings
+} vfr_cache_field_t;
+
+// an attribute column of a mapped cache
+typedef struct vfr_cachecol_s {
+    int type;
+    const unsigned char *nulls;
+    const void *data;
+    const char *strs;
+    uint32_t strslen;
+} vfr_cachecol_t;
+
+// a layer of a mapped cache, read through an (empty) memory layer that
+// holds its name, srs and fields
+typedef struct vfr_cachelayer_s {
+    struct vfr_cache_s *cache;
+    OGRLayerH layer;
+    const vfr_cache_lhdr_t *hdr;
+    const int64_t *fids;
+    const uint32_t *bboxes;
+    const unsigned char *gtypes;
+    const uint32_t *ftrparts;
+    const unsigned char *parttypes;
+    const uint32_t *partrings;
+    const uint32_t *ringpts;
+    const uint32_t *pts;
+    vfr_cachecol_t *cols;
+    uint32_t next; // next feature to read
+    int filtered;
+    OGREnvelope filter; // features whose bbox misses it are skipped
+} vfr_cachelayer_t;
+
+// a mapped cache file
+typedef struct vfr_cache_s {
+    OGRDataSourceH src;
+    unsigned char *base;
+    size_t size;
+    vfr_cachelayer_t *layers;
+    int nlayers;
+    double *xy; // scratch for decoding points
+    uint32_t xycap;
+    struct vfr_cache_s *next; // other caches open on this thread
+} vfr_cache_t;
+
+// growable buffer, for building caches
+typedef struct vfr_buf_s {
+    unsigned char *data;
+    size_t n;
+    size_t cap;
+} vfr_buf_t;
+
+// a cached layer being built
+typedef struct vfr_cachebuild_s {
+    vfr_buf_t fids, bboxes, gtypes, ftrparts, parttypes, partrings, ringpts, pts;
+    vfr_buf_t *nulls, *data, *strs; // per field
+    int *types;
+    int nfields;
+    double origin[2];
+    double scale[2];
+    uint32_t bbox[4]; // of the feature being added
+} vfr_cachebuild_t;
+
+// states of a render pipeline slot
+typedef enum {VFRSLOT_FREE, VFRSLOT_READ, VFRSLOT_STYLED} vfr_slot_state_t;
+
+// a feature on its way through the render pipeline
+typedef struct vfr_ftrslot_s {
+    OGRFeatureH ftr; // NULL at the end of a layer
+    OGRLayerH layer; // NULL tells a style thread to quit
+    const char *fldmask;
+    vfr_style_t style;
+    int state; // VFRSLOT_ (atomic)
+} vfr_ftrslot_t;
+
+// render pipeline: a reader thread fills a ring of slots in order, style
+// threads style them (each w/ its own lua state, taking every
+// nstylers'th slot) and the rendering thread draws them in order. slots
+// are handed from stage to stage by setting their state, w/o locks.
+typedef struct vfr_pipeline_s {
+    vfr_ftrslot_t *slots; // VFRPIPE_SLOTS of them
+    long head; // next slot to read into
+    long tail; // next slot to draw
+    pthread_t reader;
+    pthread_t *stylers;
+    int nstylers;
+    int started; // style threads started (atomic)
+    int ready; // nstylers is set (atomic)
+    int loaded; // style threads done loading the style (atomic)
+    int failed; // one of them couldn't load it (read once all have loaded)
+    const char *luafilenm;
+    vfr_style_t *base; // style the style threads start from
+    OGRLayerH layer; // layer being read
+    vfr_cachelayer_t *cl; // (if layer is a cache's)
+    const char *fldmask;
+    int quiet;
+} vfr_pipeline_t;
+
+// features read ahead for vfrFeatureStyleBatch
+typedef struct vfr_ftrbatch_s {
+    OGRFeatureH ftrs[VFRLUA_BATCH];
+    vfr_rule_t *rules[VFRLUA_BATCH]; // matching rule, or NULL
+    double vals[VFRLUA_BATCH]; // rule field values (for ramps)
+    int luaidx[VFRLUA_BATCH]; // index in the styles vfrFeatureStyleBatch returned
+    int n;
+    int next; // next feature to draw
+    int ref; // registry reference to the returned styles
+} vfr_ftrbatch_t;
+
 /*typedef struct vfr_list_s {
     void *dat;
     struct vfr_list_s *next;
     struct vfr_list_s *prev;
 } vfr_list_t;*/
 
-typedef double param_t;
+typedef struct vfr_render_opts_s {
+    int use_bbox; // render only within bbox (also sets extent)
+    OGREnvelope bbox;
+    const char *where; // attribute filter (OGR SQL WHERE clause)
+    vfr_format_t format;
+    int buffer; // px around bbox to also read features from
+    int noempty; // don't write output if no features were drawn
+    int quiet; // no per-layer progress
+    int threads; // render w/ a pipeline of this many threads (if > 1), or band threads
+    int band; // render a raster in bands of this many rows (0 = all at once)
+    const char *luafilenm; // loaded by each of the pipeline's style threads
+} vfr_render_opts_t;
+
+// writes a png or (deflated) tiff a band of rows at a time
+typedef struct vfr_imgout_s {
+    FILE *fp;
+    vfr_format_t format;
+    int width;
+    int height;
+    int alpha; // rgba, or just rgb
+    int rows; // rows written
+    long offset; // bytes written
+    z_stream z;
+    unsigned char *row; // a converted row, after a png filter byte
+    unsigned char *zbuf; // VFRBAND_ZBUF
+    uint32_t *stripoffs; // tiff strips (one per band)
+    uint32_t *stripsizes;
+    int nstrips;
+    int maxstrips;
+    uint32_t rowsperstrip;
+} vfr_imgout_t;
+
+// a banded render: bands are drawn by worker threads and written in order
+typedef struct vfr_bandjob_s {
+    const char *datpath;
+    const char *luafilenm;
+    vfr_style_t *style;
+    vfr_render_opts_t opts; // for the workers
+    OGREnvelope ext;
+    int iw;
+    int ih;
+    int bandh;
+    int nbands;
+    int next; // next band to draw
+    int written; // bands written
+    int inflight; // bands drawn ahead of the writer, at most
+    cairo_surface_t **bands; // drawn, waiting to be written
+    long drawn;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} vfr_bandjob_t;
+
+// reusable buffer of interleaved (x, y) coordinates
+typedef struct vfr_coords_s {
+    double *xy;
+    int n;
+    int cap;
+    unsigned char *keep; // scratch for simplification
+    int *stack;
+} vfr_coords_t;
+
+// a ring edge (from point i to i+1) by its x range, for finding crossings
+typedef struct vfr_edge_s {
+    double minx, maxx;
+    int i;
+} vfr_edge_t;
+
+typedef struct vfr_edges_s {
+    vfr_edge_t *items;
+    int cap;
+} vfr_edges_t;
+
+// kinds of shapes that get painted the same way
+typedef enum {VFRBATCH_NONE, VFRBATCH_POLY, VFRBATCH_LINE, VFRBATCH_POINT,
+    VFRBATCH_PDOT, VFRBATCH_LDOT} vfr_batch_kind_t;
+
+// consecutive shapes w/ the same kind and paint style are added to one
+// path, which is filled/stroked once when the style changes
+typedef struct vfr_batch_s {
+    vfr_batch_kind_t kind; // kind of the pending path (none if empty)
+    vfr_style_t style; // paint style of the pending path
+    long features;
+    long runs;
+} vfr_batch_t;
+
+// a fill pattern, by the style properties it's made from
+typedef struct vfr_pattern_s {
+    char *hatch_pattern;
+    uint64_t fill;
+    int fill_opacity;
+    double hatch_scale;
+    double hatch_rotate;
+    cairo_pattern_t *pattern;
+} vfr_pattern_t;
+
+typedef struct vfr_pattern_cache_s {
+    vfr_pattern_t *entries;
+    int n;
+    int cap;
+} vfr_pattern_cache_t;
+
+// parsed font description and a layout using it, per font string
+typedef struct vfr_font_s {
+    char *fontdesc;
+    PangoFontDescription *desc;
+    PangoLayout *layout;
+} vfr_font_t;
+
+typedef struct vfr_font_cache_s {
+    PangoContext *context; // shared by all cached layouts
+    cairo_t *cr; // the context was last set up for
+    vfr_font_t *entries;
+    int n;
+    int cap;
+    int last; // last hit, labels tend to repeat fonts
+} vfr_font_cache_t;
 
+// shared state for tile workers
+typedef struct vfr_tilejob_s {
+    const char *datpath;
+    const char *luafilenm;
+    const char *outdir;
+    vfr_style_t *style; // default style (before lua)
+    vfr_render_opts_t opts;
+    int size;
+    int minz, maxz;
+    OGREnvelope dsext;
+    pthread_mutex_t lock; // guards everything below
+    int z, x, y; // next tile
+    int xmin, xmax, ymin, ymax; // tiles covering dsext at zoom z
+    long done, written, failed;
+} vfr_tilejob_t;
+
+// a line w/ the arc length at each vertex, for setting text along it
 typedef struct {
-    cairo_path_t *path;
-    param_t *params;
+    double *xy; // vertices (px)
+    double *cum; // arc length from the first vertex
+    int n;
+    int cap;
     double length;
+    int cursor; // segment of the last lookup
 } paramd_path_t;
 
+#define VFRLABEL_CELL 64 // label collision grid cell size (px)
+
+typedef enum {VFRLBL_LAYOUT, VFRLBL_PATH} vfr_label_kind_t;
+
+// a label candidate, queued during the feature loop and placed afterward
+typedef struct vfr_label_s {
+    double priority;
+    long seq; // feature order, for ties
+    vfr_label_kind_t kind;
+    struct vfr_outline_s *outline; // cached text outline
+    uint64_t fill;
+    int opacity;
+    uint64_t halo_fill;
+    double halo_size;
+    vfr_halo_t halo_mode;
+    double x, y; // layout origin (px)
+    paramd_path_t path; // line to set text along (VFRLBL_PATH)
+    OGREnvelope box; // extent incl. halo (px)
+    int overlap; // may overlap other labels
+} vfr_label_t;
+
+#define VFROUTLINE_WRAP 0x01
+#define VFROUTLINE_CENTER 0x02
+#define VFROUTLINE_LINE 0x04 // first line only, for setting along a path
+
+// laid out, flattened text, keyed by (text, fontdesc, width, flags)
+typedef struct vfr_outline_s {
+    unsigned long hash;
+    char *text;
+    char *fontdesc;
+    int width; // pango units, -1 = none
+    int flags;
+    PangoLayout *layout; // shaped once, drawn as is
+    cairo_path_t *path; // at the origin, made when first needed (or NULL)
+    PangoRectangle rect; // logical extents (px)
+    int lyow, lyoh; // layout size (pango units)
+    struct vfr_outline_s *next;
+} vfr_outline_t;
+
+typedef struct vfr_outline_cache_s {
+    vfr_outline_t **buckets;
+    long nbuckets; // power of 2
+    long n;
+} vfr_outline_cache_t;
+
+#define VFRLINE_SNAP 1000.0 // line ends closer than 1/SNAP px are joined
+#define VFRLINE_REPEAT 4.0 // at most one label per this many label widths of line
+#define VFRLINE_MAXLABELS 3 // per joined line
+
+// a line (part) waiting to be joined w/ others of the same name
+typedef struct vfr_linepiece_s {
+    vfr_label_t tmpl; // label settings
+    int start; // first point in xy
+    int n;
+    int used;
+} vfr_linepiece_t;
+
+typedef struct vfr_lineend_s {
+    vfr_outline_t *outline; // (same outline = same text and font)
+    long long qx, qy; // snapped position
+    int piece;
+    int tail; // last point of the piece?
+    int next; // next end in the same bucket
+} vfr_lineend_t;
+
+typedef struct vfr_lines_s {
+    double *xy; // all pieces' points (px)
+    int n;
+    int cap;
+    vfr_linepiece_t *pieces;
+    int npieces;
+    int piececap;
+    vfr_lineend_t *ends;
+    int *buckets;
+    int nbuckets; // power of 2
+    int *chain; // scratch for joining
+} vfr_lines_t;
+
+// polygon rings (px), for finding inside label anchors
+typedef struct vfr_rings_s {
+    double *xy;
+    int n;
+    int cap;
+    int *ends; // end (exclusive) of each ring in xy
+    int nrings;
+    int ringcap;
+} vfr_rings_t;
+
+typedef struct vfr_polecell_s {
+    double x, y; // center (px)
+    double h; // half the cell size
+    double d; // distance from center to polygon (negative outside)
+    double max; // best distance possible in the cell
+} vfr_polecell_t;
+
+typedef struct vfr_poleheap_s {
+    vfr_polecell_t *cells;
+    int n;
+    int cap;
+} vfr_poleheap_t;
+
+// an inside label anchor, in map units, by layer and fid
+typedef struct vfr_pole_s {
+    unsigned long hash;
+    OGRFeatureDefnH defn;
+    long fid;
+    double x, y, r;
+    double precision;
+    struct vfr_pole_s *next;
+} vfr_pole_t;
+
+typedef struct vfr_pole_cache_s {
+    vfr_pole_t **buckets;
+    long nbuckets; // power of 2
+    long n;
+} vfr_pole_cache_t;
+
+typedef struct vfr_labels_s {
+    vfr_label_t *items;
+    long n;
+    long cap;
+} vfr_labels_t;
+
+typedef struct vfr_label_cell_s {
+    int *items; // indexes into boxes
+    int n;
+    int cap;
+} vfr_label_cell_t;
+
+typedef struct vfr_label_grid_s {
+    vfr_label_cell_t *cells;
+    int cols;
+    int rows;
+    OGREnvelope *boxes; // placed label boxes
+    int nboxes;
+} vfr_label_grid_t;
+
 const char *g_progname;
+// per-render scratch state (one per thread, for tiles)
+static __thread vfr_coords_t g_coords = {NULL, 0, 0, NULL, NULL};
+static __thread vfr_coords_t g_clipbuf = {NULL, 0, 0, NULL, NULL};
+static __thread vfr_edges_t g_edges = {NULL, 0};
+static __thread long g_subpx_culled = 0; // sub-pixel features, by what each's style did
+static __thread long g_subpx_dotted = 0;
+static __thread long g_shown_count = 0; // features drawn inside the canvas extent
+static __thread vfr_batch_t g_batch;
+static __thread vfr_pattern_cache_t g_patterns = {NULL, 0, 0};
+static __thread vfr_labels_t g_labels = {NULL, 0, 0};
+static __thread paramd_path_t g_linepath; // feature line being labelled
+static __thread vfr_rings_t g_rings;
+static __thread vfr_lines_t g_lines;
+static __thread vfr_style_memos_t g_memos;
+static __thread vfr_rules_t g_rules;
+static __thread vfr_ftrbatch_t g_ftrbatch;
+static __thread vfr_poleheap_t g_poleheap;
+static __thread vfr_pole_cache_t g_poles = {NULL, 0, 0};
+static __thread vfr_font_cache_t g_fonts = {NULL, NULL, NULL, 0, 0, 0};
+static __thread vfr_outline_cache_t g_outlines = {NULL, 0, 0};
+static __thread vfr_cache_t *g_cache = NULL; // cache files open on this thread
+static __thread OGRFeatureDefnH g_label_unread = NULL; // layer warned about an unread label field
 
 static void usage(void);
 
@@ -114,32 +701,193 @@ static int runrender(int argc, char **argv);
 static int runinform(int argc, char **argv);
 static int runversion(int argc, char **argv);
 static int runfonts(int argc, char **argv);
+static int runtiles(int argc, char **argv);
+static int runcache(int argc, char **argv);
+static int parse_shared_opt(int argc, char **argv, int *i, vfr_style_t *style,
+        vfr_render_opts_t *opts, char **luafilenm);
+static void vfr_style_defaults(vfr_style_t *style);
+static void vfr_style_copy(vfr_style_t *dst, vfr_style_t *src);
+static void vfr_style_free(vfr_style_t *style);
+static char* vfr_strdup(const char *str);
 
 static int implrender(const char *datpath, int iw, int ih, 
-        const char *outfilenm, vfr_style_t *style, const char *luafilenm);
+        const char *outfilenm, vfr_style_t *style, const char *luafilenm,
+        vfr_render_opts_t *opts);
+static lua_State* vfr_lua_load(const char *luafilenm, vfr_style_t *style);
+static long render_layers(OGRDataSourceH src, lua_State *L, OGREnvelope *ext, int iw, int ih,
+        cairo_t *cr, cairo_t *lcr, vfr_style_t *style, vfr_render_opts_t *opts);
+static long render_banded(OGRDataSourceH src, lua_State *L, const char *datpath,
+        OGREnvelope *ext, int iw, int ih, const char *outfilenm, vfr_style_t *style,
+        vfr_render_opts_t *opts);
+static void* band_worker(void *arg);
+static int imgout_write(vfr_imgout_t *out, const void *data, size_t len);
+static void put32be(unsigned char *b, uint32_t v);
+static void put16le(unsigned char *b, uint16_t v);
+static void put32le(unsigned char *b, uint32_t v);
+static int png_chunk(vfr_imgout_t *out, const char *type, const unsigned char *data, uint32_t len);
+static int imgout_deflate(vfr_imgout_t *out, int flush);
+static int imgout_open(vfr_imgout_t *out, const char *filenm, vfr_format_t format,
+        int w, int h, int bandh);
+static int imgout_band(vfr_imgout_t *out, cairo_surface_t *band);
+static unsigned char* tiff_tag(unsigned char *b, uint16_t tag, uint16_t type,
+        uint32_t count, uint32_t val);
+static int imgout_close(vfr_imgout_t *out, int ok);
+static long render_map(OGRDataSourceH src, lua_State *L, OGREnvelope *ext, int iw, int ih,
+        const char *outfilenm, vfr_style_t *style, vfr_render_opts_t *opts);
+static void tile_next_zoom(vfr_tilejob_t *job);
+static int tile_next(vfr_tilejob_t *job, int *z, int *x, int *y);
+static void tile_extent(int z, int x, int y, OGREnvelope *ext);
+static void* tile_worker(void *arg);
+static int vfr_mkdir(const char *path);
 static int vfr_ds_extent(OGRDataSourceH *ds, OGREnvelope *ext);
+static int vfr_ds_mercator(OGRDataSourceH *ds);
+static OGRDataSourceH vfr_open(const char *datpath);
+static void vfr_close(OGRDataSourceH src);
+static vfr_cachelayer_t* cache_layer(OGRLayerH layer);
+static OGRFeatureH vfr_next_feature(OGRLayerH layer, vfr_cachelayer_t *cl);
+static int cache_skip(vfr_cachelayer_t *cl, uint32_t i);
+static int cache_count(vfr_cachelayer_t *cl);
+static OGRFeatureH cache_feature(vfr_cachelayer_t *cl, uint32_t i);
+static OGRGeometryH cache_part(vfr_cachelayer_t *cl, uint32_t part);
+static void cache_points(vfr_cachelayer_t *cl, OGRGeometryH geom, uint32_t ring);
+static vfr_cache_t* cache_open(const char *path);
+static int cache_map(vfr_cache_t *cache, const char *path);
+static int cache_map_layer(vfr_cache_t *cache, vfr_cachelayer_t *cl,
+        const vfr_cache_lhdr_t *lh);
+static const void* cache_section(vfr_cache_t *cache, uint64_t off, uint64_t n, size_t size);
+static const char* cache_string(vfr_cache_t *cache, uint64_t off);
+static void cache_close(vfr_cache_t *cache);
+static int cache_build_layer(FILE *fp, uint64_t *pos, OGRLayerH layer, vfr_cache_lhdr_t *lh);
+static int cache_put_geom(vfr_cachebuild_t *cb, OGRGeometryH geom);
+static void cache_put_part(vfr_cachebuild_t *cb, int type);
+static void cache_put_ring(vfr_cachebuild_t *cb, OGRGeometryH ring);
+static uint32_t cache_quant(double v, double origin, double scale);
+static int cache_write(FILE *fp, uint64_t *pos, const void *data, size_t len, uint64_t *off);
+static void buf_add(vfr_buf_t *buf, const void *data, size_t len);
+static int parse_bbox(const char *str, OGREnvelope *ext);
+static int parse_format(const char *str, vfr_format_t *format);
+static vfr_format_t format_from_filenm(const char *filenm);
+static int vfr_geom_to_px(OGRGeometryH geom, OGREnvelope *ext, double pxw, double pxh,
+        vfr_coords_t *pts);
+static void vfr_px_transform(double *xy, int n, double offx, double offy, double sx, double sy);
+static void vfr_path_coords(cairo_t *cr, vfr_coords_t *pts);
+static void vfr_coords_reserve(vfr_coords_t *pts, int n);
+static int vfr_simplify_coords(vfr_coords_t *pts, double tol, int closed,
+        vfr_coords_t *tmp);
+static void vfr_orient_coords(vfr_coords_t *pts, int cw);
+static void vfr_clip_rect(OGREnvelope *ext, double pxw, double pxh, double margin,
+        OGREnvelope *clip);
+static int vfr_clip_ring(vfr_coords_t *pts, vfr_coords_t *tmp, OGREnvelope *clip);
+static void vfr_path_clipped_line(cairo_t *cr, vfr_coords_t *pts, OGREnvelope *clip);
+static int parse_subpx(const char *str, vfr_subpx_t *mode);
+static int parse_halo(const char *str, vfr_halo_t *mode);
+static void vfr_draw_subpx(cairo_t *cr, OGREnvelope *genv, OGREnvelope *ext,
+        double pxw, double pxh, vfr_style_t *style, int poly);
 static int vfr_draw_geom(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom, OGREnvelope *ext,
         double pxw, double pxh, vfr_style_t *style);
-static int vfr_draw_label(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom, OGREnvelope *ext,
+static int vfr_queue_label(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom, OGREnvelope *ext,
         double pxw, double pxh, vfr_style_t *style);
+static int vfr_draw_label(cairo_t *cr, vfr_label_t *lbl);
+static void vfr_label_box(vfr_label_t *lbl);
+static void vfr_lines_add(vfr_lines_t *lines, vfr_coords_t *pts, vfr_label_t *tmpl);
+static unsigned long line_end_hash(vfr_outline_t *outline, long long qx, long long qy);
+static int line_end_find(vfr_lines_t *lines, vfr_outline_t *outline, double *pt, int *tail);
+static double* line_end_pt(vfr_lines_t *lines, int piece, int tail);
+static void vfr_queue_lines(cairo_t *cr, vfr_lines_t *lines);
+static void vfr_queue_chain(cairo_t *cr, vfr_coords_t *pts, vfr_label_t *tmpl);
+static void vfr_labels_push(vfr_labels_t *labels, vfr_label_t *lbl);
+static void vfr_labels_clear(vfr_labels_t *labels);
+static int label_cmp(const void *a, const void *b);
+static int label_grid_range(vfr_label_grid_t *grid, OGREnvelope *box,
+        int *c0, int *r0, int *c1, int *r1);
+static int label_grid_hit(vfr_label_grid_t *grid, OGREnvelope *box);
+static void label_grid_add(vfr_label_grid_t *grid, OGREnvelope *box);
+static long vfr_place_labels(cairo_t *cr, int iw, int ih);
+static int pole_rings(OGRGeometryH geom, OGREnvelope *ext, double pxw, double pxh,
+        vfr_rings_t *rings);
+static double pole_dist(vfr_rings_t *rings, double x, double y);
+static void pole_push(vfr_poleheap_t *heap, vfr_rings_t *rings, double x, double y, double h);
+static vfr_polecell_t pole_pop(vfr_poleheap_t *heap);
+static int polylabel(vfr_rings_t *rings, double precision, double *px, double *py, double *pr);
+static int vfr_pole_anchor(OGRFeatureH ftr, OGRGeometryH geom, OGREnvelope *ext,
+        double pxw, double pxh, double *px, double *py, double *pr);
+static void clear_pole_cache(void);
+static void free_scratch(void);
+static int vfr_style_paint_eq(vfr_style_t *a, vfr_style_t *b);
+static int vfr_batch_mergeable(vfr_style_t *style, vfr_batch_kind_t kind);
+static void vfr_batch_begin(cairo_t *cr, vfr_style_t *style, vfr_batch_kind_t kind);
+static void vfr_batch_flush(cairo_t *cr);
 static int vfr_draw_point(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext,
         double pxw, double pxh, vfr_style_t *style);
 static int vfr_draw_linestring(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext, 
         double pxw, double pxh, vfr_style_t *style);
 static int vfr_draw_polygon(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext,
         double pxw, double pxh, vfr_style_t *style);
-static int eval_feature_style(lua_State *L, OGRFeatureH f, vfr_style_t *style);
+static int eval_feature_style(lua_State *L, OGRFeatureH f, vfr_style_t *style,
+        const char *fldmask);
+static void lua_feature_begin(lua_State *L);
+static void layer_abort(OGRLayerH layer, char *fldmask);
+static vfr_luaftr_t* lua_batch_proxy(lua_State *L, int i);
+static int lua_feature_batch(lua_State *L, OGRLayerH layer, vfr_ftrbatch_t *fb,
+        const char *fldmask, int quiet);
+static void vfr_batch_style(lua_State *L, vfr_ftrbatch_t *fb, int i, vfr_style_t *style);
+static void vfr_progress(long j, int lfcount);
+static void pipe_wait(vfr_ftrslot_t *slot, int state);
+static void pipe_post(vfr_ftrslot_t *slot, int state);
+static vfr_pipeline_t* vfr_pipeline_start(lua_State *L, vfr_style_t *style, vfr_render_opts_t *opts);
+static void vfr_pipeline_stop(vfr_pipeline_t *pipe);
+static void* pipe_reader(void *arg);
+static void* pipe_styler(void *arg);
+static long vfr_pipeline_layer(vfr_pipeline_t *pipe, OGRLayerH layer, const char *fldmask,
+        cairo_t *cr, cairo_t *lcr, OGREnvelope *ext, double pxw, double pxh,
+        vfr_style_t *style, int lfcount, int quiet);
+static int lua_feature_index(lua_State *L);
+static int lua_layer_wanted(lua_State *L, const char *lname);
+static char* lua_layer_fields(lua_State *L, OGRLayerH layer, vfr_style_t *style,
+        const char *where);
+static void where_fields(const char *where, OGRFeatureDefnH ldef, char *fldmask);
 static int synch_style_table(lua_State *L, vfr_style_t *style);
+static void lua_style_keys(lua_State *L);
+static void synch_style_color(lua_State *L, int keys, uint64_t *color);
+static void synch_style_value(lua_State *L, int keys, int id, vfr_style_t *style, unsigned char *seen);
+static void vfr_style_set_string(char **dst, const char *src);
+static void vfr_style_assign(vfr_style_t *dst, vfr_style_t *src);
+static int lua_feature_style(lua_State *L, vfr_style_t *style);
+static void clear_style_memos(vfr_style_t *base);
+static int lua_compile_ramp(lua_State *L, int keys, vfr_rule_t *r);
+static int lua_compile_rules(lua_State *L, vfr_style_t *base);
+static void clear_style_rules(void);
+static void vfr_rules_begin(OGRLayerH layer);
+static int rule_field_number(OGRFeatureH ftr, int fldidx, double *val);
+static vfr_rule_t* vfr_rules_match(OGRFeatureH ftr, double *val);
+static void vfr_rule_style(vfr_rule_t *r, double val, vfr_style_t *style);
+static int vfr_rules_apply(OGRFeatureH ftr, vfr_style_t *style);
 
 
-static double euclid_dist(cairo_path_data_t *pt1, cairo_path_data_t *pt2);
-static param_t* parametrize_path(cairo_path_t *path, double *plen);
-static cairo_path_t* get_linear_label_path(cairo_t *cr, paramd_path_t *parpath,
-        double txtwidth, double placeat);
+static void paramd_reserve(paramd_path_t *pp, int n);
+static void paramd_free(paramd_path_t *pp);
+static void paramd_add(paramd_path_t *pp, double x, double y);
+static void parametrize_coords(vfr_coords_t *pts, paramd_path_t *pp);
+static int paramd_segment(paramd_path_t *pp, double s);
+static int get_linear_label_path(paramd_path_t *src, double txtwidth, double placeat,
+        paramd_path_t *dst);
 static void transform_label_points(cairo_path_t *lyopath, paramd_path_t *paramd_lblpath);
 static void transform_label_point(paramd_path_t *paramd_lblpath, double *xptr, double *yptr);
 static cairo_pattern_t* make_fill_pattern(vfr_style_t *style);
-static void make_label_halo(cairo_t *cr, cairo_path_t* plyopath, vfr_style_t *style);
+static cairo_pattern_t* cached_fill_pattern(vfr_style_t *style);
+static void clear_fill_patterns(void);
+static PangoContext* cached_context(cairo_t *cr);
+static PangoLayout* cached_layout(cairo_t *cr, const char *fontdesc);
+static void clear_font_cache(void);
+static unsigned long outline_hash(const char *text, const char *fontdesc, int width, int flags);
+static vfr_outline_t* cached_outline(cairo_t *cr, const char *text, const char *fontdesc,
+        int width, int flags);
+static PangoLayout* outline_layout(cairo_t *cr, vfr_outline_t *o);
+static cairo_path_t* outline_path(cairo_t *cr, vfr_outline_t *o);
+static void clear_outline_cache(void);
+static int path_convex_hull(cairo_path_t *path, vfr_coords_t *pts, vfr_coords_t *hull);
+static int hull_pt_cmp(const void *a, const void *b);
+static void make_label_halo(cairo_t *cr, cairo_path_t* plyopath, vfr_label_t *lbl);
 //static int spline_knots(int knots, double *tx, double *ty, double *cpx, double *cpy);
 
 static double vfr_color_compextr(uint64_t color, char c);
@@ -158,6 +906,10 @@ int main(int argc, char **argv) {
         rv = runversion(argc, argv);
     } else if(!strcmp(argv[1], "fonts")) {
         rv = runfonts(argc, argv);
+    } else if(!strcmp(argv[1], "tiles")) {
+        rv = runtiles(argc, argv);
+    } else if(!strcmp(argv[1], "cache")) {
+        rv = runcache(argc, argv);
     } else {
         usage();
     }
@@ -170,7 +922,13 @@ static void usage(void){
     fprintf(stderr, "usage:\n");
     fprintf(stderr, "  %s fonts\n", g_progname);
     fprintf(stderr, "  %s inform dsrc\n", g_progname);
-    fprintf(stderr, "  %s render [-out outfile] -ht INT | -wd INT [-lua luafile] datasrc\n", g_progname);
+    fprintf(stderr, "  %s render [-out outfile] -ht INT | -wd INT [-lua luafile]\n", g_progname);
+    fprintf(stderr, "      [-bbox minx,miny,maxx,maxy] [-where expr] [-simplify px]\n");
+    fprintf(stderr, "      [-subpx draw|dot|cull] [-format svg|png|png24|tiff] [-threads INT]\n");
+    fprintf(stderr, "      [-band INT] datasrc\n");
+    fprintf(stderr, "  %s tiles -z MINZ[-MAXZ] -out dir [-size INT] [-threads INT] [-noempty]\n", g_progname);
+    fprintf(stderr, "      [-lua luafile] [-where expr] [-format png|png24|svg] datasrc\n");
+    fprintf(stderr, "  %s cache build [-where expr] datasrc cachefile\n", g_progname);
     fprintf(stderr, "  %s version\n", g_progname);
     fprintf(stderr, "\n");
     exit(1);
@@ -187,18 +945,12 @@ static int runrender(int argc, char **argv) {
     char *outfilenm = NULL;
     char *luafilenm = NULL;
     // init style struct
-    vfr_style_t style = {
-        0xffffff, 100, NULL, 0.0, 1.0, // fill, fopacity, fill pattern, pattern rotate, pattern scale  
-        0x000000, 100, 1, // stroke, sopacity, size
-        VFRPLACE_NONE, NULL, 0xffffff, 100, NULL, NULL, // label placement, field, color, text, fontdesc
-        0, 0, 0, 0, 0x01000000, 0, -1 // flags, xoff, yoff, halo rad, halo fill, label rot, label w
-    };
+    vfr_render_opts_t opts = {0};
+    vfr_style_t style;
+    vfr_style_defaults(&style);
     int iw, ih, i;
     iw = 0;
     ih = 0;
-    char *end;
-    unsigned long long ullval;
-    int ival;
     for(i=2; i<argc; i++) {
         if(!path && argv[i][0] == '-') {
             if(!strcmp(argv[i], "-ht")) {
@@ -219,44 +971,23 @@ static int runrender(int argc, char **argv) {
                     return 1;
                 }
                 outfilenm = argv[i];
-            } else if(!strcmp(argv[i], "-st")) {
-                ullval = strtoull(argv[++i], &end, 16);
-                if(ullval == 0 && end == argv[i]) {
+            } else if(!strcmp(argv[i], "-bbox")) {
+                if(++i >= argc || parse_bbox(argv[i], &opts.bbox)) {
                     usage();
                     return 1;
-                } else if(ullval == ULLONG_MAX && errno) {
-                    usage();
-                    return 1;
-                } else if(*end) {
-                    usage();
-                    return 1;
-                } else {
-                    style.stroke = ullval;
                 }
-            } else if(!strcmp(argv[i], "-fl")) {
-                ullval = strtoull(argv[++i], &end, 16);
-                if(ullval == 0 && end == argv[i]) {
-                    usage();
-                    return 1;
-                } else if(ullval == ULLONG_MAX && errno) {
-                    usage();
-                    return 1;
-                } else if(*end) {
+                opts.use_bbox = 1;
+            } else if(!strcmp(argv[i], "-threads")) {
+                if(++i >= argc || (opts.threads = atoi(argv[i])) <= 0) {
                     usage();
                     return 1;
-                } else {
-                    style.fill = ullval;
                 }
-            } else if(!strcmp(argv[i], "-sz")) {
-                ival = atoi(argv[++i]);
-                style.size = ival;
-            } else if(!strcmp(argv[i], "-lua")) {
-                if(++i >= argc) {
+            } else if(!strcmp(argv[i], "-band")) {
+                if(++i >= argc || (opts.band = atoi(argv[i])) <= 0) {
                     usage();
                     return 1;
                 }
-                luafilenm = argv[i];
-            } else {
+            } else if(parse_shared_opt(argc, argv, &i, &style, &opts, &luafilenm) != 1) {
                 usage();
                 return 1;
             }
@@ -275,23 +1006,153 @@ static int runrender(int argc, char **argv) {
 
     int rv;
 
+    if(opts.format == VFRFORMAT_AUTO) {
+        opts.format = outfilenm ? format_from_filenm(outfilenm) : VFRFORMAT_SVG;
+    }
+
+    opts.luafilenm = luafilenm;
     if(outfilenm == NULL) {
-        rv = implrender(path, iw, ih, "vfr_out.svg", &style, luafilenm);
+        rv = implrender(path, iw, ih, opts.format == VFRFORMAT_SVG ? "vfr_out.svg" :
+            opts.format == VFRFORMAT_TIFF ? "vfr_out.tif" : "vfr_out.png",
+            &style, luafilenm, &opts);
     } else {
-        rv = implrender(path, iw, ih, outfilenm, &style, luafilenm);
+        rv = implrender(path, iw, ih, outfilenm, &style, luafilenm, &opts);
     }
 
     return rv;
 }
 
+static int runtiles(int argc, char **argv) {
+
+    if(argc < 3) {
+        usage();
+        return 1;
+    }
+
+    vfr_tilejob_t job;
+    char *luafilenm = NULL;
+    char *zend;
+    int i, t, nthreads = 0;
+    long ncpu;
+    pthread_t *threads;
+    vfr_style_t style;
+
+    memset(&job, 0, sizeof(job));
+    vfr_style_defaults(&style);
+    job.style = &style;
+    job.size = VFRTILE_SIZE;
+    job.minz = job.maxz = -1;
+    for(i=2; i<argc; i++) {
+        if(!job.datpath && argv[i][0] == '-') {
+            if(!strcmp(argv[i], "-z")) {
+                if(++i >= argc) {
+                    usage();
+                    return 1;
+                }
+                job.minz = job.maxz = strtol(argv[i], &zend, 10);
+                if(*zend == '-') {
+                    job.maxz = strtol(zend+1, &zend, 10);
+                }
+                if(*zend || job.minz < 0 || job.maxz < job.minz || job.maxz > VFRTILE_MAXZ) {
+                    usage();
+                    return 1;
+                }
+            } else if(!strcmp(argv[i], "-out")) {
+                if(++i >= argc) {
+                    usage();
+                    return 1;
+                }
+                job.outdir = argv[i];
+            } else if(!strcmp(argv[i], "-size")) {
+                if(++i >= argc || (job.size = atoi(argv[i])) <= 0) {
+                    usage();
+                    return 1;
+                }
+            } else if(!strcmp(argv[i], "-threads")) {
+                if(++i >= argc || (nthreads = atoi(argv[i])) <= 0) {
+                    usage();
+                    return 1;
+                }
+            } else if(!strcmp(argv[i], "-noempty")) {
+                job.opts.noempty = 1;
+            } else if(parse_shared_opt(argc, argv, &i, &style, &job.opts, &luafilenm) != 1) {
+                usage();
+                return 1;
+            }
+        } else if(!job.datpath) {
+            job.datpath = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if(job.datpath == NULL || job.outdir == NULL || job.minz < 0) {
+        usage();
+        return 1;
+    }
+    job.luafilenm = luafilenm;
+    if(job.opts.format == VFRFORMAT_AUTO) {
+        job.opts.format = VFRFORMAT_PNG;
+    }
+    job.opts.quiet = 1;
+    job.opts.use_bbox = 1;
+    job.opts.buffer = VFRTILE_BUFFER;
+
+    // tiles are only made where there's data
+    OGRDataSourceH src;
+    src = vfr_open(job.datpath);
+    if(src == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", job.datpath, CPLGetLastErrorMsg());
+        return 1;
+    }
+    if(vfr_ds_mercator(src)) {
+        vfr_close(src);
+        return 1;
+    }
+    vfr_ds_extent(src, &job.dsext);
+    vfr_close(src);
+    if(vfr_mkdir(job.outdir)) {
+        return 1;
+    }
+
+    if(nthreads == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? ncpu : 1;
+    }
+    fprintf(stderr, "rendering zoom %d-%d to %s (%d thread(s))\n", job.minz, job.maxz,
+        job.outdir, nthreads);
+    pthread_mutex_init(&job.lock, NULL);
+    job.z = job.minz - 1;
+    tile_next_zoom(&job);
+    threads = malloc(nthreads*sizeof(pthread_t));
+    if(threads == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(t=0; t<nthreads; t++) {
+        if(pthread_create(&threads[t], NULL, tile_worker, &job)) {
+            fprintf(stderr, "could not start tile worker %d\n", t);
+            nthreads = t;
+            break;
+        }
+    }
+    for(t=0; t<nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+    fprintf(stderr, "%ld tile(s) rendered, %ld written, %ld failed\n",
+        job.done, job.written, job.failed);
+    return job.failed || !nthreads ? 1 : 0;
+}
+
 static int runinform(int argc, char **argv) {
     if(argc < 3) {
         usage();
         return 1;
     }
     OGRDataSourceH src;
-    OGRSFDriverH drvr;
-    src = OGROpen(argv[2], FALSE, &drvr);
+    src = vfr_open(argv[2]);
     if(src == NULL) {
         fprintf(stderr, "could not open %s: %s\n", argv[2], CPLGetLastErrorMsg());
         return 1;
@@ -304,24 +1165,33 @@ static int runinform(int argc, char **argv) {
     const char *lgeomtype = "UKNOWN";
     OGRLayerH layer;
     OGRFeatureH ftr;
+    vfr_cachelayer_t *cl;
     char *srswkt;
     OGREnvelope ext;
     for(i =0; i<srclcount; i++) {
         layer = OGR_DS_GetLayer(src, i);
-        lfcount = OGR_L_GetFeatureCount(layer, TRUE);
+        cl = cache_layer(layer);
+        lfcount = cl != NULL ? cache_count(cl) : OGR_L_GetFeatureCount(layer, TRUE);
         OGR_L_ResetReading(layer);
-        if((ftr = OGR_L_GetNextFeature(layer)) != NULL) {
+        if((ftr = vfr_next_feature(layer, cl)) != NULL) {
             lgeomtype = OGR_G_GetGeometryName(OGR_F_GetGeometryRef(ftr));
         }
         printf("\tlayer %d: %s [%s] - %d feature(s)\n", i, OGR_L_GetName(layer), 
             lgeomtype, lfcount);
-        OGR_L_GetExtent(layer, &ext, 0);
+        if(cl != NULL) {
+            ext.MinX = cl->hdr->ext[0];
+            ext.MinY = cl->hdr->ext[1];
+            ext.MaxX = cl->hdr->ext[2];
+            ext.MaxY = cl->hdr->ext[3];
+        } else {
+            OGR_L_GetExtent(layer, &ext, 0);
+        }
         printf("\textent: %0.2f, %0.2f, %0.2f, %0.2f\n", 
             ext.MinX, ext.MinY, ext.MaxX, ext.MaxY);
         OSRExportToWkt(OGR_L_GetSpatialRef(layer), &srswkt);
         printf("\t%s\n", srswkt);
     }
-    OGR_DS_Destroy(src);
+    vfr_close(src);
     return 0;
 }
 
@@ -363,43 +1233,37 @@ static int runfonts(int argc, char **argv) {
 }
 
 static int implrender(const char *datpath, int iw, int ih, 
-        const char *outfilenm, vfr_style_t *style, const char *luafilenm) {
+        const char *outfilenm, vfr_style_t *style, const char *luafilenm,
+        vfr_render_opts_t *opts) {
     
     // open shapefile
     OGRDataSourceH src;
-    OGRSFDriverH drvr;
-    src = OGROpen(datpath, FALSE, &drvr);
+    src = vfr_open(datpath);
     if(src == NULL) {
         fprintf(stderr, "could not open %s: %s\n", datpath, CPLGetLastErrorMsg());
         return 1;
     }
 
     // init lua, load luafile if available
-    lua_State *L;
+    lua_State *L = NULL;
     if(luafilenm != NULL) {
         fprintf(stderr, "opening lua file: %s\n", luafilenm);
-        L = lua_open();
-        luaL_openlibs(L);
-        if(luaL_loadfile(L, luafilenm) || lua_pcall(L, 0, 0, 0)) {
-            fprintf(stderr, "could not load luafile %s: %s\n", luafilenm, lua_tostring(L, -1));
-            lua_close(L);
+        if((L = vfr_lua_load(luafilenm, style)) == NULL) {
+            vfr_close(src);
             return 1;
         }
-
-        // load default style (if available)
-        lua_getglobal(L, "vfr_style");
-        synch_style_table(L, style);
     }
 
-    // get max extent for all layers
-    int i, layercount, lfcount;
-    long j;
+    // get max extent for all layers (or use bbox, if given)
     OGREnvelope ext;
-    vfr_ds_extent(src, &ext);
+    if(opts->use_bbox) {
+        ext = opts->bbox;
+    } else {
+        vfr_ds_extent(src, &ext);
+    }
     fprintf(stderr, "got extents: \n\tmax = (%f, %f)\n\tmin = (%f, %f)\n", ext.MaxX, ext.MaxY, ext.MinX, ext.MinY);
 
-    // get pixel-to-map unit ratio
-    double pxw, pxh;
+    // get output size
     if(iw == 0 && ih == 0) {
         usage();
         return 1;
@@ -408,18 +1272,86 @@ static int implrender(const char *datpath, int iw, int ih,
     } else if(ih == 0) {
         ih = iw * ((ext.MaxY - ext.MinY)/(ext.MaxX - ext.MinX));
     }
-    pxw = (ext.MaxX - ext.MinX)/iw;
-    pxh = (ext.MaxY - ext.MinY)/ih;
+
+    long rv;
+    if(opts->format != VFRFORMAT_SVG && (opts->band > 0 || opts->format == VFRFORMAT_TIFF)) {
+        rv = render_banded(src, L, datpath, &ext, iw, ih, outfilenm, style, opts);
+    } else {
+        rv = render_map(src, L, &ext, iw, ih, outfilenm, style, opts);
+    }
+    clear_pole_cache();
+
+    if(L != NULL) {
+        clear_style_memos(NULL);
+        clear_style_rules();
+        lua_close(L);
+    }
+    vfr_close(src);
+    if(rv < 0) {
+        return 1;
+    }
+    fprintf(stderr, "done.\n");
+    return 0;
+}
+
+// makes a lua state w/ luafilenm loaded and its vfr_style (if any)
+// synched to style. returns NULL on error.
+static lua_State* vfr_lua_load(const char *luafilenm, vfr_style_t *style) {
+    lua_State *L = lua_open();
+    luaL_openlibs(L);
+    if(luaL_loadfile(L, luafilenm) || lua_pcall(L, 0, 0, 0)) {
+        fprintf(stderr, "could not load luafile %s: %s\n", luafilenm, lua_tostring(L, -1));
+        lua_close(L);
+        return NULL;
+    }
+
+    // features are passed to vfrFeatureStyle as proxies
+    luaL_newmetatable(L, VFRLUA_FEATURE_MT);
+    lua_pushcfunction(L, lua_feature_index);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    // load default style (if available)
+    lua_style_keys(L);
+    lua_getglobal(L, "vfr_style");
+    synch_style_table(L, style);
+    lua_pop(L, 1);
+    clear_style_memos(style);
+    lua_compile_rules(L, style);
+    return L;
+}
+
+// renders the extent ext of src to outfilenm (iw x ih px), styling features
+// w/ L if it's not NULL. returns the number of features drawn inside ext
+// (not counting ones only in the margin opts->buffer reads) or -1 on error.
+static long render_map(OGRDataSourceH src, lua_State *L, OGREnvelope *extp, int iw, int ih,
+        const char *outfilenm, vfr_style_t *style, vfr_render_opts_t *opts) {
+
+    long drawn, nlabels, placed;
+    OGREnvelope ext = *extp;
 
     // draw
     cairo_surface_t *surface;
     cairo_t *cr;
-    // surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, iw, ih);
-    surface = cairo_svg_surface_create(outfilenm, iw, ih);
-    cairo_svg_surface_restrict_to_version(surface, CAIRO_SVG_VERSION_1_2);
+    cairo_status_t status;
+    if(opts->format == VFRFORMAT_SVG) {
+        surface = cairo_svg_surface_create(outfilenm, iw, ih);
+        cairo_svg_surface_restrict_to_version(surface, CAIRO_SVG_VERSION_1_2);
+    } else {
+        surface = cairo_image_surface_create(opts->format == VFRFORMAT_PNG24 ?
+            CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32, iw, ih);
+    }
+    if((status = cairo_surface_status(surface)) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "could not create %dx%d surface: %s\n", iw, ih,
+            cairo_status_to_string(status));
+        cairo_surface_destroy(surface);
+        return -1;
+    }
     cr = cairo_create(surface);
-    // cairo_rectangle(cr, 0, 0, iw, ih);
-    // cairo_set_source_rgb(cr, 255, 255, 255);
+    if(opts->format == VFRFORMAT_PNG24) {
+        cairo_rectangle(cr, 0, 0, iw, ih);
+        cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+    }
     cairo_fill(cr);
     // make label surface/context
     cairo_surface_t *lsurface;
@@ -427,444 +1359,3604 @@ static int implrender(const char *datpath, int iw, int ih,
     cairo_rectangle_t surfext = {0.0, 0.0, iw, ih};
     lsurface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &surfext);
     lcr = cairo_create(lsurface);
+    drawn = render_layers(src, L, &ext, iw, ih, cr, lcr, style, opts);
+    if(drawn > 0) {
+        drawn = g_shown_count;
+    }
+    if(g_labels.n) {
+        nlabels = g_labels.n;
+        placed = vfr_place_labels(lcr, iw, ih);
+        vfr_labels_clear(&g_labels);
+        if(!opts->quiet) {
+            fprintf(stderr, "%ld label(s) placed, %ld dropped\n", placed, nlabels - placed);
+        }
+    }
+    clear_outline_cache();
+    clear_font_cache();
+    if(!opts->quiet) fprintf(stderr, "painting labels over shapes...\n");
+    cairo_set_source_surface(cr, lsurface, 0.0, 0.0);
+    cairo_paint(cr);
+    status = CAIRO_STATUS_SUCCESS;
+    if(drawn < 0 || (!drawn && opts->noempty)) {
+        // nothing to write
+    } else if(opts->format != VFRFORMAT_SVG) {
+        if(!opts->quiet) fprintf(stderr, "writing to %s...", outfilenm);
+        cairo_surface_flush(surface);
+        status = cairo_surface_write_to_png(surface, outfilenm);
+    } else {
+        if(!opts->quiet) fprintf(stderr, "writing to %s...", outfilenm);
+    }
+    // cairo_surface_write_to_png(lsurface, "test.png");
+    cairo_destroy(lcr);
+    cairo_surface_destroy(lsurface);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    cairo_surface_destroy(surface);
+    if(opts->format == VFRFORMAT_SVG && (drawn < 0 || (!drawn && opts->noempty))) {
+        // svg surfaces write as they go
+        unlink(outfilenm);
+    }
+    if(status != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "\ncould not write %s: %s\n", outfilenm, cairo_status_to_string(status));
+        return -1;
+    }
+    return drawn;
+}
+
+// draws the features of src's layers in the extent ext (iw x ih px) w/ cr
+// and queues their labels w/ lcr. either can be NULL, to skip shapes or
+// labels. returns the number of features read or -1 on error.
+static long render_layers(OGRDataSourceH src, lua_State *L, OGREnvelope *extp, int iw, int ih,
+        cairo_t *cr, cairo_t *lcr, vfr_style_t *style, vfr_render_opts_t *opts) {
+
+    int i, layercount, lfcount, batched = 0;
+    long j, drawn = 0;
+    OGREnvelope ext = *extp, fext;
+    vfr_ftrbatch_t *fb = &g_ftrbatch;
+    vfr_pipeline_t *pipe = NULL;
+
+    // get pixel-to-map unit ratio
+    double pxw, pxh;
+    pxw = (ext.MaxX - ext.MinX)/iw;
+    pxh = (ext.MaxY - ext.MinY)/ih;
+
     // geom/feature/layer variables
     OGRGeometryH geom;
     OGRFeatureH ftr;
     OGRLayerH layer;
+    vfr_cachelayer_t *cl;
+    char *fldmask = NULL;
     layercount = OGR_DS_GetLayerCount(src);
 
-    fprintf(stderr, "loading layers (%d)\n", layercount);
+    g_subpx_culled = g_subpx_dotted = 0;
+    g_shown_count = 0;
+    memset(&g_batch, 0, sizeof(g_batch));
+    vfr_labels_clear(&g_labels);
+    g_lines.n = g_lines.npieces = 0;
+
+    if(opts->threads > 1) {
+        pipe = vfr_pipeline_start(L, style, opts);
+        if(pipe != NULL && pipe->failed) {
+            // (as w/o threads, a style that doesn't load is an error)
+            fprintf(stderr, "could not load %s in a style thread\n", opts->luafilenm);
+            vfr_pipeline_stop(pipe);
+            return -1;
+        }
+    }
+    if(!opts->quiet) fprintf(stderr, "loading layers (%d)\n", layercount);
     for(i=0; i<layercount; i++) {
         layer = OGR_DS_GetLayer(src, i);
-        lfcount = OGR_L_GetFeatureCount(layer, 0);
-        fprintf(stderr, "layer \"%s\": %d feature(s)\n", OGR_L_GetName(layer), lfcount);
-        OGR_L_ResetReading(layer);
-        j = 0;
-        while(1) {
-            ftr = OGR_L_GetNextFeature(layer);
-            if(!ftr) break;
-            geom = OGR_F_GetGeometryRef(ftr);
-            if(geom == NULL) {
-                fprintf(stderr, "skipping null geometry w/ fid = %ld\n", 
-                    OGR_F_GetFID(ftr));
+        cl = cache_layer(layer);
+        if(L != NULL) {
+            if(!lua_layer_wanted(L, OGR_L_GetName(layer))) {
+                if(!opts->quiet) fprintf(stderr, "layer \"%s\": skipped (not in vfr_layers)\n",
+                    OGR_L_GetName(layer));
                 continue;
             }
-            if(luafilenm != NULL) {
-                eval_feature_style(L, ftr, style);
+            vfr_rules_begin(layer);
+            fldmask = lua_layer_fields(L, layer, style, opts->where);
+            lua_feature_begin(L);
+        }
+        if(opts->where != NULL) {
+            if(cl != NULL) {
+                fprintf(stderr, "layer \"%s\": -where can't filter a cache file "
+                    "(give it to cache build instead)\n", OGR_L_GetName(layer));
+                layer_abort(layer, fldmask);
+                drawn = -1;
+                break;
+            }
+            if(OGR_L_SetAttributeFilter(layer, opts->where) != OGRERR_NONE) {
+                fprintf(stderr, "invalid attribute filter for layer \"%s\": %s\n",
+                    OGR_L_GetName(layer), CPLGetLastErrorMsg());
+                layer_abort(layer, fldmask);
+                drawn = -1;
+                break;
+            }
+        }
+        if(opts->use_bbox) {
+            // let the driver skip features outside the viewport (uses
+            // the spatial index, where one exists)
+            fext.MinX = opts->bbox.MinX - opts->buffer*pxw;
+            fext.MinY = opts->bbox.MinY - opts->buffer*pxh;
+            fext.MaxX = opts->bbox.MaxX + opts->buffer*pxw;
+            fext.MaxY = opts->bbox.MaxY + opts->buffer*pxh;
+            if(cl != NULL) {
+                // (cached features are checked against their bboxes)
+                cl->filter = fext;
+                cl->filtered = 1;
+            } else {
+                OGR_L_SetSpatialFilterRect(layer, fext.MinX, fext.MinY, fext.MaxX, fext.MaxY);
+            }
+        }
+        lfcount = cl != NULL ? cache_count(cl) : OGR_L_GetFeatureCount(layer, 0);
+        if(!opts->quiet) fprintf(stderr, "layer \"%s\": %d feature(s)\n", OGR_L_GetName(layer), lfcount);
+        OGR_L_ResetReading(layer);
+        if(cl != NULL) cl->next = 0;
+        j = 0;
+        if(pipe != NULL) {
+            if((j = vfr_pipeline_layer(pipe, layer, fldmask, cr, lcr, &ext, pxw, pxh,
+                    style, lfcount, opts->quiet)) < 0) {
+                layer_abort(layer, fldmask);
+                drawn = -1;
+                break;
             }
-            if(j && !(j % 200)) {
-                fprintf(stderr, ".");
-                if(!(j % 10000)) {
-                    fprintf(stderr, " (%ld/%d)\n", j, lfcount);
+            if(lcr != NULL) vfr_queue_lines(lcr, &g_lines);
+            drawn += j;
+            free(fldmask);
+            fldmask = NULL;
+            continue;
+        }
+        if(L != NULL) {
+            lua_getglobal(L, "vfrFeatureStyleBatch");
+            batched = lua_isfunction(L, -1);
+            lua_pop(L, 1);
+        }
+        fb->n = fb->next = 0;
+        fb->ref = LUA_NOREF;
+        while(1) {
+            if(batched) {
+                // features are read and styled VFRLUA_BATCH at a time
+                if(fb->next == fb->n && !lua_feature_batch(L, layer, fb, fldmask, opts->quiet)) break;
+                ftr = fb->ftrs[fb->next];
+                geom = OGR_F_GetGeometryRef(ftr);
+                vfr_batch_style(L, fb, fb->next++, style);
+            } else {
+                ftr = vfr_next_feature(layer, cl);
+                if(!ftr) break;
+                geom = OGR_F_GetGeometryRef(ftr);
+                if(geom == NULL) {
+                    if(!opts->quiet) fprintf(stderr, "skipping null geometry w/ fid = %ld\n", 
+                        (long)OGR_F_GetFID(ftr));
+                    OGR_F_Destroy(ftr);
+                    continue;
+                }
+                if(L != NULL && !vfr_rules_apply(ftr, style)) {
+                    eval_feature_style(L, ftr, style, fldmask);
                 }
-            } else if(j == (lfcount-1)) {
-                fprintf(stderr, "done.\n");
             }
-            vfr_draw_geom(cr, ftr, geom, &ext, pxw, pxh, style);
-            vfr_draw_label(lcr, ftr, geom, &ext, pxw, pxh, style);
+            if(!opts->quiet) vfr_progress(j, lfcount);
+            if(cr != NULL) vfr_draw_geom(cr, ftr, geom, &ext, pxw, pxh, style);
+            if(lcr != NULL) vfr_queue_label(lcr, ftr, geom, &ext, pxw, pxh, style);
             OGR_F_Destroy(ftr);
             j++;
         }
+        if(batched) {
+            // (the next layer starts w/ a fresh batch)
+            luaL_unref(L, LUA_REGISTRYINDEX, fb->ref);
+            fb->ref = LUA_NOREF;
+        }
+        if(lcr != NULL) vfr_queue_lines(lcr, &g_lines);
+        drawn += j;
+        free(fldmask);
+        fldmask = NULL;
     }
-    fprintf(stderr, "painting labels over shapes...\n");
-    cairo_set_source_surface(cr, lsurface, 0.0, 0.0);
-    cairo_paint(cr);
-    fprintf(stderr, "writing to %s...", outfilenm);
-    // fprintf(stderr, "writing to %s\n", outfilenm);
-    // cairo_surface_write_to_png(surface, outfilenm);
-    // cairo_surface_write_to_png(lsurface, "test.png");
-    cairo_destroy(lcr);
-    cairo_surface_destroy(lsurface);
-    cairo_destroy(cr);
-    cairo_surface_flush(surface);
-    cairo_surface_destroy(surface);
-    if(luafilenm != NULL) {
-        lua_close(L);
+    if(pipe != NULL) {
+        vfr_pipeline_stop(pipe);
     }
-    fprintf(stderr, "done.\n");
+    if(cr != NULL) {
+        vfr_batch_flush(cr);
+        if(!opts->quiet) {
+            fprintf(stderr, "%ld shape(s) painted in %ld path(s)\n", g_batch.features, g_batch.runs);
+        }
+    }
+    free(g_batch.style.hatch_pattern);
+    g_batch.style.hatch_pattern = NULL;
+    clear_fill_patterns();
+    if((g_subpx_culled || g_subpx_dotted) && !opts->quiet) {
+        fprintf(stderr, "%ld sub-pixel feature(s) culled, %ld drawn as dots\n",
+            g_subpx_culled, g_subpx_dotted);
+    }
+    return drawn;
+}
+
+// writes len bytes to out's file
+static int imgout_write(vfr_imgout_t *out, const void *data, size_t len) {
+    if(fwrite(data, 1, len, out->fp) != len) {
+        fprintf(stderr, "could not write image: %s\n", strerror(errno));
+        return -1;
+    }
+    out->offset += len;
     return 0;
 }
 
-static int eval_feature_style(lua_State *L, OGRFeatureH ftr, vfr_style_t *style) {
-    lua_getglobal(L, "vfrFeatureStyle");
-    if(!lua_isfunction(L, -1)) {
-        fprintf(stderr, "vfrFeatureStyle is not a lua function");
-        lua_pop(L, 1);
-        return 1;
+static void put32be(unsigned char *b, uint32_t v) {
+    b[0] = v >> 24; b[1] = v >> 16; b[2] = v >> 8; b[3] = v;
+}
+
+static void put16le(unsigned char *b, uint16_t v) {
+    b[0] = v; b[1] = v >> 8;
+}
+
+static void put32le(unsigned char *b, uint32_t v) {
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+// writes a png chunk
+static int png_chunk(vfr_imgout_t *out, const char *type, const unsigned char *data, uint32_t len) {
+    unsigned char b[8];
+    uLong crc = crc32(0L, (const Bytef*)type, 4);
+    if(len) crc = crc32(crc, data, len);
+    put32be(b, len);
+    memcpy(b+4, type, 4);
+    if(imgout_write(out, b, 8) || (len && imgout_write(out, data, len))) return -1;
+    put32be(b, crc);
+    return imgout_write(out, b, 4);
+}
+
+// deflates what's in out->z's input (all of it, if flush is Z_FINISH),
+// writing the output as png IDAT chunks or straight to a tiff strip
+static int imgout_deflate(vfr_imgout_t *out, int flush) {
+    int zrv;
+    size_t len;
+    do {
+        zrv = deflate(&out->z, flush);
+        if(zrv == Z_STREAM_ERROR) {
+            fprintf(stderr, "could not compress image\n");
+            return -1;
+        }
+        len = VFRBAND_ZBUF - out->z.avail_out;
+        if(len && (out->z.avail_out == 0 || flush == Z_FINISH)) {
+            if(out->format == VFRFORMAT_TIFF) {
+                if(imgout_write(out, out->zbuf, len)) return -1;
+            } else if(png_chunk(out, "IDAT", out->zbuf, len)) {
+                return -1;
+            }
+            out->z.next_out = out->zbuf;
+            out->z.avail_out = VFRBAND_ZBUF;
+        }
+    } while(out->z.avail_in > 0 || (flush == Z_FINISH && zrv != Z_STREAM_END));
+    return 0;
+}
+
+// starts writing a w x h png or tiff (see vfr_imgout_t) to filenm.
+// tiff strips are bandh rows.
+static int imgout_open(vfr_imgout_t *out, const char *filenm, vfr_format_t format,
+        int w, int h, int bandh) {
+    static const unsigned char pngsig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    unsigned char b[13];
+
+    memset(out, 0, sizeof(vfr_imgout_t));
+    out->format = format;
+    out->width = w;
+    out->height = h;
+    out->alpha = format != VFRFORMAT_PNG24;
+    out->rowsperstrip = bandh;
+    if((out->fp = fopen(filenm, "wb")) == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", filenm, strerror(errno));
+        return -1;
     }
-    lua_newtable(L);
-    int fldcount = OGR_F_GetFieldCount(ftr);
-    int i;
-    OGRFieldDefnH fdef;
-    OGRFeatureDefnH ftrdef;
-    for(i=0; i<fldcount; i++) {
-        fdef = OGR_F_GetFieldDefnRef(ftr, i);
-        lua_pushstring(L, OGR_Fld_GetNameRef(fdef));
-        switch(OGR_Fld_GetType(fdef)) {
-            case OFTString:
-            case OFTDate:
-            case OFTTime:
-                lua_pushstring(L, OGR_F_GetFieldAsString(ftr, i));
-                break;
-            case OFTInteger:
-            case OFTInteger64:
-            case OFTReal:
-                lua_pushnumber(L, OGR_F_GetFieldAsDouble(ftr, i));
-                break;
-            default:
-                fprintf(stderr, "skipping unimplemented field type (pushing nil) for field named '%s'\n",
-                    OGR_Fld_GetNameRef(fdef));
-                lua_pushnil(L);
-                break;
+    out->row = malloc(1 + (size_t)w*(out->alpha ? 4 : 3));
+    out->zbuf = malloc(VFRBAND_ZBUF);
+    if(out->row == NULL || out->zbuf == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if(deflateInit(&out->z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        fprintf(stderr, "could not start compressor\n");
+        imgout_close(out, 0);
+        return -1;
+    }
+    out->z.next_out = out->zbuf;
+    out->z.avail_out = VFRBAND_ZBUF;
+
+    if(format == VFRFORMAT_TIFF) {
+        // little-endian, w/ the ifd (written last) offset filled in then
+        out->maxstrips = (h + bandh - 1)/bandh;
+        out->stripoffs = malloc(out->maxstrips*sizeof(uint32_t));
+        out->stripsizes = malloc(out->maxstrips*sizeof(uint32_t));
+        if(out->stripoffs == NULL || out->stripsizes == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memcpy(b, "II*\0\0\0\0\0", 8);
+        if(imgout_write(out, b, 8)) {
+            imgout_close(out, 0);
+            return -1;
         }
-        lua_settable(L, -3);
+        return 0;
+    }
+    put32be(b, w);
+    put32be(b+4, h);
+    b[8] = 8; // bits per sample
+    b[9] = out->alpha ? 6 : 2; // rgba, rgb
+    b[10] = b[11] = b[12] = 0; // deflate, no filter, no interlace
+    if(imgout_write(out, pngsig, 8) || png_chunk(out, "IHDR", b, 13)) {
+        imgout_close(out, 0);
+        return -1;
     }
+    return 0;
+}
 
-    // add metadata for layer name, geom type, etc.
-    ftrdef = OGR_F_GetDefnRef(ftr);
-    lua_pushstring(L, "_vfr_layer");
-    lua_pushstring(L, OGR_FD_GetName(ftrdef));
-    lua_settable(L, -3);
-    lua_pushstring(L, "_vfr_geomtype");
-    lua_pushstring(L, OGR_G_GetGeometryName(OGR_F_GetGeometryRef(ftr)));
-    lua_settable(L, -3);
+// writes the rows of band, an image surface out->width wide
+static int imgout_band(vfr_imgout_t *out, cairo_surface_t *band) {
+    int x, y, h = cairo_image_surface_get_height(band);
+    int stride = cairo_image_surface_get_stride(band);
+    unsigned char *data, *px;
+    uint32_t argb, a, r, g, b;
+    size_t rowlen = (size_t)out->width*(out->alpha ? 4 : 3);
 
-    if(lua_pcall(L, 1, 1, 0) != 0) {
-        fprintf(stderr, "error calling vfrFeatureStyle: %s\n", lua_tostring(L, -1));
+    cairo_surface_flush(band);
+    data = cairo_image_surface_get_data(band);
+    if(out->format == VFRFORMAT_TIFF) {
+        if(out->nstrips >= out->maxstrips || out->offset > UINT32_MAX) {
+            fprintf(stderr, "image too big for tiff\n");
+            return -1;
+        }
+        out->stripoffs[out->nstrips] = out->offset;
+        deflateReset(&out->z);
     }
-    if(!lua_istable(L, -1)) {
-        fprintf(stderr, "vfrFeatureStyle did not return a table\n");
-        return 1;
+    for(y=0; y<h; y++) {
+        // cairo's pixels are native-endian, premultiplied argb
+        out->row[0] = 0; // png filter: none
+        px = out->row + 1;
+        for(x=0; x<out->width; x++) {
+            argb = ((uint32_t*)(data + (size_t)y*stride))[x];
+            a = argb >> 24;
+            r = (argb >> 16) & 0xff;
+            g = (argb >> 8) & 0xff;
+            b = argb & 0xff;
+            if(!out->alpha) {
+                *px++ = r; *px++ = g; *px++ = b;
+                continue;
+            }
+            if(a == 0) {
+                r = g = b = 0;
+            } else if(a != 0xff) {
+                r = (r*0xff + a/2)/a;
+                g = (g*0xff + a/2)/a;
+                b = (b*0xff + a/2)/a;
+            }
+            *px++ = r; *px++ = g; *px++ = b; *px++ = a;
+        }
+        // (tiff rows have no filter byte)
+        out->z.next_in = out->format == VFRFORMAT_TIFF ? out->row + 1 : out->row;
+        out->z.avail_in = out->format == VFRFORMAT_TIFF ? rowlen : rowlen + 1;
+        if(imgout_deflate(out, Z_NO_FLUSH)) return -1;
+    }
+    out->rows += h;
+    if(out->format == VFRFORMAT_TIFF) {
+        // each band is a strip, deflated on its own
+        if(imgout_deflate(out, Z_FINISH)) return -1;
+        out->stripsizes[out->nstrips] = out->offset - out->stripoffs[out->nstrips];
+        out->nstrips++;
     }
-    synch_style_table(L, style);
     return 0;
 }
 
-// assumes a valid style table is pushed on the lua stack
-static int synch_style_table(lua_State *L, vfr_style_t *style) {
+// appends a tiff ifd entry to b
+static unsigned char* tiff_tag(unsigned char *b, uint16_t tag, uint16_t type,
+        uint32_t count, uint32_t val) {
+    put16le(b, tag);
+    put16le(b+2, type);
+    put32le(b+4, count);
+    put32le(b+8, val);
+    return b + 12;
+}
 
-    int objlen;
+// finishes the image (if ok) and closes it. returns 0 if all's well.
+static int imgout_close(vfr_imgout_t *out, int ok) {
+    unsigned char ifd[2 + 11*12 + 4], b[8], *e;
+    uint32_t bpsoff, offsoff, sizesoff;
+    int i, spp = out->alpha ? 4 : 3, rv = ok ? 0 : -1;
 
-    if(!lua_istable(L, -1)) {
-        fprintf(stderr, "style is not a valid lua table\n");
-        return -1;
+    if(!rv && out->rows != out->height) {
+        rv = -1;
     }
-
-    lua_pushstring(L, "stroke");
-    lua_gettable(L, -2);
-    if(lua_istable(L, -1)) {
-        lua_pushstring(L, "r");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->stroke = ((int)lua_tonumber(L, -1) << 16) & 0xff0000;
+    if(!rv && out->format == VFRFORMAT_TIFF) {
+        // arrays too long for their ifd entries go first
+        if(out->offset & 1) rv = imgout_write(out, "", 1);
+        bpsoff = out->offset;
+        for(i=0; !rv && i<spp; i++) {
+            put16le(b, 8);
+            rv = imgout_write(out, b, 2);
         }
-        lua_pop(L, 1);
-        lua_pushstring(L, "g");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->stroke |= ((int)lua_tonumber(L, -1) << 8) & 0x00ff00;
+        offsoff = out->offset;
+        for(i=0; !rv && i<out->nstrips; i++) {
+            put32le(b, out->stripoffs[i]);
+            rv = imgout_write(out, b, 4);
         }
-        lua_pop(L, 1);
-        lua_pushstring(L, "b");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->stroke |= ((int)lua_tonumber(L, -1)) & 0x0000ff;
+        sizesoff = out->offset;
+        for(i=0; !rv && i<out->nstrips; i++) {
+            put32le(b, out->stripsizes[i]);
+            rv = imgout_write(out, b, 4);
         }
-        lua_pop(L, 2);
-    } else {
-        style->stroke = 0x01000000;
-        lua_pop(L, 1);
+        if(!rv && out->offset > UINT32_MAX) {
+            fprintf(stderr, "image too big for tiff\n");
+            rv = -1;
+        }
+        if(!rv) {
+            e = ifd + 2;
+            e = tiff_tag(e, 256, 4, 1, out->width);
+            e = tiff_tag(e, 257, 4, 1, out->height);
+            e = tiff_tag(e, 258, 3, spp, bpsoff); // bits per sample
+            e = tiff_tag(e, 259, 3, 1, 8); // compression: deflate
+            e = tiff_tag(e, 262, 3, 1, 2); // photometric: rgb
+            e = tiff_tag(e, 273, 4, out->nstrips, out->nstrips == 1 ? out->stripoffs[0] : offsoff);
+            e = tiff_tag(e, 277, 3, 1, spp);
+            e = tiff_tag(e, 278, 4, 1, out->rowsperstrip);
+            e = tiff_tag(e, 279, 4, out->nstrips, out->nstrips == 1 ? out->stripsizes[0] : sizesoff);
+            e = tiff_tag(e, 284, 3, 1, 1); // planar config: contiguous
+            if(out->alpha) {
+                e = tiff_tag(e, 338, 3, 1, 2); // extra sample: unassociated alpha
+            }
+            put16le(ifd, (e - ifd - 2)/12);
+            put32le(e, 0); // no next ifd
+            put32le(b, out->offset);
+            rv = imgout_write(out, ifd, e + 4 - ifd);
+            if(!rv && (fseek(out->fp, 4, SEEK_SET) || fwrite(b, 1, 4, out->fp) != 4)) {
+                fprintf(stderr, "could not write image: %s\n", strerror(errno));
+                rv = -1;
+            }
+        }
+    } else if(!rv) {
+        rv = imgout_deflate(out, Z_FINISH) || png_chunk(out, "IEND", NULL, 0) ? -1 : 0;
     }
-    lua_pushstring(L, "fill");
-    lua_gettable(L, -2);
-    if(lua_istable(L, -1)) {
-        lua_pushstring(L, "r");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->fill = ((int)lua_tonumber(L, -1) << 16) & 0xff0000;
+    deflateEnd(&out->z);
+    if(fclose(out->fp) && !rv) {
+        fprintf(stderr, "could not write image: %s\n", strerror(errno));
+        rv = -1;
+    }
+    free(out->row);
+    free(out->zbuf);
+    free(out->stripoffs);
+    free(out->stripsizes);
+    return rv;
+}
+
+// draws bands from the job until there are none left, w/ its own
+// datasource handle, lua state and styles (like tile_worker)
+static void* band_worker(void *arg) {
+    vfr_bandjob_t *job = arg;
+    OGRDataSourceH src;
+    lua_State *L = NULL;
+    vfr_style_t wstyle, bstyle;
+    vfr_render_opts_t bopts = job->opts;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    double pxh = (job->ext.MaxY - job->ext.MinY)/job->ih;
+    int b, y0, h;
+    long rv;
+
+    src = vfr_open(job->datpath);
+    if(src == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", job->datpath, CPLGetLastErrorMsg());
+        pthread_mutex_lock(&job->lock);
+        job->failed++;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+    vfr_style_copy(&wstyle, job->style);
+    if(job->luafilenm != NULL && (L = vfr_lua_load(job->luafilenm, &wstyle)) == NULL) {
+        vfr_style_free(&wstyle);
+        vfr_close(src);
+        pthread_mutex_lock(&job->lock);
+        job->failed++;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    while(1) {
+        pthread_mutex_lock(&job->lock);
+        // don't get too far ahead of the writer
+        while(job->next < job->nbands && !job->failed &&
+                job->next - job->written >= job->inflight) {
+            pthread_cond_wait(&job->cond, &job->lock);
         }
-        lua_pop(L, 1);
-        lua_pushstring(L, "g");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->fill |= ((int)lua_tonumber(L, -1) << 8) & 0x00ff00;
+        if(job->next >= job->nbands || job->failed) {
+            pthread_mutex_unlock(&job->lock);
+            break;
         }
-        lua_pop(L, 1);
-        lua_pushstring(L, "b");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->fill |= ((int)lua_tonumber(L, -1)) & 0x0000ff;
+        b = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        y0 = b*job->bandh;
+        h = job->ih - y0 < job->bandh ? job->ih - y0 : job->bandh;
+        // only the band's features are read...
+        bopts.use_bbox = 1;
+        bopts.bbox = job->ext;
+        bopts.bbox.MaxY = job->ext.MaxY - y0*pxh;
+        bopts.bbox.MinY = bopts.bbox.MaxY - h*pxh;
+        surface = cairo_image_surface_create(job->opts.format == VFRFORMAT_PNG24 ?
+            CAIRO_FORMAT_RGB24 : CAIRO_FORMAT_ARGB32, job->iw, h);
+        if(cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+            fprintf(stderr, "could not create %dx%d surface: %s\n", job->iw, h,
+                cairo_status_to_string(cairo_surface_status(surface)));
+            cairo_surface_destroy(surface);
+            rv = -1;
+        } else {
+            cr = cairo_create(surface);
+            if(job->opts.format == VFRFORMAT_PNG24) {
+                cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+                cairo_paint(cr);
+            }
+            // ...but drawn in canvas coordinates, so patterns line up
+            // across bands (the surface clips to the band)
+            cairo_translate(cr, 0.0, -y0);
+            vfr_style_copy(&bstyle, &wstyle);
+            rv = render_layers(src, L, &job->ext, job->iw, job->ih, cr, NULL, &bstyle, &bopts);
+            vfr_style_free(&bstyle);
+            cairo_destroy(cr);
+            if(rv < 0) {
+                cairo_surface_destroy(surface);
+            }
         }
-        lua_pop(L, 2);
-    } else {
-        style->fill = 0x01000000;
-        lua_pop(L, 1);
-    }
-    lua_pushstring(L, "fill_opacity");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->fill_opacity = (int)lua_tonumber(L, -1);
-        if(style->fill_opacity < 0) {
-            style->fill_opacity = 0;
-        } else if(style->fill_opacity > 100) {
-            style->fill_opacity = 100;
+
+        pthread_mutex_lock(&job->lock);
+        if(rv < 0) {
+            job->failed++;
+        } else {
+            job->bands[b] = surface;
+            job->drawn += rv;
         }
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "stroke_opacity");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->stroke_opacity = (int)lua_tonumber(L, -1);
-        if(style->stroke_opacity < 0) {
-            style->stroke_opacity = 0;
-        } else if(style->stroke_opacity > 100) {
-            style->stroke_opacity = 100;
-        }
+
+    if(L != NULL) {
+        clear_style_memos(NULL);
+        clear_style_rules();
+        lua_close(L);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "size");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->size = (int)lua_tonumber(L, -1);
+    vfr_style_free(&wstyle);
+    free_scratch();
+    vfr_close(src);
+    return NULL;
+}
+
+// renders the extent ext of src to a png or tiff (iw x ih px) a band of
+// rows at a time. bands are drawn by worker threads, while labels for the
+// whole map are placed here, then painted over each band as it's written
+// out. returns the number of features drawn or -1 on error.
+static long render_banded(OGRDataSourceH src, lua_State *L, const char *datpath,
+        OGREnvelope *ext, int iw, int ih, const char *outfilenm, vfr_style_t *style,
+        vfr_render_opts_t *opts) {
+    vfr_bandjob_t job;
+    vfr_style_t jstyle;
+    vfr_render_opts_t lopts = *opts;
+    vfr_imgout_t out;
+    cairo_surface_t *lsurface, *band;
+    cairo_t *lcr, *cr;
+    cairo_rectangle_t surfext = {0.0, 0.0, iw, ih};
+    pthread_t *threads;
+    long ncpu, nlabels, placed, drawn;
+    int b, t, nthreads, ok, opened;
+
+    memset(&job, 0, sizeof(job));
+    job.datpath = datpath;
+    job.luafilenm = opts->luafilenm;
+    // workers copy the default style while it's being changed here
+    vfr_style_copy(&jstyle, style);
+    job.style = &jstyle;
+    job.opts = *opts;
+    job.opts.threads = 0;
+    // features just outside a band still reach into it (strokes, points)
+    if(job.opts.buffer < VFRTILE_BUFFER) {
+        job.opts.buffer = VFRTILE_BUFFER;
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_place");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_place = (int)lua_tonumber(L, -1);
+    job.ext = *ext;
+    job.iw = iw;
+    job.ih = ih;
+    job.bandh = opts->band > 0 ? opts->band : VFRBAND_HEIGHT;
+    job.nbands = (ih + job.bandh - 1)/job.bandh;
+    job.bands = calloc(job.nbands, sizeof(cairo_surface_t*));
+    if(job.bands == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_fontdesc");
-    lua_gettable(L, -2);
-    if(lua_isstring(L, -1)) {
-        objlen = lua_objlen(L, -1);
-        if(style->label_fontdesc != NULL) {
-            free(style->label_fontdesc);
-        }
-        style->label_fontdesc = malloc(objlen+1);
-        if(style->label_fontdesc == NULL) {
-            fprintf(stderr, "out of memory\n");
-            exit(1);
-        }
-        memcpy(style->label_fontdesc, lua_tostring(L, -1), objlen);
-        style->label_fontdesc[objlen] = '\0';
+    nthreads = opts->threads;
+    if(nthreads <= 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? ncpu : 1;
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_field");
-    lua_gettable(L, -2);
-    if(lua_isstring(L, -1)) {
-        // we need to copy this string, not juse use the pointer...
-        objlen = lua_objlen(L, -1);
-        // free old string
-        if(style->label_field != NULL) {
-            free(style->label_field);
-        }
-        style->label_field = malloc(objlen+1);
-        if(style->label_field == NULL) {
-            fprintf(stderr, "out of memory\n");
-            exit(1);
-        }
-        memcpy(style->label_field, lua_tostring(L, -1), objlen);
-        style->label_field[objlen] = '\0';
+    job.inflight = 2*nthreads;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    if(!opts->quiet) {
+        fprintf(stderr, "rendering %d band(s) of %d px w/ %d thread(s)\n",
+            job.nbands, job.bandh, nthreads);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_text");
-    lua_gettable(L, -2);
-    if(lua_isstring(L, -1)) {
-        // we need to copy this string, not juse use the pointer...
-        objlen = lua_objlen(L, -1);
-        // free old string
-        if(style->label_text != NULL) {
-            free(style->label_text);
-        }
-        style->label_text = malloc(objlen+1);
-        if(style->label_text == NULL) {
-            fprintf(stderr, "out of memory\n");
-            exit(1);
-        }
-        memcpy(style->label_text, lua_tostring(L, -1), objlen);
-        style->label_text[objlen] = '\0';
-    } else {
-        style->label_text = NULL;
+
+    threads = malloc(nthreads*sizeof(pthread_t));
+    if(threads == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_fill");
-    lua_gettable(L, -2);
-    if(lua_istable(L, -1)) {
-        lua_pushstring(L, "r");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->label_fill = ((int)lua_tonumber(L, -1) << 16) & 0xff0000;
-        }
-        lua_pop(L, 1);
-        lua_pushstring(L, "g");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->label_fill |= ((int)lua_tonumber(L, -1) << 8) & 0x00ff00;
+    // (workers' progress would be interleaved)
+    job.opts.quiet = 1;
+    for(t=0; t<nthreads; t++) {
+        if(pthread_create(&threads[t], NULL, band_worker, &job)) {
+            fprintf(stderr, "could not start thread\n");
+            break;
         }
-        lua_pop(L, 1);
-        lua_pushstring(L, "b");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->label_fill |= ((int)lua_tonumber(L, -1)) & 0x0000ff;
+    }
+    nthreads = t;
+    ok = opened = nthreads > 0 && !imgout_open(&out, outfilenm, opts->format, iw, ih, job.bandh);
+
+    // labels are placed over the whole map at once, while bands are drawn
+    lsurface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &surfext);
+    lcr = cairo_create(lsurface);
+    lopts.threads = 0;
+    if(ok && render_layers(src, L, ext, iw, ih, NULL, lcr, style, &lopts) < 0) {
+        ok = 0;
+    }
+    if(ok && g_labels.n) {
+        nlabels = g_labels.n;
+        placed = vfr_place_labels(lcr, iw, ih);
+        if(!opts->quiet) {
+            fprintf(stderr, "%ld label(s) placed, %ld dropped\n", placed, nlabels - placed);
         }
-        lua_pop(L, 1);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_opacity");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_opacity = (int)lua_tonumber(L, -1);
-        if(style->label_opacity < 0) {
-            style->label_opacity = 0;
-        } else if(style->label_opacity > 100) {
-            style->label_opacity = 100;
+    vfr_labels_clear(&g_labels);
+    if(!ok) {
+        pthread_mutex_lock(&job.lock);
+        job.failed++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    // bands are written in order, w/ their labels
+    if(ok && !opts->quiet) fprintf(stderr, "writing to %s...", outfilenm);
+    for(b=0; ok && b<job.nbands; b++) {
+        pthread_mutex_lock(&job.lock);
+        while(job.bands[b] == NULL && !job.failed) {
+            pthread_cond_wait(&job.cond, &job.lock);
         }
+        band = job.bands[b];
+        job.bands[b] = NULL;
+        ok = band != NULL;
+        pthread_mutex_unlock(&job.lock);
+        if(!ok) break;
+        cr = cairo_create(band);
+        cairo_set_source_surface(cr, lsurface, 0.0, -b*job.bandh);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        ok = !imgout_band(&out, band);
+        cairo_surface_destroy(band);
+        pthread_mutex_lock(&job.lock);
+        job.written++;
+        if(!ok) job.failed++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_width");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_width = (int)lua_tonumber(L, -1);
-        if(style->label_width < 0) {
-            style->label_opacity = 0;
+
+    for(t=0; t<nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if(opened && imgout_close(&out, ok && !job.failed)) {
+        ok = 0;
+    }
+    if(!ok || job.failed) {
+        unlink(outfilenm);
+        ok = 0;
+    }
+    for(b=0; b<job.nbands; b++) {
+        if(job.bands[b] != NULL) cairo_surface_destroy(job.bands[b]);
+    }
+    cairo_destroy(lcr);
+    cairo_surface_destroy(lsurface);
+    clear_outline_cache();
+    clear_font_cache();
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    vfr_style_free(&jstyle);
+    free(job.bands);
+    free(threads);
+    drawn = job.drawn;
+    if(!ok) {
+        fprintf(stderr, "\ncould not render %s\n", outfilenm);
+        return -1;
+    }
+    return drawn;
+}
+
+// advances job to the tiles of the next zoom level that cover the data
+static void tile_next_zoom(vfr_tilejob_t *job) {
+    double tsize;
+    long n;
+    job->z++;
+    if(job->z > job->maxz) return;
+    n = 1L << job->z;
+    tsize = 2.0*VFRMERC_ORIGIN/n;
+    job->xmin = floor((job->dsext.MinX + VFRMERC_ORIGIN)/tsize);
+    job->xmax = floor((job->dsext.MaxX + VFRMERC_ORIGIN)/tsize);
+    job->ymin = floor((VFRMERC_ORIGIN - job->dsext.MaxY)/tsize);
+    job->ymax = floor((VFRMERC_ORIGIN - job->dsext.MinY)/tsize);
+    job->xmin = job->xmin < 0 ? 0 : (job->xmin >= n ? n-1 : job->xmin);
+    job->xmax = job->xmax < 0 ? 0 : (job->xmax >= n ? n-1 : job->xmax);
+    job->ymin = job->ymin < 0 ? 0 : (job->ymin >= n ? n-1 : job->ymin);
+    job->ymax = job->ymax < 0 ? 0 : (job->ymax >= n ? n-1 : job->ymax);
+    job->x = job->xmin;
+    job->y = job->ymin;
+}
+
+// takes the next tile to render from job. returns 0 when there are none left.
+static int tile_next(vfr_tilejob_t *job, int *z, int *x, int *y) {
+    int rv = 0;
+    pthread_mutex_lock(&job->lock);
+    if(job->z <= job->maxz) {
+        *z = job->z;
+        *x = job->x;
+        *y = job->y;
+        rv = 1;
+        if(++job->y > job->ymax) {
+            job->y = job->ymin;
+            if(++job->x > job->xmax) {
+                tile_next_zoom(job);
+            }
         }
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_xoffset");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_xoffset = (int)lua_tonumber(L, -1);
+    pthread_mutex_unlock(&job->lock);
+    return rv;
+}
+
+// web mercator extent of tile z/x/y
+static void tile_extent(int z, int x, int y, OGREnvelope *ext) {
+    double tsize = 2.0*VFRMERC_ORIGIN/(1L << z);
+    ext->MinX = -VFRMERC_ORIGIN + x*tsize;
+    ext->MaxX = ext->MinX + tsize;
+    ext->MaxY = VFRMERC_ORIGIN - y*tsize;
+    ext->MinY = ext->MaxY - tsize;
+}
+
+// renders tiles from the job until there are none left, w/ its own
+// datasource handle, lua state and styles (none of which are thread-safe)
+static void* tile_worker(void *arg) {
+    vfr_tilejob_t *job = arg;
+    OGRDataSourceH src;
+    lua_State *L = NULL;
+    vfr_style_t wstyle, tstyle;
+    vfr_render_opts_t topts = job->opts;
+    char *outfilenm;
+    size_t outlen = strlen(job->outdir) + 64;
+    int z, x, y;
+    long rv;
+
+    src = vfr_open(job->datpath);
+    if(src == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", job->datpath, CPLGetLastErrorMsg());
+        pthread_mutex_lock(&job->lock);
+        job->failed++;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_yoffset");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_yoffset = (int)lua_tonumber(L, -1);
+    vfr_style_copy(&wstyle, job->style);
+    if(job->luafilenm != NULL && (L = vfr_lua_load(job->luafilenm, &wstyle)) == NULL) {
+        vfr_style_free(&wstyle);
+        vfr_close(src);
+        pthread_mutex_lock(&job->lock);
+        job->failed++;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_rotate");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_rotate = (int)lua_tonumber(L, -1);
-        style->label_rotate = fmod(style->label_rotate, 360.0);
+    outfilenm = malloc(outlen);
+    if(outfilenm == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "fill_pattern");
-    lua_gettable(L, -2);
-    if(lua_isstring(L, -1)) {
-        objlen = lua_objlen(L, -1);
-        if(style->hatch_pattern != NULL) {
-            free(style->hatch_pattern);
-        }
-        style->hatch_pattern = malloc(objlen+1);
-        if(style->hatch_pattern == NULL) {
-            exit(1);
+
+    while(tile_next(job, &z, &x, &y)) {
+        snprintf(outfilenm, outlen, "%s/%d", job->outdir, z);
+        if(vfr_mkdir(outfilenm)) {
+            rv = -1;
+        } else {
+            snprintf(outfilenm, outlen, "%s/%d/%d", job->outdir, z, x);
+            rv = vfr_mkdir(outfilenm) ? -1 : 0;
         }
-        memcpy(style->hatch_pattern, lua_tostring(L, -1), objlen);
-        style->hatch_pattern[objlen] = '\0';   
-    } else {
-        if(style->hatch_pattern != NULL) {
-            free(style->hatch_pattern);
+        if(!rv) {
+            snprintf(outfilenm, outlen, "%s/%d/%d/%d.%s", job->outdir, z, x, y,
+                job->opts.format == VFRFORMAT_SVG ? "svg" : "png");
+            tile_extent(z, x, y, &topts.bbox);
+            // each tile starts from the default style
+            vfr_style_copy(&tstyle, &wstyle);
+            rv = render_map(src, L, &topts.bbox, job->size, job->size, outfilenm,
+                &tstyle, &topts);
+            vfr_style_free(&tstyle);
+        }
+        pthread_mutex_lock(&job->lock);
+        job->done++;
+        if(rv < 0) {
+            job->failed++;
+        } else if(rv > 0 || !job->opts.noempty) {
+            job->written++;
         }
-        style->hatch_pattern = NULL;
+        if(!(job->done % 1000)) {
+            fprintf(stderr, "%ld tile(s) (at %d/%d/%d)\n", job->done, z, x, y);
+        }
+        pthread_mutex_unlock(&job->lock);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "fill_rotate");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->hatch_rotate = lua_tonumber(L, -1)*(180.0/M_PI); // lua val is in degrees, make rads
-    } else {
-        style->hatch_rotate = 0.0;
+
+    free(outfilenm);
+    if(L != NULL) {
+        clear_style_memos(NULL);
+        clear_style_rules();
+        lua_close(L);
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "fill_scale");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->hatch_scale = lua_tonumber(L, -1);
-    } else {
-        style->hatch_scale = 1.0;
+    vfr_style_free(&wstyle);
+    free_scratch();
+    vfr_close(src);
+    return NULL;
+}
+
+// mkdir that's ok w/ the directory already being there
+static int vfr_mkdir(const char *path) {
+    if(mkdir(path, 0755) && errno != EEXIST) {
+        fprintf(stderr, "could not create directory %s: %s\n", path, strerror(errno));
+        return 1;
     }
-    lua_pop(L, 1);
-    lua_pushstring(L, "label_halo_fill");
-    lua_gettable(L, -2);
-    if(lua_istable(L, -1)) {
-        lua_pushstring(L, "r");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->label_halo_fill = ((int)lua_tonumber(L, -1) << 16) & 0xff0000;
-        }
+    return 0;
+}
+
+// is layer lname listed in the (optional) global vfr_layers?
+static int lua_layer_wanted(lua_State *L, const char *lname) {
+    int i, wanted = 0;
+    lua_getglobal(L, "vfr_layers");
+    if(!lua_istable(L, -1)) {
         lua_pop(L, 1);
-        lua_pushstring(L, "g");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->label_halo_fill |= ((int)lua_tonumber(L, -1) << 8) & 0x00ff00;
+        return 1;
+    }
+    for(i=1; !wanted; i++) {
+        lua_rawgeti(L, -1, i);
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
         }
-        lua_pop(L, 1);
-        lua_pushstring(L, "b");
-        lua_gettable(L, -2);
-        if(lua_isnumber(L, -1)) {
-            // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
-            style->label_halo_fill |= ((int)lua_tonumber(L, -1)) & 0x0000ff;
+        if(lua_isstring(L, -1) && !strcmp(lua_tostring(L, -1), lname)) {
+            wanted = 1;
         }
         lua_pop(L, 1);
     }
     lua_pop(L, 1);
-    lua_pushstring(L, "label_halo_size");
-    lua_gettable(L, -2);
-    if(lua_isnumber(L, -1)) {
-        style->label_halo_size = lua_tonumber(L, -1);
+    return wanted;
+}
+
+// reads the (optional) global vfr_fields, either a list of field names
+// for all layers or a table of such lists keyed by layer name, and tells
+// OGR to skip reading the other fields. returns a mask (1 = wanted) w/ an
+// entry for each field in the layer, or NULL if all fields are wanted.
+static char* lua_layer_fields(lua_State *L, OGRLayerH layer, vfr_style_t *style,
+        const char *where) {
+    OGRFeatureDefnH ldef = OGR_L_GetLayerDefn(layer);
+    int i, fldidx, fldcount = OGR_FD_GetFieldCount(ldef);
+    int ignorecount = 0;
+    char *fldmask;
+    const char **ignored;
+
+    lua_getglobal(L, "vfr_fields");
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    lua_getfield(L, -1, OGR_L_GetName(layer));
+    if(lua_istable(L, -1)) {
+        lua_remove(L, -2);
     } else {
-        style->label_halo_size = 1.0;
+        lua_pop(L, 1);
+        lua_rawgeti(L, -1, 1);
+        if(lua_isnil(L, -1)) {
+            // keyed by layer, but not this one
+            lua_pop(L, 2);
+            return NULL;
+        }
+        lua_pop(L, 1);
     }
-    lua_pop(L, 1);
-    return 0;
-}
 
-static int vfr_ds_extent(OGRDataSourceH *ds, OGREnvelope *ext) {
+    fldmask = calloc(fldcount+1, 1);
+    ignored = malloc((fldcount+1)*sizeof(char*));
+    if(fldmask == NULL || ignored == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i=1; ; i++) {
+        lua_rawgeti(L, -1, i);
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        if(lua_isstring(L, -1)) {
+            fldidx = OGR_FD_GetFieldIndex(ldef, lua_tostring(L, -1));
+            if(fldidx < 0) {
+                fprintf(stderr, "vfr_fields: no field named '%s' in layer \"%s\"\n",
+                    lua_tostring(L, -1), OGR_L_GetName(layer));
+            } else {
+                fldmask[fldidx] = 1;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    // the attribute filter's fields are tested by OGR
+    if(where != NULL) {
+        where_fields(where, ldef, fldmask);
+    }
+    // the default label field is read in vfr_queue_label, not in lua
+    if(style->label_field != NULL &&
+            (fldidx = OGR_FD_GetFieldIndex(ldef, style->label_field)) >= 0) {
+        fldmask[fldidx] = 1;
+    }
+    // and rules test fields (and label their features) in C
+    for(i=0; i<g_rules.n; i++) {
+        if(!g_rules.rules[i].active) continue;
+        if(g_rules.rules[i].fldidx >= 0) {
+            fldmask[g_rules.rules[i].fldidx] = 1;
+        }
+        if(g_rules.rules[i].style.label_field != NULL &&
+                (fldidx = OGR_FD_GetFieldIndex(ldef, g_rules.rules[i].style.label_field)) >= 0) {
+            fldmask[fldidx] = 1;
+        }
+    }
+    for(i=0; i<fldcount; i++) {
+        if(!fldmask[i]) {
+            ignored[ignorecount++] = OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(ldef, i));
+        }
+    }
+    ignored[ignorecount] = NULL;
+    if(OGR_L_SetIgnoredFields(layer, ignored) != OGRERR_NONE) {
+        fprintf(stderr, "could not ignore fields for layer \"%s\"\n", OGR_L_GetName(layer));
+    }
+    free(ignored);
+    return fldmask;
+}
+
+// marks the fields of ldef named in the OGR SQL expression where (bare or
+// double quoted identifiers, not string literals) in fldmask
+static void where_fields(const char *where, OGRFeatureDefnH ldef, char *fldmask) {
+    const char *p = where, *start;
+    char name[256];
+    size_t len;
+    int fldidx;
+
+    while(*p) {
+        if(*p == '\'') {
+            // string literal ('' is a quote)
+            for(p++; *p && !(*p == '\'' && p[1] != '\''); p++) {
+                if(*p == '\'') p++;
+            }
+            if(*p) p++;
+            continue;
+        }
+        if(*p == '"') {
+            start = ++p;
+            while(*p && *p != '"') p++;
+        } else if(isalpha((unsigned char)*p) || *p == '_') {
+            start = p;
+            while(isalnum((unsigned char)*p) || *p == '_') p++;
+        } else {
+            p++;
+            continue;
+        }
+        len = p - start;
+        if(*p == '"') p++;
+        if(len == 0 || len >= sizeof(name)) continue;
+        memcpy(name, start, len);
+        name[len] = '\0';
+        if((fldidx = OGR_FD_GetFieldIndex(ldef, name)) >= 0) {
+            fldmask[fldidx] = 1;
+        }
+    }
+}
+
+// undoes what render_layers set up on layer (the fields it reads, its
+// filters) when it gives up on it, and frees fldmask
+static void layer_abort(OGRLayerH layer, char *fldmask) {
+    vfr_cachelayer_t *cl = cache_layer(layer);
+    free(fldmask);
+    OGR_L_SetIgnoredFields(layer, NULL);
+    OGR_L_SetAttributeFilter(layer, NULL);
+    OGR_L_SetSpatialFilter(layer, NULL);
+    if(cl != NULL) cl->filtered = 0;
+}
+
+// makes the feature proxy for a layer's features. fields are looked up
+// by name once per layer, in the proxy's environment table.
+static void lua_feature_begin(lua_State *L) {
+    vfr_luaftr_t *proxy = lua_newuserdata(L, sizeof(vfr_luaftr_t));
+    proxy->ftr = NULL;
+    proxy->fldmask = NULL;
+    luaL_getmetatable(L, VFRLUA_FEATURE_MT);
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, VFRLUA_FEATURE);
+    // batch proxies are made as needed (see lua_batch_proxy)
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, VFRLUA_FEATURE_BATCH);
+}
+
+// pushes the i'th (from 1) batch proxy for the layer's features, making
+// it if needed. batch proxies share the layer proxy's field indexes.
+static vfr_luaftr_t* lua_batch_proxy(lua_State *L, int i) {
+    vfr_luaftr_t *proxy;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, VFRLUA_FEATURE_BATCH);
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, VFRLUA_BATCH, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, VFRLUA_FEATURE_BATCH);
+    }
+    lua_rawgeti(L, -1, i);
+    if(lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        proxy = lua_newuserdata(L, sizeof(vfr_luaftr_t));
+        proxy->ftr = NULL;
+        proxy->fldmask = NULL;
+        luaL_getmetatable(L, VFRLUA_FEATURE_MT);
+        lua_setmetatable(L, -2);
+        lua_getfield(L, LUA_REGISTRYINDEX, VFRLUA_FEATURE);
+        lua_getfenv(L, -1);
+        lua_setfenv(L, -3);
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, i);
+    }
+    proxy = lua_touserdata(L, -1);
+    lua_remove(L, -2);
+    return proxy;
+}
+
+// reads the next (up to) VFRLUA_BATCH features of layer that have
+// geometries into fb, and styles the ones no rule matches w/ a single
+// vfrFeatureStyleBatch call. returns the number of features read.
+static int lua_feature_batch(lua_State *L, OGRLayerH layer, vfr_ftrbatch_t *fb,
+        const char *fldmask, int quiet) {
+    vfr_luaftr_t *proxies[VFRLUA_BATCH];
+    vfr_cachelayer_t *cl = cache_layer(layer);
+    OGRFeatureH ftr;
+    int i, nlua = 0;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, fb->ref);
+    fb->ref = LUA_NOREF;
+    fb->n = fb->next = 0;
+    while(fb->n < VFRLUA_BATCH && (ftr = vfr_next_feature(layer, cl)) != NULL) {
+        if(OGR_F_GetGeometryRef(ftr) == NULL) {
+            if(!quiet) fprintf(stderr, "skipping null geometry w/ fid = %ld\n",
+                (long)OGR_F_GetFID(ftr));
+            OGR_F_Destroy(ftr);
+            continue;
+        }
+        fb->ftrs[fb->n] = ftr;
+        fb->rules[fb->n] = g_rules.n ? vfr_rules_match(ftr, &fb->vals[fb->n]) : NULL;
+        fb->n++;
+    }
+    if(!fb->n) return 0;
+
+    lua_getglobal(L, "vfrFeatureStyleBatch");
+    lua_createtable(L, fb->n, 0);
+    for(i=0; i<fb->n; i++) {
+        fb->luaidx[i] = 0;
+        if(fb->rules[i] != NULL) continue;
+        proxies[nlua] = lua_batch_proxy(L, nlua+1);
+        proxies[nlua]->ftr = fb->ftrs[i];
+        proxies[nlua]->fldmask = fldmask;
+        lua_rawseti(L, -2, ++nlua);
+        fb->luaidx[i] = nlua;
+    }
+    if(!nlua) {
+        // all styled by rules
+        lua_pop(L, 2);
+        return fb->n;
+    }
+
+    // on errors the whole batch gets the default style (see
+    // vfr_batch_style), w/ one message rather than one per feature
+    if(lua_pcall(L, 1, 1, 0) != 0) {
+        fprintf(stderr, "error calling vfrFeatureStyleBatch: %s\n", lua_tostring(L, -1));
+    } else if(!lua_istable(L, -1)) {
+        fprintf(stderr, "vfrFeatureStyleBatch did not return a table\n");
+    }
+    for(i=0; i<nlua; i++) {
+        proxies[i]->ftr = NULL;
+    }
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return fb->n;
+    }
+    fb->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return fb->n;
+}
+
+// styles the i'th feature of a batch, w/ its rule or what
+// vfrFeatureStyleBatch returned for it
+static void vfr_batch_style(lua_State *L, vfr_ftrbatch_t *fb, int i, vfr_style_t *style) {
+    if(fb->rules[i] != NULL) {
+        vfr_rule_style(fb->rules[i], fb->vals[i], style);
+        return;
+    }
+    if(fb->ref == LUA_NOREF) {
+        // (vfrFeatureStyleBatch failed)
+        vfr_style_assign(style, &g_memos.base);
+        return;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fb->ref);
+    lua_rawgeti(L, -1, fb->luaidx[i]);
+    if(lua_istable(L, -1)) {
+        lua_feature_style(L, style);
+    } else {
+        fprintf(stderr, "vfrFeatureStyleBatch returned no style for feature %d\n", fb->luaidx[i]);
+    }
+    lua_pop(L, 2);
+}
+
+// __index for feature proxies: converts only the fields that are read
+static int lua_feature_index(lua_State *L) {
+    vfr_luaftr_t *proxy = luaL_checkudata(L, 1, VFRLUA_FEATURE_MT);
+    const char *name;
+    OGRFieldDefnH fdef;
+    int fldidx;
+
+    if(proxy->ftr == NULL || !lua_isstring(L, 2)) {
+        // (features can't be used after vfrFeatureStyle returns)
+        lua_pushnil(L);
+        return 1;
+    }
+    name = lua_tostring(L, 2);
+    if(!strcmp(name, "_vfr_layer")) {
+        lua_pushstring(L, OGR_FD_GetName(OGR_F_GetDefnRef(proxy->ftr)));
+        return 1;
+    } else if(!strcmp(name, "_vfr_geomtype")) {
+        lua_pushstring(L, OGR_G_GetGeometryName(OGR_F_GetGeometryRef(proxy->ftr)));
+        return 1;
+    }
+
+    // field index, cached by name
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if(lua_isnumber(L, -1)) {
+        fldidx = lua_tointeger(L, -1);
+    } else {
+        fldidx = OGR_F_GetFieldIndex(proxy->ftr, name);
+        lua_pushvalue(L, 2);
+        lua_pushinteger(L, fldidx);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 2);
+
+    if(fldidx < 0 || (proxy->fldmask != NULL && !proxy->fldmask[fldidx])) {
+        lua_pushnil(L);
+        return 1;
+    }
+    fdef = OGR_F_GetFieldDefnRef(proxy->ftr, fldidx);
+    switch(OGR_Fld_GetType(fdef)) {
+        case OFTString:
+        case OFTDate:
+        case OFTTime:
+            lua_pushstring(L, OGR_F_GetFieldAsString(proxy->ftr, fldidx));
+            break;
+        case OFTInteger:
+        case OFTInteger64:
+        case OFTReal:
+            lua_pushnumber(L, OGR_F_GetFieldAsDouble(proxy->ftr, fldidx));
+            break;
+        default:
+            fprintf(stderr, "skipping unimplemented field type (pushing nil) for field named '%s'\n",
+                OGR_Fld_GetNameRef(fdef));
+            lua_pushnil(L);
+            break;
+    }
+    return 1;
+}
+
+static int eval_feature_style(lua_State *L, OGRFeatureH ftr, vfr_style_t *style,
+        const char *fldmask) {
+    vfr_luaftr_t *proxy;
+    int rv = 0;
+
+    lua_getglobal(L, "vfrFeatureStyle");
+    if(!lua_isfunction(L, -1)) {
+        fprintf(stderr, "vfrFeatureStyle is not a lua function");
+        lua_pop(L, 1);
+        return 1;
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, VFRLUA_FEATURE);
+    proxy = lua_touserdata(L, -1);
+    proxy->ftr = ftr;
+    proxy->fldmask = fldmask;
+
+    if(lua_pcall(L, 1, 1, 0) != 0) {
+        fprintf(stderr, "error calling vfrFeatureStyle: %s\n", lua_tostring(L, -1));
+    }
+    proxy->ftr = NULL;
+    if(!lua_istable(L, -1)) {
+        fprintf(stderr, "vfrFeatureStyle did not return a table\n");
+        rv = 1;
+    } else {
+        lua_feature_style(L, style);
+    }
+    lua_pop(L, 1);
+    return rv;
+}
+
+// registers the style key strings, once per lua state, so style tables
+// can be read w/o hashing key names for every feature
+static void lua_style_keys(lua_State *L) {
+    int i;
+    lua_newtable(L);
+    for(i=1; i<VFRKEY_COUNT; i++) {
+        lua_pushstring(L, vfr_style_keys[i]);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, i); // id -> name
+        lua_pushinteger(L, i);
+        lua_rawset(L, -3); // name -> id
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, VFRLUA_STYLE_KEYS);
+}
+
+// reads an {r=, g=, b=} table at the top of the stack into color.
+// keys is the (absolute) index of the style keys table.
+static void synch_style_color(lua_State *L, int keys, uint64_t *color) {
+    lua_rawgeti(L, keys, VFRKEY_R);
+    lua_rawget(L, -2);
+    if(lua_isnumber(L, -1)) {
+        // should check for valid color here. maybe later. meantime, expect weirdness for n > 255
+        *color = ((int)lua_tonumber(L, -1) << 16) & 0xff0000;
+    }
+    lua_pop(L, 1);
+    lua_rawgeti(L, keys, VFRKEY_G);
+    lua_rawget(L, -2);
+    if(lua_isnumber(L, -1)) {
+        *color |= ((int)lua_tonumber(L, -1) << 8) & 0x00ff00;
+    }
+    lua_pop(L, 1);
+    lua_rawgeti(L, keys, VFRKEY_B);
+    lua_rawget(L, -2);
+    if(lua_isnumber(L, -1)) {
+        *color |= ((int)lua_tonumber(L, -1)) & 0x0000ff;
+    }
+    lua_pop(L, 1);
+}
+
+// sets *dst to a copy of src, unless it's already the same string
+static void vfr_style_set_string(char **dst, const char *src) {
+    size_t len;
+    if(src == NULL) {
+        free(*dst);
+        *dst = NULL;
+        return;
+    }
+    if(*dst != NULL && !strcmp(*dst, src)) return;
+    len = strlen(src);
+    free(*dst);
+    if((*dst = malloc(len+1)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(*dst, src, len+1);
+}
+
+// copies src to dst, reusing dst's strings where they're unchanged
+static void vfr_style_assign(vfr_style_t *dst, vfr_style_t *src) {
+    char *hatch_pattern = dst->hatch_pattern, *label_field = dst->label_field;
+    char *label_text = dst->label_text, *label_fontdesc = dst->label_fontdesc;
+    *dst = *src;
+    dst->hatch_pattern = hatch_pattern;
+    dst->label_field = label_field;
+    dst->label_text = label_text;
+    dst->label_fontdesc = label_fontdesc;
+    vfr_style_set_string(&dst->hatch_pattern, src->hatch_pattern);
+    vfr_style_set_string(&dst->label_field, src->label_field);
+    vfr_style_set_string(&dst->label_text, src->label_text);
+    vfr_style_set_string(&dst->label_fontdesc, src->label_fontdesc);
+}
+
+// applies the value at the top of the stack to style key id. keys is
+// the (absolute) index of the style keys table; keys that reset when
+// they're missing are flagged in seen.
+static void synch_style_value(lua_State *L, int keys, int id, vfr_style_t *style, unsigned char *seen) {
+    switch(id) {
+        case VFRKEY_STROKE:
+            if(lua_istable(L, -1)) {
+                synch_style_color(L, keys, &style->stroke);
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_FILL:
+            if(lua_istable(L, -1)) {
+                synch_style_color(L, keys, &style->fill);
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_FILL_OPACITY:
+            if(lua_isnumber(L, -1)) {
+                style->fill_opacity = (int)lua_tonumber(L, -1);
+                if(style->fill_opacity < 0) {
+                    style->fill_opacity = 0;
+                } else if(style->fill_opacity > 100) {
+                    style->fill_opacity = 100;
+                }
+            }
+            break;
+        case VFRKEY_STROKE_OPACITY:
+            if(lua_isnumber(L, -1)) {
+                style->stroke_opacity = (int)lua_tonumber(L, -1);
+                if(style->stroke_opacity < 0) {
+                    style->stroke_opacity = 0;
+                } else if(style->stroke_opacity > 100) {
+                    style->stroke_opacity = 100;
+                }
+            }
+            break;
+        case VFRKEY_SIZE:
+            if(lua_isnumber(L, -1)) {
+                style->size = (int)lua_tonumber(L, -1);
+            }
+            break;
+        case VFRKEY_SIMPLIFY:
+            if(lua_isnumber(L, -1)) {
+                style->simplify = lua_tonumber(L, -1);
+                if(style->simplify < 0.0) {
+                    style->simplify = 0.0;
+                }
+            }
+            break;
+        case VFRKEY_SUBPIXEL:
+            if(lua_isstring(L, -1)) {
+                parse_subpx(lua_tostring(L, -1), &style->subpixel);
+            }
+            break;
+        case VFRKEY_LABEL_PLACE:
+            if(lua_isnumber(L, -1)) {
+                style->label_place = (int)lua_tonumber(L, -1);
+            }
+            break;
+        case VFRKEY_LABEL_FONTDESC:
+            if(lua_isstring(L, -1)) {
+                vfr_style_set_string(&style->label_fontdesc, lua_tostring(L, -1));
+            }
+            break;
+        case VFRKEY_LABEL_FIELD:
+            if(lua_isstring(L, -1)) {
+                vfr_style_set_string(&style->label_field, lua_tostring(L, -1));
+            }
+            break;
+        case VFRKEY_LABEL_TEXT:
+            if(lua_isstring(L, -1)) {
+                vfr_style_set_string(&style->label_text, lua_tostring(L, -1));
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_LABEL_FILL:
+            if(lua_istable(L, -1)) {
+                synch_style_color(L, keys, &style->label_fill);
+            }
+            break;
+        case VFRKEY_LABEL_OPACITY:
+            if(lua_isnumber(L, -1)) {
+                style->label_opacity = (int)lua_tonumber(L, -1);
+                if(style->label_opacity < 0) {
+                    style->label_opacity = 0;
+                } else if(style->label_opacity > 100) {
+                    style->label_opacity = 100;
+                }
+            }
+            break;
+        case VFRKEY_LABEL_WIDTH:
+            if(lua_isnumber(L, -1)) {
+                style->label_width = (int)lua_tonumber(L, -1);
+                if(style->label_width < 0) {
+                    style->label_opacity = 0;
+                }
+            }
+            break;
+        case VFRKEY_LABEL_XOFFSET:
+            if(lua_isnumber(L, -1)) {
+                style->label_xoffset = (int)lua_tonumber(L, -1);
+            }
+            break;
+        case VFRKEY_LABEL_YOFFSET:
+            if(lua_isnumber(L, -1)) {
+                style->label_yoffset = (int)lua_tonumber(L, -1);
+            }
+            break;
+        case VFRKEY_LABEL_ROTATE:
+            if(lua_isnumber(L, -1)) {
+                style->label_rotate = (int)lua_tonumber(L, -1);
+                style->label_rotate = fmod(style->label_rotate, 360.0);
+            }
+            break;
+        case VFRKEY_FILL_PATTERN:
+            if(lua_isstring(L, -1)) {
+                vfr_style_set_string(&style->hatch_pattern, lua_tostring(L, -1));
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_FILL_ROTATE:
+            if(lua_isnumber(L, -1)) {
+                style->hatch_rotate = lua_tonumber(L, -1)*(180.0/M_PI); // lua val is in degrees, make rads
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_FILL_SCALE:
+            if(lua_isnumber(L, -1)) {
+                style->hatch_scale = lua_tonumber(L, -1);
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_LABEL_HALO_FILL:
+            if(lua_istable(L, -1)) {
+                synch_style_color(L, keys, &style->label_halo_fill);
+            }
+            break;
+        case VFRKEY_LABEL_HALO_SIZE:
+            if(lua_isnumber(L, -1)) {
+                style->label_halo_size = lua_tonumber(L, -1);
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_LABEL_HALO:
+            if(lua_isstring(L, -1)) {
+                parse_halo(lua_tostring(L, -1), &style->label_halo);
+            }
+            break;
+        case VFRKEY_LABEL_PRIORITY:
+            if(lua_isnumber(L, -1)) {
+                style->label_priority = lua_tonumber(L, -1);
+                seen[id] = 1;
+            }
+            break;
+        case VFRKEY_LABEL_OVERLAP:
+            if(lua_isboolean(L, -1)) {
+                if(lua_toboolean(L, -1)) {
+                    style->label_flags |= VFRLABEL_OVRLAP;
+                } else {
+                    style->label_flags &= ~VFRLABEL_OVRLAP;
+                }
+            }
+            break;
+        default:
+            // not a style key
+            break;
+    }
+}
+
+// assumes a valid style table is pushed on the lua stack
+static int synch_style_table(lua_State *L, vfr_style_t *style) {
+
+    int keys, id;
+    unsigned char seen[VFRKEY_COUNT];
+
+    if(!lua_istable(L, -1)) {
+        fprintf(stderr, "style is not a valid lua table\n");
+        return -1;
+    }
+
+    memset(seen, 0, sizeof(seen));
+    lua_getfield(L, LUA_REGISTRYINDEX, VFRLUA_STYLE_KEYS);
+    keys = lua_gettop(L);
+
+    if(lua_getmetatable(L, keys-1)) {
+        // keys may be inherited (__index), so ask for each one
+        lua_pop(L, 1);
+        for(id=1; id<VFRKEY_CLASS; id++) {
+            lua_rawgeti(L, keys, id);
+            lua_gettable(L, keys-1);
+            synch_style_value(L, keys, id, style, seen);
+            lua_pop(L, 1);
+        }
+    } else {
+        // only the keys the table has are visited
+        lua_pushnil(L);
+        while(lua_next(L, keys-1)) {
+            id = 0;
+            if(lua_type(L, -2) == LUA_TSTRING) {
+                lua_pushvalue(L, -2);
+                lua_rawget(L, keys);
+                if(lua_type(L, -1) == LUA_TNUMBER) {
+                    id = (int)lua_tointeger(L, -1);
+                }
+                lua_pop(L, 1);
+            }
+            synch_style_value(L, keys, id, style, seen);
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+
+    // these reset when they're missing
+    if(!seen[VFRKEY_STROKE]) style->stroke = 0x01000000;
+    if(!seen[VFRKEY_FILL]) style->fill = 0x01000000;
+    if(!seen[VFRKEY_LABEL_TEXT]) vfr_style_set_string(&style->label_text, NULL);
+    if(!seen[VFRKEY_FILL_PATTERN]) vfr_style_set_string(&style->hatch_pattern, NULL);
+    if(!seen[VFRKEY_FILL_ROTATE]) style->hatch_rotate = 0.0;
+    if(!seen[VFRKEY_FILL_SCALE]) style->hatch_scale = 1.0;
+    if(!seen[VFRKEY_LABEL_HALO_SIZE]) style->label_halo_size = 1.0;
+    if(!seen[VFRKEY_LABEL_PRIORITY]) style->label_priority = 0.0;
+    return 0;
+}
+
+// reads a style table returned for a feature (at the top of the stack).
+// tables tagged _vfr_class are taken as fixed class styles: the first
+// time one is seen it's resolved against the default style and kept, and
+// after that the kept style is used w/o reading the table.
+static int lua_feature_style(lua_State *L, vfr_style_t *style) {
+    int i, isclass;
+    const void *tbl = lua_topointer(L, -1);
+    vfr_style_memos_t *m = &g_memos;
+    vfr_style_t resolved;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, VFRLUA_STYLE_KEYS);
+    lua_rawgeti(L, -1, VFRKEY_CLASS);
+    lua_rawget(L, -3);
+    isclass = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    if(!isclass) {
+        return synch_style_table(L, style);
+    }
+
+    if(m->last < m->n && m->entries[m->last].tbl == tbl) {
+        vfr_style_assign(style, &m->entries[m->last].style);
+        return 0;
+    }
+    for(i=0; i<m->n; i++) {
+        if(m->entries[i].tbl == tbl) {
+            m->last = i;
+            vfr_style_assign(style, &m->entries[i].style);
+            return 0;
+        }
+    }
+    vfr_style_copy(&resolved, &m->base);
+    synch_style_table(L, &resolved);
+    vfr_style_assign(style, &resolved);
+    if(m->n < VFRSTYLE_MEMO_MAX) {
+        // (the reference keeps the table, and so its address, alive)
+        lua_pushvalue(L, -1);
+        m->entries[m->n].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        m->entries[m->n].tbl = tbl;
+        m->entries[m->n].style = resolved;
+        m->last = m->n++;
+    } else {
+        vfr_style_free(&resolved);
+    }
+    return 0;
+}
+
+// forgets class styles (for a lua state that's going away). base, if not
+// NULL, is the default style class styles are resolved against from now on.
+static void clear_style_memos(vfr_style_t *base) {
+    int i;
+    vfr_style_memos_t *m = &g_memos;
+    for(i=0; i<m->n; i++) {
+        vfr_style_free(&m->entries[i].style);
+    }
+    m->n = m->last = 0;
+    vfr_style_free(&m->base);
+    if(base != NULL) {
+        vfr_style_copy(&m->base, base);
+    }
+}
+
+// reads a ramp (a table of style key = {from, to}) at the top of the
+// stack into r. only colors and plain numbers can be ramped.
+static int lua_compile_ramp(lua_State *L, int keys, vfr_rule_t *r) {
+    int id, i;
+    uint64_t color;
+    const char *name;
+    double *end;
+    vfr_ramp_t *ramp;
+
+    lua_pushnil(L);
+    while(lua_next(L, -2)) {
+        id = 0;
+        name = lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "?";
+        if(lua_type(L, -2) == LUA_TSTRING) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, keys);
+            if(lua_type(L, -1) == LUA_TNUMBER) {
+                id = (int)lua_tointeger(L, -1);
+            }
+            lua_pop(L, 1);
+        }
+        if(!strcmp(name, "min") || !strcmp(name, "max")) {
+            // the ramp's range
+            lua_pop(L, 1);
+            continue;
+        } else if(!VFRRAMP_COLOR(id) && !VFRRAMP_NUMBER(id)) {
+            fprintf(stderr, "vfr_rules: can't ramp '%s'\n", name);
+            lua_pop(L, 1);
+            continue;
+        }
+        if(!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if((r->ramps = realloc(r->ramps, (r->nramps+1)*sizeof(vfr_ramp_t))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        ramp = &r->ramps[r->nramps++];
+        ramp->key = id;
+        for(i=1; i<=2; i++) {
+            end = i == 1 ? ramp->from : ramp->to;
+            lua_rawgeti(L, -1, i);
+            if(VFRRAMP_COLOR(id) && lua_istable(L, -1)) {
+                color = 0;
+                synch_style_color(L, keys, &color);
+                end[0] = (color >> 16) & 0xff;
+                end[1] = (color >> 8) & 0xff;
+                end[2] = color & 0xff;
+            } else if(VFRRAMP_NUMBER(id) && lua_isnumber(L, -1)) {
+                end[0] = lua_tonumber(L, -1);
+            } else {
+                fprintf(stderr, "vfr_rules: bad ramp for '%s'\n", vfr_style_keys[id]);
+                r->nramps--;
+                lua_pop(L, 1);
+                break;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    return r->nramps;
+}
+
+// compiles the (optional) global vfr_rules into g_rules. each rule's
+// style is resolved against base once, here.
+static int lua_compile_rules(lua_State *L, vfr_style_t *base) {
+    vfr_rules_t *rs = &g_rules;
+    vfr_rule_t *r;
+    int i, keys;
+
+    clear_style_rules();
+    lua_getglobal(L, "vfr_rules");
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_getglobal(L, "vfrFeatureStyle");
+    lua_getglobal(L, "vfrFeatureStyleBatch");
+    rs->fallback = lua_isfunction(L, -1) || lua_isfunction(L, -2);
+    lua_pop(L, 2);
+    lua_getfield(L, LUA_REGISTRYINDEX, VFRLUA_STYLE_KEYS);
+    keys = lua_gettop(L);
+
+    for(i=1; ; i++) {
+        lua_rawgeti(L, keys-1, i);
+        if(lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+        }
+        if(!lua_istable(L, -1)) {
+            fprintf(stderr, "vfr_rules: rule %d is not a table\n", i);
+            lua_pop(L, 1);
+            continue;
+        }
+        if((rs->rules = realloc(rs->rules, (rs->n+1)*sizeof(vfr_rule_t))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        r = &rs->rules[rs->n++];
+        memset(r, 0, sizeof(vfr_rule_t));
+        r->fldidx = -1;
+        r->min = -HUGE_VAL;
+        r->max = HUGE_VAL;
+
+        lua_getfield(L, -1, "layer");
+        if(lua_isstring(L, -1)) r->layer = vfr_strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "field");
+        if(lua_isstring(L, -1)) r->field = vfr_strdup(lua_tostring(L, -1));
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "equals");
+        if(lua_type(L, -1) == LUA_TNUMBER) {
+            r->eqnum = lua_tonumber(L, -1);
+            r->numeric = 1;
+            r->haseq = 1;
+        } else if(lua_isstring(L, -1)) {
+            r->eqstr = vfr_strdup(lua_tostring(L, -1));
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "min");
+        if(lua_isnumber(L, -1)) {
+            r->min = lua_tonumber(L, -1);
+            r->numeric = 1;
+        }
+        lua_pop(L, 1);
+        lua_getfield(L, -1, "max");
+        if(lua_isnumber(L, -1)) {
+            r->max = lua_tonumber(L, -1);
+            r->numeric = 1;
+        }
+        lua_pop(L, 1);
+
+        vfr_style_copy(&r->style, base);
+        lua_getfield(L, -1, "style");
+        if(lua_istable(L, -1)) {
+            synch_style_table(L, &r->style);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, -1, "ramp");
+        if(lua_istable(L, -1)) {
+            r->rampmin = r->min;
+            r->rampmax = r->max;
+            lua_getfield(L, -1, "min");
+            if(lua_isnumber(L, -1)) r->rampmin = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+            lua_getfield(L, -1, "max");
+            if(lua_isnumber(L, -1)) r->rampmax = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+            if(r->field == NULL || isinf(r->rampmin) || isinf(r->rampmax) ||
+                    r->rampmin == r->rampmax) {
+                fprintf(stderr, "vfr_rules: rule %d: a ramp needs a field and a min and max\n", i);
+            } else if(lua_compile_ramp(L, keys, r)) {
+                r->numeric = 1;
+            }
+        }
+        lua_pop(L, 1);
+        if((r->eqstr != NULL || r->numeric) && r->field == NULL) {
+            fprintf(stderr, "vfr_rules: rule %d tests no field\n", i);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return rs->n;
+}
+
+// frees g_rules
+static void clear_style_rules(void) {
+    int i;
+    vfr_rules_t *rs = &g_rules;
+    for(i=0; i<rs->n; i++) {
+        free(rs->rules[i].layer);
+        free(rs->rules[i].field);
+        free(rs->rules[i].eqstr);
+        free(rs->rules[i].ramps);
+        vfr_style_free(&rs->rules[i].style);
+    }
+    free(rs->rules);
+    memset(rs, 0, sizeof(vfr_rules_t));
+}
+
+// finds out which rules apply to layer (and the indexes of their fields)
+static void vfr_rules_begin(OGRLayerH layer) {
+    OGRFeatureDefnH ldef = OGR_L_GetLayerDefn(layer);
+    vfr_rule_t *r;
+    int i;
+    for(i=0; i<g_rules.n; i++) {
+        r = &g_rules.rules[i];
+        r->active = r->layer == NULL || !strcmp(r->layer, OGR_L_GetName(layer));
+        r->fldidx = -1;
+        if(r->active && r->field != NULL) {
+            r->fldidx = OGR_FD_GetFieldIndex(ldef, r->field);
+            if(r->fldidx < 0) {
+                r->active = 0;
+            }
+        }
+    }
+}
+
+// reads field fldidx as a number (numeric strings too, like lua's tonumber).
+// returns 0 if it's not one.
+static int rule_field_number(OGRFeatureH ftr, int fldidx, double *val) {
+    const char *str;
+    char *end;
+    switch(OGR_Fld_GetType(OGR_F_GetFieldDefnRef(ftr, fldidx))) {
+        case OFTInteger:
+        case OFTInteger64:
+        case OFTReal:
+            *val = OGR_F_GetFieldAsDouble(ftr, fldidx);
+            return 1;
+        case OFTString:
+            str = OGR_F_GetFieldAsString(ftr, fldidx);
+            *val = strtod(str, &end);
+            if(end == str) return 0;
+            while(isspace((unsigned char)*end)) end++;
+            return *end == '\0';
+        default:
+            return 0;
+    }
+}
+
+// finds the first rule ftr matches (and the value of its field, for
+// ramps). returns NULL if there's none.
+static vfr_rule_t* vfr_rules_match(OGRFeatureH ftr, double *val) {
+    vfr_rule_t *r;
+    int i;
+
+    *val = 0.0;
+    for(i=0; i<g_rules.n; i++) {
+        r = &g_rules.rules[i];
+        if(!r->active) continue;
+        if(r->fldidx >= 0) {
+            if(!OGR_F_IsFieldSet(ftr, r->fldidx)) continue;
+            if(r->eqstr != NULL && strcmp(OGR_F_GetFieldAsString(ftr, r->fldidx), r->eqstr)) continue;
+            if(r->numeric) {
+                if(!rule_field_number(ftr, r->fldidx, val)) continue;
+                if(r->haseq && *val != r->eqnum) continue;
+                if(*val < r->min || *val >= r->max) continue;
+            }
+        }
+        return r;
+    }
+    return NULL;
+}
+
+// sets style to rule r's, w/ its ramps at val
+static void vfr_rule_style(vfr_rule_t *r, double val, vfr_style_t *style) {
+    vfr_ramp_t *ramp;
+    double p, c[3];
+    uint64_t *color;
+    int j, k;
+
+    vfr_style_assign(style, &r->style);
+    if(!r->nramps) return;
+    p = (val - r->rampmin)/(r->rampmax - r->rampmin);
+    p = p < 0.0 ? 0.0 : (p > 1.0 ? 1.0 : p);
+    for(j=0; j<r->nramps; j++) {
+        ramp = &r->ramps[j];
+        for(k=0; k<3; k++) {
+            c[k] = ramp->from[k] + p*(ramp->to[k] - ramp->from[k]);
+        }
+        color = NULL;
+        switch(ramp->key) {
+            case VFRKEY_STROKE:
+                color = &style->stroke;
+                break;
+            case VFRKEY_FILL:
+                color = &style->fill;
+                break;
+            case VFRKEY_LABEL_FILL:
+                color = &style->label_fill;
+                break;
+            case VFRKEY_LABEL_HALO_FILL:
+                color = &style->label_halo_fill;
+                break;
+            case VFRKEY_SIZE:
+                style->size = (int)c[0];
+                break;
+            case VFRKEY_FILL_OPACITY:
+                style->fill_opacity = (int)c[0];
+                break;
+            case VFRKEY_STROKE_OPACITY:
+                style->stroke_opacity = (int)c[0];
+                break;
+            case VFRKEY_LABEL_OPACITY:
+                style->label_opacity = (int)c[0];
+                break;
+            case VFRKEY_LABEL_HALO_SIZE:
+                style->label_halo_size = c[0];
+                break;
+        }
+        if(color != NULL) {
+            *color = (((int)c[0] << 16) & 0xff0000) | (((int)c[1] << 8) & 0x00ff00) |
+                ((int)c[2] & 0x0000ff);
+        }
+    }
+}
+
+// styles ftr w/ the first rule it matches. returns 0 if there's none
+// (and vfrFeatureStyle should be asked instead).
+static int vfr_rules_apply(OGRFeatureH ftr, vfr_style_t *style) {
+    vfr_rule_t *r;
+    double val;
+
+    if(!g_rules.n) return 0;
+    if((r = vfr_rules_match(ftr, &val)) != NULL) {
+        vfr_rule_style(r, val, style);
+        return 1;
+    }
+    if(!g_rules.fallback) {
+        // no vfrFeatureStyle to ask
+        vfr_style_assign(style, &g_memos.base);
+        return 1;
+    }
+    return 0;
+}
+
+// prints progress for the j'th of a layer's lfcount features
+static void vfr_progress(long j, int lfcount) {
+    if(j && !(j % 200)) {
+        fprintf(stderr, ".");
+        if(!(j % 10000)) {
+            fprintf(stderr, " (%ld/%d)\n", j, lfcount);
+        }
+    } else if(j == (lfcount-1)) {
+        fprintf(stderr, "done.\n");
+    }
+}
+
+// waits for slot to get to state (set by another stage)
+static void pipe_wait(vfr_ftrslot_t *slot, int state) {
+    long spins = 0;
+    while(__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != state) {
+        if(++spins < VFRPIPE_SPINS) {
+            continue;
+        } else if(spins < 16*VFRPIPE_SPINS) {
+            sched_yield();
+        } else {
+            // a stage that's this far behind won't catch up soon
+            usleep(100);
+        }
+    }
+}
+
+// hands slot on to the next stage
+static void pipe_post(vfr_ftrslot_t *slot, int state) {
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+}
+
+// starts the style threads of a render pipeline (see vfr_pipeline_t).
+// returns NULL if the pipeline can't be used.
+static vfr_pipeline_t* vfr_pipeline_start(lua_State *L, vfr_style_t *style, vfr_render_opts_t *opts) {
+    vfr_pipeline_t *pipe;
+    int i, nstylers = 0, hasfn = 0;
+
+    if(L != NULL) {
+        lua_getglobal(L, "vfrFeatureStyle");
+        lua_getglobal(L, "vfrFeatureStyleBatch");
+        hasfn = lua_isfunction(L, -2);
+        if(!hasfn && lua_isfunction(L, -1)) {
+            lua_pop(L, 2);
+            fprintf(stderr, "vfrFeatureStyleBatch is not used by style threads (rendering w/o -threads)\n");
+            return NULL;
+        }
+        lua_pop(L, 2);
+        if(hasfn || g_rules.n) {
+            nstylers = opts->threads > 3 ? opts->threads-2 : 1;
+        }
+    }
+
+    if((pipe = calloc(1, sizeof(vfr_pipeline_t))) == NULL ||
+            (pipe->slots = calloc(VFRPIPE_SLOTS, sizeof(vfr_ftrslot_t))) == NULL ||
+            (nstylers && (pipe->stylers = malloc(nstylers*sizeof(pthread_t))) == NULL)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    pipe->luafilenm = opts->luafilenm;
+    pipe->base = style;
+    for(i=0; i<nstylers; i++) {
+        if(pthread_create(&pipe->stylers[i], NULL, pipe_styler, pipe)) {
+            fprintf(stderr, "could not start style thread\n");
+            break;
+        }
+    }
+    pipe->nstylers = i;
+    if(nstylers && !pipe->nstylers) {
+        free(pipe->stylers);
+        free(pipe->slots);
+        free(pipe);
+        return NULL;
+    } else if(pipe->nstylers < nstylers) {
+        fprintf(stderr, "using %d style thread(s)\n", pipe->nstylers);
+    }
+    // threads take every nstylers'th feature, so they wait until it's
+    // known how many there are
+    __atomic_store_n(&pipe->ready, 1, __ATOMIC_RELEASE);
+    // (and a style that doesn't load fails the render)
+    while(__atomic_load_n(&pipe->loaded, __ATOMIC_ACQUIRE) < pipe->nstylers) {
+        sched_yield();
+    }
+    return pipe;
+}
+
+// stops the style threads and frees the pipeline
+static void vfr_pipeline_stop(vfr_pipeline_t *pipe) {
+    vfr_ftrslot_t *slot;
+    int i;
+
+    // one quit marker for each style thread
+    for(i=0; i<pipe->nstylers; i++) {
+        slot = &pipe->slots[pipe->head++ % VFRPIPE_SLOTS];
+        pipe_wait(slot, VFRSLOT_FREE);
+        slot->ftr = NULL;
+        slot->layer = NULL;
+        pipe_post(slot, VFRSLOT_READ);
+    }
+    for(i=0; i<pipe->nstylers; i++) {
+        pthread_join(pipe->stylers[i], NULL);
+    }
+    for(i=0; i<VFRPIPE_SLOTS; i++) {
+        vfr_style_free(&pipe->slots[i].style);
+    }
+    free(pipe->stylers);
+    free(pipe->slots);
+    free(pipe);
+}
+
+// reads the features of pipe->layer that have geometries into slots,
+// in order, then an end of layer marker
+static void* pipe_reader(void *arg) {
+    vfr_pipeline_t *pipe = arg;
+    vfr_ftrslot_t *slot;
+    OGRFeatureH ftr;
+
+    while(1) {
+        ftr = vfr_next_feature(pipe->layer, pipe->cl);
+        if(ftr != NULL && OGR_F_GetGeometryRef(ftr) == NULL) {
+            if(!pipe->quiet) fprintf(stderr, "skipping null geometry w/ fid = %ld\n",
+                (long)OGR_F_GetFID(ftr));
+            OGR_F_Destroy(ftr);
+            continue;
+        }
+        slot = &pipe->slots[pipe->head++ % VFRPIPE_SLOTS];
+        pipe_wait(slot, VFRSLOT_FREE);
+        slot->ftr = ftr;
+        slot->layer = pipe->layer;
+        slot->fldmask = pipe->fldmask;
+        // w/o style threads, features go straight to be drawn
+        pipe_post(slot, pipe->nstylers ? VFRSLOT_READ : VFRSLOT_STYLED);
+        if(ftr == NULL) break;
+    }
+    return NULL;
+}
+
+// styles every nstylers'th slot w/ its own lua state, until it gets a
+// quit marker
+static void* pipe_styler(void *arg) {
+    vfr_pipeline_t *pipe = arg;
+    vfr_ftrslot_t *slot;
+    OGRLayerH layer = NULL;
+    lua_State *L;
+    vfr_style_t wstyle;
+    long seq;
+
+    seq = __atomic_fetch_add(&pipe->started, 1, __ATOMIC_RELAXED);
+    vfr_style_copy(&wstyle, pipe->base);
+    L = vfr_lua_load(pipe->luafilenm, &wstyle);
+    if(L == NULL) {
+        __atomic_store_n(&pipe->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&pipe->loaded, 1, __ATOMIC_RELEASE);
+    while(!__atomic_load_n(&pipe->ready, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+
+    for(; ; seq += pipe->nstylers) {
+        slot = &pipe->slots[seq % VFRPIPE_SLOTS];
+        pipe_wait(slot, VFRSLOT_READ);
+        if(slot->layer == NULL) break;
+        if(slot->ftr != NULL && L != NULL) {
+            if(slot->layer != layer) {
+                layer = slot->layer;
+                vfr_rules_begin(layer);
+                lua_feature_begin(L);
+            }
+            if(pipe->nstylers > 1) {
+                // other threads style the features in between, so
+                // each feature starts from the default style
+                vfr_style_assign(&wstyle, &g_memos.base);
+            }
+            if(!vfr_rules_apply(slot->ftr, &wstyle)) {
+                eval_feature_style(L, slot->ftr, &wstyle, slot->fldmask);
+            }
+        }
+        if(slot->ftr != NULL) {
+            vfr_style_assign(&slot->style, &wstyle);
+        }
+        pipe_post(slot, VFRSLOT_STYLED);
+    }
+
+    if(L != NULL) {
+        clear_style_memos(NULL);
+        clear_style_rules();
+        lua_close(L);
+    }
+    vfr_style_free(&wstyle);
+    return NULL;
+}
+
+// renders layer through the pipeline: a reader thread reads features,
+// the style threads style them and they're drawn here, in the order they
+// were read. returns the number of features drawn or -1 on error.
+static long vfr_pipeline_layer(vfr_pipeline_t *pipe, OGRLayerH layer, const char *fldmask,
+        cairo_t *cr, cairo_t *lcr, OGREnvelope *ext, double pxw, double pxh,
+        vfr_style_t *style, int lfcount, int quiet) {
+    vfr_ftrslot_t *slot;
+    vfr_style_t *fstyle;
+    OGRGeometryH geom;
+    long j = 0;
+
+    pipe->layer = layer;
+    pipe->cl = cache_layer(layer);
+    pipe->fldmask = fldmask;
+    pipe->quiet = quiet;
+    if(pthread_create(&pipe->reader, NULL, pipe_reader, pipe)) {
+        fprintf(stderr, "could not start reader thread\n");
+        return -1;
+    }
+    while(1) {
+        slot = &pipe->slots[pipe->tail++ % VFRPIPE_SLOTS];
+        pipe_wait(slot, VFRSLOT_STYLED);
+        if(slot->ftr == NULL) {
+            pipe_post(slot, VFRSLOT_FREE);
+            break;
+        }
+        fstyle = pipe->nstylers ? &slot->style : style;
+        if(!quiet) vfr_progress(j, lfcount);
+        geom = OGR_F_GetGeometryRef(slot->ftr);
+        if(cr != NULL) vfr_draw_geom(cr, slot->ftr, geom, ext, pxw, pxh, fstyle);
+        if(lcr != NULL) vfr_queue_label(lcr, slot->ftr, geom, ext, pxw, pxh, fstyle);
+        OGR_F_Destroy(slot->ftr);
+        slot->ftr = NULL;
+        pipe_post(slot, VFRSLOT_FREE);
+        j++;
+    }
+    // (the reader's done w/ pipe->head once it's joined)
+    pthread_join(pipe->reader, NULL);
+    return j;
+}
+
+// tiles are cut in web mercator meters, so every layer has to be in it.
+// returns 0 if they are (layers w/o a srs are assumed to be), else -1.
+static int vfr_ds_mercator(OGRDataSourceH *ds) {
+    int i, same;
+    int layercount = OGR_DS_GetLayerCount(ds);
+    OGRLayerH layer;
+    OGRSpatialReferenceH srs, merc;
+    const char *code;
+
+    merc = OSRNewSpatialReference(NULL);
+    if(merc == NULL || OSRImportFromEPSG(merc, 3857) != OGRERR_NONE) {
+        fprintf(stderr, "could not load EPSG:3857: %s\n", CPLGetLastErrorMsg());
+        if(merc != NULL) OSRDestroySpatialReference(merc);
+        return -1;
+    }
+    for(i=0; i<layercount; i++) {
+        layer = OGR_DS_GetLayer(ds, i);
+        if((srs = OGR_L_GetSpatialRef(layer)) == NULL) {
+            fprintf(stderr, "warning: layer %s has no srs, assuming EPSG:3857\n",
+                OGR_L_GetName(layer));
+            continue;
+        }
+        // (old files name it by the unofficial codes)
+        code = OSRGetAuthorityCode(srs, NULL);
+        same = code != NULL && (!strcmp(code, "3857") || !strcmp(code, "900913") ||
+            !strcmp(code, "3785") || !strcmp(code, "102100"));
+        if(!same && !OSRIsSame(srs, merc)) {
+            fprintf(stderr, "layer %s isn't in EPSG:3857 (web mercator), "
+                "reproject it first (ogr2ogr -t_srs EPSG:3857)\n", OGR_L_GetName(layer));
+            OSRDestroySpatialReference(merc);
+            return -1;
+        }
+    }
+    OSRDestroySpatialReference(merc);
+    return 0;
+}
+
+static int vfr_ds_extent(OGRDataSourceH *ds, OGREnvelope *ext) {
+    int i;
+    int layercount = OGR_DS_GetLayerCount(ds);
+    OGRLayerH layer;
+    vfr_cachelayer_t *cl;
+    OGREnvelope lext = {};
+    for(i=0; i<layercount; i++) {
+        layer = OGR_DS_GetLayer(ds, i);
+        if((cl = cache_layer(layer)) != NULL) {
+            // (stored when the cache was built)
+            lext.MinX = cl->hdr->ext[0];
+            lext.MinY = cl->hdr->ext[1];
+            lext.MaxX = cl->hdr->ext[2];
+            lext.MaxY = cl->hdr->ext[3];
+        } else {
+            OGR_L_GetExtent(layer, &lext, 1); // arg 3 is bForce (exp. but nec.)
+        }
+        if(i == 0 || lext.MinX < ext->MinX) {
+            ext->MinX = lext.MinX;
+        }
+        if(i == 0 || lext.MinY < ext->MinY) {
+            ext->MinY = lext.MinY;
+        }
+        if(i == 0 || lext.MaxX > ext->MaxX) {
+            ext->MaxX = lext.MaxX;
+        }
+        if(i == 0 || lext.MaxY > ext->MaxY) {
+            ext->MaxY = lext.MaxY;
+        }
+    }
+    return 0;
+}
+
+// opens datpath w/ OGR or, if it's a cache file (see runcache), maps it
+static OGRDataSourceH vfr_open(const char *datpath) {
+    char magic[sizeof(VFRCACHE_MAGIC)-1];
+    vfr_cache_t *cache;
+    FILE *fp;
+    size_t n = 0;
+
+    if((fp = fopen(datpath, "rb")) != NULL) {
+        n = fread(magic, 1, sizeof(magic), fp);
+        fclose(fp);
+    }
+    if(n < sizeof(magic) || memcmp(magic, VFRCACHE_MAGIC, sizeof(magic))) {
+        return OGROpen(datpath, FALSE, NULL);
+    }
+    if((cache = cache_open(datpath)) == NULL) {
+        return NULL;
+    }
+    cache->next = g_cache;
+    g_cache = cache;
+    return cache->src;
+}
+
+// closes a datasource from vfr_open
+static void vfr_close(OGRDataSourceH src) {
+    vfr_cache_t **cp, *cache;
+    for(cp = &g_cache; *cp != NULL; cp = &(*cp)->next) {
+        if((*cp)->src == src) {
+            cache = *cp;
+            *cp = cache->next;
+            cache_close(cache);
+            return;
+        }
+    }
+    OGR_DS_Destroy(src);
+}
+
+// the cache layer read through layer, or NULL if layer's an OGR one
+static vfr_cachelayer_t* cache_layer(OGRLayerH layer) {
+    vfr_cache_t *cache;
+    int i;
+    for(cache = g_cache; cache != NULL; cache = cache->next) {
+        for(i=0; i<cache->nlayers; i++) {
+            if(cache->layers[i].layer == layer) return &cache->layers[i];
+        }
+    }
+    return NULL;
+}
+
+// reads the next feature of layer, or of its cache layer cl
+static OGRFeatureH vfr_next_feature(OGRLayerH layer, vfr_cachelayer_t *cl) {
+    if(cl == NULL) {
+        return OGR_L_GetNextFeature(layer);
+    }
+    while(cl->next < cl->hdr->nftrs) {
+        if(!cache_skip(cl, cl->next)) {
+            return cache_feature(cl, cl->next++);
+        }
+        cl->next++;
+    }
+    return NULL;
+}
+
+// is feature i outside cl's filter?
+static int cache_skip(vfr_cachelayer_t *cl, uint32_t i) {
+    const double *o = cl->hdr->origin, *sc = cl->hdr->scale;
+    const uint32_t *b = &cl->bboxes[4*i];
+    if(!cl->filtered) return 0;
+    if(!cl->gtypes[i]) return 1;
+    return o[0] + b[0]*sc[0] > cl->filter.MaxX || o[0] + b[2]*sc[0] < cl->filter.MinX ||
+        o[1] + b[1]*sc[1] > cl->filter.MaxY || o[1] + b[3]*sc[1] < cl->filter.MinY;
+}
+
+// counts the features of cl that pass its filter
+static int cache_count(vfr_cachelayer_t *cl) {
+    uint32_t i;
+    int n = 0;
+    if(!cl->filtered) return cl->hdr->nftrs;
+    for(i=0; i<cl->hdr->nftrs; i++) {
+        if(!cache_skip(cl, i)) n++;
+    }
+    return n;
+}
+
+// makes feature i of cl, w/ the fields that aren't ignored on its layer
+static OGRFeatureH cache_feature(vfr_cachelayer_t *cl, uint32_t i) {
+    OGRFeatureDefnH ldef = OGR_L_GetLayerDefn(cl->layer);
+    OGRFeatureH ftr;
+    OGRGeometryH geom = NULL, part;
+    vfr_cachecol_t *col;
+    uint32_t p, p0 = cl->ftrparts[i], p1 = cl->ftrparts[i+1];
+    uint32_t off;
+    int k, type = cl->gtypes[i];
+
+    if((ftr = OGR_F_Create(ldef)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    OGR_F_SetFID(ftr, cl->fids[i]);
+    for(k=0; k<(int)cl->hdr->nfields; k++) {
+        col = &cl->cols[k];
+        if((col->nulls[i >> 3] & (1 << (i & 7))) ||
+                OGR_Fld_IsIgnored(OGR_FD_GetFieldDefn(ldef, k))) {
+            continue;
+        }
+        switch(col->type) {
+            case OFTInteger:
+                OGR_F_SetFieldInteger(ftr, k, ((const int32_t*)col->data)[i]);
+                break;
+            case OFTInteger64:
+                OGR_F_SetFieldInteger64(ftr, k, ((const int64_t*)col->data)[i]);
+                break;
+            case OFTReal:
+                OGR_F_SetFieldDouble(ftr, k, ((const double*)col->data)[i]);
+                break;
+            default:
+                off = ((const uint32_t*)col->data)[i];
+                if(off < col->strslen) OGR_F_SetFieldString(ftr, k, col->strs + off);
+                break;
+        }
+    }
+
+    if(!type || p0 > p1 || p1 > cl->hdr->nparts) {
+        return ftr;
+    }
+    if(type == wkbPoint || type == wkbLineString || type == wkbPolygon) {
+        geom = p1 > p0 ? cache_part(cl, p0) : OGR_G_CreateGeometry(type);
+    } else if((geom = OGR_G_CreateGeometry(type)) != NULL) {
+        for(p=p0; p<p1; p++) {
+            if((part = cache_part(cl, p)) == NULL) continue;
+            if(OGR_G_AddGeometryDirectly(geom, part) != OGRERR_NONE) {
+                OGR_G_DestroyGeometry(part);
+            }
+        }
+    }
+    if(geom != NULL) {
+        OGR_F_SetGeometryDirectly(ftr, geom);
+    }
+    return ftr;
+}
+
+// makes a point, line or polygon from part of cl
+static OGRGeometryH cache_part(vfr_cachelayer_t *cl, uint32_t part) {
+    OGRGeometryH geom, ring;
+    uint32_t r, r0 = cl->partrings[part], r1 = cl->partrings[part+1];
+    int type = cl->parttypes[part];
+
+    if(r0 >= r1 || r1 > cl->hdr->nrings) return NULL;
+    switch(type) {
+        case wkbPoint:
+        case wkbLineString:
+            geom = OGR_G_CreateGeometry(type);
+            cache_points(cl, geom, r0);
+            break;
+        case wkbPolygon:
+            geom = OGR_G_CreateGeometry(wkbPolygon);
+            for(r=r0; r<r1; r++) {
+                ring = OGR_G_CreateGeometry(wkbLinearRing);
+                cache_points(cl, ring, r);
+                OGR_G_AddGeometryDirectly(geom, ring);
+            }
+            break;
+        default:
+            return NULL;
+    }
+    return geom;
+}
+
+// sets the points of geom to those of ring in cl
+static void cache_points(vfr_cachelayer_t *cl, OGRGeometryH geom, uint32_t ring) {
+    vfr_cache_t *cache = cl->cache;
+    const double *o = cl->hdr->origin, *sc = cl->hdr->scale;
+    const uint32_t *q;
+    uint32_t i, n, p0 = cl->ringpts[ring], p1 = cl->ringpts[ring+1];
+
+    if(p0 >= p1 || p1 > cl->hdr->npts) return;
+    n = p1 - p0;
+    if(n > cache->xycap) {
+        cache->xycap = n > cache->xycap*2 ? n : cache->xycap*2;
+        cache->xy = realloc(cache->xy, 2*(size_t)cache->xycap*sizeof(double));
+        if(cache->xy == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    q = &cl->pts[2*(size_t)p0];
+    for(i=0; i<2*n; i+=2) {
+        cache->xy[i] = o[0] + q[i]*sc[0];
+        cache->xy[i+1] = o[1] + q[i+1]*sc[1];
+    }
+    if(wkbFlatten(OGR_G_GetGeometryType(geom)) == wkbPoint) {
+        OGR_G_SetPoint_2D(geom, 0, cache->xy[0], cache->xy[1]);
+    } else {
+        OGR_G_SetPoints(geom, n, cache->xy, 2*sizeof(double),
+            cache->xy + 1, 2*sizeof(double), NULL, 0);
+    }
+}
+
+// maps the cache file at path. errors are reported through CPLError,
+// like OGROpen's.
+static vfr_cache_t* cache_open(const char *path) {
+    vfr_cache_t *cache;
+    struct stat st;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+        CPLError(CE_Failure, CPLE_OpenFailed, "%s: %s", path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    if((cache = calloc(1, sizeof(vfr_cache_t))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    cache->size = st.st_size;
+    cache->base = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(cache->base == MAP_FAILED) {
+        CPLError(CE_Failure, CPLE_OpenFailed, "%s: %s", path, strerror(errno));
+        cache->base = NULL;
+        cache_close(cache);
+        return NULL;
+    }
+    if(cache_map(cache, path)) {
+        CPLError(CE_Failure, CPLE_OpenFailed,
+            "%s is truncated or was built by another version of vfr (rebuild it)", path);
+        cache_close(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// checks the mapped cache's header and sets up its layers
+static int cache_map(vfr_cache_t *cache, const char *path) {
+    const vfr_cache_hdr_t *hdr = (const vfr_cache_hdr_t*)cache->base;
+    const vfr_cache_lhdr_t *lhdrs;
+    OGRSFDriverH drvr;
+    int i;
+
+    if(cache->size < sizeof(vfr_cache_hdr_t) || hdr->version != VFRCACHE_VERSION ||
+            hdr->byteorder != VFRCACHE_BYTEORDER || hdr->size != cache->size) {
+        return -1;
+    }
+    if((lhdrs = cache_section(cache, hdr->layers, hdr->nlayers,
+            sizeof(vfr_cache_lhdr_t))) == NULL) {
+        return -1;
+    }
+    if((drvr = OGRGetDriverByName("Memory")) == NULL &&
+            (drvr = OGRGetDriverByName("MEM")) == NULL) {
+        return -1;
+    }
+    if((cache->src = OGR_Dr_CreateDataSource(drvr, path, NULL)) == NULL) {
+        return -1;
+    }
+    cache->layers = calloc(hdr->nlayers ? hdr->nlayers : 1, sizeof(vfr_cachelayer_t));
+    if(cache->layers == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(i=0; i<(int)hdr->nlayers; i++) {
+        cache->nlayers++;
+        if(cache_map_layer(cache, &cache->layers[i], &lhdrs[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// points the arrays of cl at the mapped layer lh and makes its memory layer
+static int cache_map_layer(vfr_cache_t *cache, vfr_cachelayer_t *cl,
+        const vfr_cache_lhdr_t *lh) {
+    const vfr_cache_field_t *fields;
+    const uint32_t *offs;
+    const char *name, *wkt, *fldnm;
+    OGRSpatialReferenceH srs = NULL;
+    OGRFieldDefnH fld;
+    vfr_cachecol_t *col;
+    OGRErr err;
+    uint64_t n = lh->nftrs;
+    int k;
+
+    cl->cache = cache;
+    cl->hdr = lh;
+    cl->fids = cache_section(cache, lh->fids, n, sizeof(int64_t));
+    cl->bboxes = cache_section(cache, lh->bboxes, 4*n, sizeof(uint32_t));
+    cl->gtypes = cache_section(cache, lh->gtypes, n, 1);
+    cl->ftrparts = cache_section(cache, lh->ftrparts, n+1, sizeof(uint32_t));
+    cl->parttypes = cache_section(cache, lh->parttypes, lh->nparts, 1);
+    cl->partrings = cache_section(cache, lh->partrings, (uint64_t)lh->nparts+1, sizeof(uint32_t));
+    cl->ringpts = cache_section(cache, lh->ringpts, (uint64_t)lh->nrings+1, sizeof(uint32_t));
+    cl->pts = cache_section(cache, lh->pts, 2*(uint64_t)lh->npts, sizeof(uint32_t));
+    fields = cache_section(cache, lh->fields, lh->nfields, sizeof(vfr_cache_field_t));
+    if((name = cache_string(cache, lh->name)) == NULL || cl->fids == NULL ||
+            cl->bboxes == NULL || cl->gtypes == NULL || cl->ftrparts == NULL ||
+            cl->parttypes == NULL || cl->partrings == NULL || cl->ringpts == NULL ||
+            cl->pts == NULL || fields == NULL) {
+        return -1;
+    }
+    // (the offsets are checked as features are read)
+    if(cl->ftrparts[n] != lh->nparts || cl->partrings[lh->nparts] != lh->nrings ||
+            cl->ringpts[lh->nrings] != lh->npts) {
+        return -1;
+    }
+
+    if(lh->srs && (wkt = cache_string(cache, lh->srs)) != NULL) {
+        srs = OSRNewSpatialReference(wkt);
+    }
+    cl->layer = OGR_DS_CreateLayer(cache->src, name, srs, lh->geomtype, NULL);
+    if(srs != NULL) OSRRelease(srs);
+    if(cl->layer == NULL) return -1;
+
+    if((cl->cols = calloc(lh->nfields ? lh->nfields : 1, sizeof(vfr_cachecol_t))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(k=0; k<(int)lh->nfields; k++) {
+        col = &cl->cols[k];
+        col->type = fields[k].type;
+        col->nulls = cache_section(cache, fields[k].nulls, (n+7)/8, 1);
+        switch(col->type) {
+            case OFTInteger:
+                col->data = cache_section(cache, fields[k].data, n, sizeof(int32_t));
+                break;
+            case OFTInteger64:
+                col->data = cache_section(cache, fields[k].data, n, sizeof(int64_t));
+                break;
+            case OFTReal:
+                col->data = cache_section(cache, fields[k].data, n, sizeof(double));
+                break;
+            case OFTString:
+                if((offs = col->data = cache_section(cache, fields[k].data, n+1,
+                        sizeof(uint32_t))) == NULL) {
+                    return -1;
+                }
+                col->strslen = offs[n];
+                col->strs = cache_section(cache, fields[k].strs, col->strslen, 1);
+                // every string ends in the section
+                if(col->strs == NULL || (col->strslen && col->strs[col->strslen-1])) {
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+        if((fldnm = cache_string(cache, fields[k].name)) == NULL || col->nulls == NULL ||
+                col->data == NULL) {
+            return -1;
+        }
+        fld = OGR_Fld_Create(fldnm, col->type);
+        err = OGR_L_CreateField(cl->layer, fld, TRUE);
+        OGR_Fld_Destroy(fld);
+        if(err != OGRERR_NONE) return -1;
+    }
+    return 0;
+}
+
+// the n items of size bytes at off in cache, or NULL if they're not
+// (aligned and) all in the file
+static const void* cache_section(vfr_cache_t *cache, uint64_t off, uint64_t n, size_t size) {
+    if(off % 8 || off > cache->size || n > (cache->size - off)/size) {
+        return NULL;
+    }
+    return cache->base + off;
+}
+
+// the nul terminated string at off in cache, or NULL if it runs off the end
+static const char* cache_string(vfr_cache_t *cache, uint64_t off) {
+    if(off >= cache->size || memchr(cache->base + off, 0, cache->size - off) == NULL) {
+        return NULL;
+    }
+    return (const char*)cache->base + off;
+}
+
+static void cache_close(vfr_cache_t *cache) {
+    int i;
+    // (the memory datasource's layers go w/ it)
+    if(cache->src != NULL) OGR_DS_Destroy(cache->src);
+    for(i=0; i<cache->nlayers; i++) {
+        free(cache->layers[i].cols);
+    }
+    free(cache->layers);
+    if(cache->base != NULL) munmap(cache->base, cache->size);
+    free(cache->xy);
+    free(cache);
+}
+
+// cache build [-where expr] datasrc cachefile: writes the layers of
+// datasrc to a file render can map and read w/o going through an OGR
+// driver (or scanning the layers for their extents)
+static int runcache(int argc, char **argv) {
+    const char *where = NULL, *datpath = NULL, *cachefilenm = NULL;
+    OGRDataSourceH src;
+    OGRLayerH layer;
+    vfr_cache_hdr_t hdr;
+    vfr_cache_lhdr_t *lhdrs;
+    FILE *fp;
+    char *tmpfilenm;
+    uint64_t pos = 0, off;
+    int i, nlayers, rv = 0;
+
+    if(argc < 3 || strcmp(argv[2], "build")) {
+        usage();
+        return 1;
+    }
+    for(i=3; i<argc; i++) {
+        if(!strcmp(argv[i], "-where")) {
+            if(++i >= argc) {
+                usage();
+                return 1;
+            }
+            where = argv[i];
+        } else if(datpath == NULL) {
+            datpath = argv[i];
+        } else if(cachefilenm == NULL) {
+            cachefilenm = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if(cachefilenm == NULL) {
+        usage();
+        return 1;
+    }
+
+    if((src = OGROpen(datpath, FALSE, NULL)) == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", datpath, CPLGetLastErrorMsg());
+        return 1;
+    }
+    // written alongside, then moved into place
+    if((tmpfilenm = malloc(strlen(cachefilenm) + 5)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    sprintf(tmpfilenm, "%s.tmp", cachefilenm);
+    if((fp = fopen(tmpfilenm, "wb")) == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", tmpfilenm, strerror(errno));
+        free(tmpfilenm);
+        OGR_DS_Destroy(src);
+        return 1;
+    }
+
+    // the header's filled in last, so a partial file isn't a cache
+    memset(&hdr, 0, sizeof(hdr));
+    nlayers = OGR_DS_GetLayerCount(src);
+    if((lhdrs = calloc(nlayers ? nlayers : 1, sizeof(vfr_cache_lhdr_t))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    rv = cache_write(fp, &pos, &hdr, sizeof(hdr), &off);
+    for(i=0; !rv && i<nlayers; i++) {
+        layer = OGR_DS_GetLayer(src, i);
+        if(where != NULL && OGR_L_SetAttributeFilter(layer, where) != OGRERR_NONE) {
+            fprintf(stderr, "invalid attribute filter for layer \"%s\": %s\n",
+                OGR_L_GetName(layer), CPLGetLastErrorMsg());
+            rv = 1;
+            break;
+        }
+        rv = cache_build_layer(fp, &pos, layer, &lhdrs[i]);
+    }
+    if(!rv) {
+        rv = cache_write(fp, &pos, lhdrs, nlayers*sizeof(vfr_cache_lhdr_t), &hdr.layers);
+    }
+    if(!rv) {
+        memcpy(hdr.magic, VFRCACHE_MAGIC, sizeof(hdr.magic));
+        hdr.version = VFRCACHE_VERSION;
+        hdr.byteorder = VFRCACHE_BYTEORDER;
+        hdr.size = pos;
+        hdr.nlayers = nlayers;
+        if(fseek(fp, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+            rv = -1;
+        }
+    }
+    if(fclose(fp) && !rv) {
+        rv = -1;
+    }
+    if(rv < 0) {
+        fprintf(stderr, "could not write %s: %s\n", tmpfilenm, strerror(errno));
+    } else if(!rv && rename(tmpfilenm, cachefilenm)) {
+        fprintf(stderr, "could not write %s: %s\n", cachefilenm, strerror(errno));
+        rv = 1;
+    }
+    if(rv) {
+        unlink(tmpfilenm);
+    } else {
+        fprintf(stderr, "wrote %s (%d layer(s), %" PRIu64 " bytes)\n", cachefilenm,
+            nlayers, pos);
+    }
+    free(lhdrs);
+    free(tmpfilenm);
+    OGR_DS_Destroy(src);
+    return rv ? 1 : 0;
+}
+
+// writes layer's features, fields and header (lh) to fp, at pos
+static int cache_build_layer(FILE *fp, uint64_t *pos, OGRLayerH layer, vfr_cache_lhdr_t *lh) {
+    OGRFeatureDefnH ldef = OGR_L_GetLayerDefn(layer);
+    OGRSpatialReferenceH srs = OGR_L_GetSpatialRef(layer);
+    OGRFeatureH ftr;
+    OGRGeometryH geom, lgeom;
+    OGRFieldType ftype;
+    OGRwkbGeometryType type;
+    OGREnvelope ext = {};
+    vfr_cachebuild_t cb;
+    vfr_cache_field_t *fields;
+    const char *name = OGR_L_GetName(layer), *str;
+    char *wkt = NULL;
+    size_t nparts, nrings, nbuf;
+    uint32_t u32, bbox[4] = {UINT32_MAX, UINT32_MAX, 0, 0};
+    unsigned char gtype, *nulls;
+    int64_t i64;
+    int32_t i32;
+    double dval;
+    int k, set, rv = 0, unsupported = 0;
+
+    memset(&cb, 0, sizeof(cb));
+    memset(lh, 0, sizeof(*lh));
+    cb.nfields = OGR_FD_GetFieldCount(ldef);
+    cb.types = calloc(cb.nfields + 1, sizeof(int));
+    cb.nulls = calloc(cb.nfields + 1, sizeof(vfr_buf_t));
+    cb.data = calloc(cb.nfields + 1, sizeof(vfr_buf_t));
+    cb.strs = calloc(cb.nfields + 1, sizeof(vfr_buf_t));
+    fields = calloc(cb.nfields + 1, sizeof(vfr_cache_field_t));
+    if(cb.types == NULL || cb.nulls == NULL || cb.data == NULL || cb.strs == NULL ||
+            fields == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    // dates, lists, etc. are kept as the strings OGR makes of them
+    for(k=0; k<cb.nfields; k++) {
+        ftype = OGR_Fld_GetType(OGR_FD_GetFieldDefn(ldef, k));
+        cb.types[k] = ftype == OFTInteger || ftype == OFTInteger64 || ftype == OFTReal ?
+            ftype : OFTString;
+    }
+
+    // coordinates are quantised across the layer's extent
+    if(OGR_L_GetExtent(layer, &ext, 1) != OGRERR_NONE) {
+        memset(&ext, 0, sizeof(ext));
+    }
+    cb.origin[0] = ext.MinX;
+    cb.origin[1] = ext.MinY;
+    cb.scale[0] = (ext.MaxX - ext.MinX)/VFRCACHE_QMAX;
+    cb.scale[1] = (ext.MaxY - ext.MinY)/VFRCACHE_QMAX;
+    if(!(cb.scale[0] > 0)) cb.scale[0] = 1;
+    if(!(cb.scale[1] > 0)) cb.scale[1] = 1;
+
+    OGR_L_ResetReading(layer);
+    while((ftr = OGR_L_GetNextFeature(layer)) != NULL) {
+        i64 = OGR_F_GetFID(ftr);
+        buf_add(&cb.fids, &i64, sizeof(i64));
+        u32 = cb.parttypes.n;
+        buf_add(&cb.ftrparts, &u32, sizeof(u32));
+        cb.bbox[0] = cb.bbox[1] = UINT32_MAX;
+        cb.bbox[2] = cb.bbox[3] = 0;
+        gtype = 0;
+        if((geom = OGR_F_GetGeometryRef(ftr)) != NULL) {
+            nparts = cb.parttypes.n;
+            nrings = cb.ringpts.n;
+            nbuf = cb.pts.n;
+            // curves are cached as the lines they'd be drawn w/
+            lgeom = NULL;
+            if(OGR_G_HasCurveGeometry(geom, 0)) {
+                geom = lgeom = OGR_G_GetLinearGeometry(geom, 0.0, NULL);
+            }
+            if(geom != NULL && !cache_put_geom(&cb, geom)) {
+                type = wkbFlatten(OGR_G_GetGeometryType(geom));
+                gtype = type == wkbLinearRing ? wkbLineString : type;
+            } else {
+                // (a tin, etc.) cached as no geometry
+                cb.parttypes.n = nparts;
+                cb.partrings.n = nparts*sizeof(uint32_t);
+                cb.ringpts.n = nrings;
+                cb.pts.n = nbuf;
+                cb.bbox[0] = cb.bbox[1] = UINT32_MAX;
+                cb.bbox[2] = cb.bbox[3] = 0;
+                unsupported++;
+            }
+            if(lgeom != NULL) OGR_G_DestroyGeometry(lgeom);
+        }
+        buf_add(&cb.gtypes, &gtype, 1);
+        buf_add(&cb.bboxes, cb.bbox, sizeof(cb.bbox));
+        if(cb.bbox[0] <= cb.bbox[2]) {
+            if(cb.bbox[0] < bbox[0]) bbox[0] = cb.bbox[0];
+            if(cb.bbox[1] < bbox[1]) bbox[1] = cb.bbox[1];
+            if(cb.bbox[2] > bbox[2]) bbox[2] = cb.bbox[2];
+            if(cb.bbox[3] > bbox[3]) bbox[3] = cb.bbox[3];
+        }
+
+        for(k=0; k<cb.nfields; k++) {
+            if(!(lh->nftrs % 8)) {
+                buf_add(&cb.nulls[k], "", 1);
+            }
+            nulls = &cb.nulls[k].data[cb.nulls[k].n-1];
+            if(!(set = OGR_F_IsFieldSetAndNotNull(ftr, k))) {
+                *nulls |= 1 << (lh->nftrs % 8);
+            }
+            switch(cb.types[k]) {
+                case OFTInteger:
+                    i32 = set ? OGR_F_GetFieldAsInteger(ftr, k) : 0;
+                    buf_add(&cb.data[k], &i32, sizeof(i32));
+                    break;
+                case OFTInteger64:
+                    i64 = set ? OGR_F_GetFieldAsInteger64(ftr, k) : 0;
+                    buf_add(&cb.data[k], &i64, sizeof(i64));
+                    break;
+                case OFTReal:
+                    dval = set ? OGR_F_GetFieldAsDouble(ftr, k) : 0;
+                    buf_add(&cb.data[k], &dval, sizeof(dval));
+                    break;
+                default:
+                    u32 = cb.strs[k].n;
+                    buf_add(&cb.data[k], &u32, sizeof(u32));
+                    str = set ? OGR_F_GetFieldAsString(ftr, k) : "";
+                    buf_add(&cb.strs[k], str, strlen(str)+1);
+                    break;
+            }
+        }
+        OGR_F_Destroy(ftr);
+        lh->nftrs++;
+    }
+
+    // end markers
+    u32 = cb.parttypes.n;
+    buf_add(&cb.ftrparts, &u32, sizeof(u32));
+    u32 = cb.ringpts.n/sizeof(uint32_t);
+    buf_add(&cb.partrings, &u32, sizeof(u32));
+    u32 = cb.pts.n/(2*sizeof(uint32_t));
+    buf_add(&cb.ringpts, &u32, sizeof(u32));
+    for(k=0; k<cb.nfields; k++) {
+        if(cb.types[k] == OFTString) {
+            u32 = cb.strs[k].n;
+            buf_add(&cb.data[k], &u32, sizeof(u32));
+        }
+    }
+
+    if(cb.pts.n/(2*sizeof(uint32_t)) >= UINT32_MAX || cb.ringpts.n/sizeof(uint32_t) > UINT32_MAX ||
+            cb.parttypes.n >= UINT32_MAX || lh->nftrs >= UINT32_MAX) {
+        fprintf(stderr, "layer \"%s\" is too big to cache\n", name);
+        rv = 1;
+    }
+    if(!rv && unsupported) {
+        fprintf(stderr, "layer \"%s\": %d geometry(ies) of unsupported types cached as null\n",
+            name, unsupported);
+    }
+    lh->geomtype = OGR_L_GetGeomType(layer);
+    lh->nparts = cb.parttypes.n;
+    lh->nrings = cb.ringpts.n/sizeof(uint32_t) - 1;
+    lh->npts = cb.pts.n/(2*sizeof(uint32_t));
+    lh->nfields = cb.nfields;
+    lh->origin[0] = cb.origin[0];
+    lh->origin[1] = cb.origin[1];
+    lh->scale[0] = cb.scale[0];
+    lh->scale[1] = cb.scale[1];
+    if(bbox[0] <= bbox[2]) {
+        lh->ext[0] = cb.origin[0] + bbox[0]*cb.scale[0];
+        lh->ext[1] = cb.origin[1] + bbox[1]*cb.scale[1];
+        lh->ext[2] = cb.origin[0] + bbox[2]*cb.scale[0];
+        lh->ext[3] = cb.origin[1] + bbox[3]*cb.scale[1];
+    } else {
+        lh->ext[0] = ext.MinX;
+        lh->ext[1] = ext.MinY;
+        lh->ext[2] = ext.MaxX;
+        lh->ext[3] = ext.MaxY;
+    }
+    if(srs != NULL && OSRExportToWkt(srs, &wkt) != OGRERR_NONE) {
+        wkt = NULL;
+    }
+
+    if(!rv) {
+        rv = cache_write(fp, pos, name, strlen(name)+1, &lh->name) ||
+            (wkt != NULL && cache_write(fp, pos, wkt, strlen(wkt)+1, &lh->srs)) ||
+            cache_write(fp, pos, cb.fids.data, cb.fids.n, &lh->fids) ||
+            cache_write(fp, pos, cb.bboxes.data, cb.bboxes.n, &lh->bboxes) ||
+            cache_write(fp, pos, cb.gtypes.data, cb.gtypes.n, &lh->gtypes) ||
+            cache_write(fp, pos, cb.ftrparts.data, cb.ftrparts.n, &lh->ftrparts) ||
+            cache_write(fp, pos, cb.parttypes.data, cb.parttypes.n, &lh->parttypes) ||
+            cache_write(fp, pos, cb.partrings.data, cb.partrings.n, &lh->partrings) ||
+            cache_write(fp, pos, cb.ringpts.data, cb.ringpts.n, &lh->ringpts) ||
+            cache_write(fp, pos, cb.pts.data, cb.pts.n, &lh->pts) ? -1 : 0;
+    }
+    for(k=0; !rv && k<cb.nfields; k++) {
+        str = OGR_Fld_GetNameRef(OGR_FD_GetFieldDefn(ldef, k));
+        fields[k].type = cb.types[k];
+        rv = cache_write(fp, pos, str, strlen(str)+1, &fields[k].name) ||
+            cache_write(fp, pos, cb.nulls[k].data, cb.nulls[k].n, &fields[k].nulls) ||
+            cache_write(fp, pos, cb.data[k].data, cb.data[k].n, &fields[k].data) ||
+            cache_write(fp, pos, cb.strs[k].data, cb.strs[k].n, &fields[k].strs) ? -1 : 0;
+    }
+    if(!rv) {
+        rv = cache_write(fp, pos, fields, cb.nfields*sizeof(vfr_cache_field_t), &lh->fields);
+    }
+    if(!rv) {
+        fprintf(stderr, "layer \"%s\": %u feature(s), %u point(s)\n", name, lh->nftrs, lh->npts);
+    }
+
+    free(cb.fids.data);
+    free(cb.bboxes.data);
+    free(cb.gtypes.data);
+    free(cb.ftrparts.data);
+    free(cb.parttypes.data);
+    free(cb.partrings.data);
+    free(cb.ringpts.data);
+    free(cb.pts.data);
+    for(k=0; k<cb.nfields; k++) {
+        free(cb.nulls[k].data);
+        free(cb.data[k].data);
+        free(cb.strs[k].data);
+    }
+    free(cb.nulls);
+    free(cb.data);
+    free(cb.strs);
+    free(cb.types);
+    free(fields);
+    CPLFree(wkt);
+    return rv;
+}
+
+// adds the points, lines and polygons in geom to cb as parts. returns -1
+// for geometry types that can't be cached.
+static int cache_put_geom(vfr_cachebuild_t *cb, OGRGeometryH geom) {
+    OGRwkbGeometryType type = wkbFlatten(OGR_G_GetGeometryType(geom));
+    int i, n;
+
+    switch(type) {
+        case wkbPoint:
+        case wkbLineString:
+        case wkbLinearRing:
+            if(OGR_G_IsEmpty(geom)) return 0;
+            cache_put_part(cb, type == wkbPoint ? wkbPoint : wkbLineString);
+            cache_put_ring(cb, geom);
+            return 0;
+        case wkbPolygon:
+            if(OGR_G_IsEmpty(geom)) return 0;
+            cache_put_part(cb, wkbPolygon);
+            n = OGR_G_GetGeometryCount(geom);
+            for(i=0; i<n; i++) {
+                cache_put_ring(cb, OGR_G_GetGeometryRef(geom, i));
+            }
+            return 0;
+        case wkbMultiPoint:
+        case wkbMultiLineString:
+        case wkbMultiPolygon:
+        case wkbGeometryCollection:
+            n = OGR_G_GetGeometryCount(geom);
+            for(i=0; i<n; i++) {
+                if(cache_put_geom(cb, OGR_G_GetGeometryRef(geom, i))) return -1;
+            }
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static void cache_put_part(vfr_cachebuild_t *cb, int type) {
+    unsigned char ptype = type;
+    uint32_t ring = cb->ringpts.n/sizeof(uint32_t);
+    buf_add(&cb->parttypes, &ptype, 1);
+    buf_add(&cb->partrings, &ring, sizeof(ring));
+}
+
+// adds the points of ring (a line or polygon ring) to the last part
+static void cache_put_ring(vfr_cachebuild_t *cb, OGRGeometryH ring) {
+    uint32_t q[2], first = cb->pts.n/(2*sizeof(uint32_t));
+    int i, n = OGR_G_GetPointCount(ring);
+
+    buf_add(&cb->ringpts, &first, sizeof(first));
+    for(i=0; i<n; i++) {
+        q[0] = cache_quant(OGR_G_GetX(ring, i), cb->origin[0], cb->scale[0]);
+        q[1] = cache_quant(OGR_G_GetY(ring, i), cb->origin[1], cb->scale[1]);
+        if(q[0] < cb->bbox[0]) cb->bbox[0] = q[0];
+        if(q[1] < cb->bbox[1]) cb->bbox[1] = q[1];
+        if(q[0] > cb->bbox[2]) cb->bbox[2] = q[0];
+        if(q[1] > cb->bbox[3]) cb->bbox[3] = q[1];
+        buf_add(&cb->pts, q, sizeof(q));
+    }
+}
+
+static uint32_t cache_quant(double v, double origin, double scale) {
+    double q = floor((v - origin)/scale + 0.5);
+    if(!(q > 0)) return 0;
+    return q >= VFRCACHE_QMAX ? UINT32_MAX : (uint32_t)q;
+}
+
+// writes len bytes at the next 8 byte boundary after *pos, and sets
+// *off to where they went
+static int cache_write(FILE *fp, uint64_t *pos, const void *data, size_t len, uint64_t *off) {
+    static const unsigned char pad[8];
+    size_t npad = (8 - *pos % 8) % 8;
+    if(npad && fwrite(pad, 1, npad, fp) != npad) return -1;
+    *pos += npad;
+    *off = *pos;
+    if(len && fwrite(data, 1, len, fp) != len) return -1;
+    *pos += len;
+    return 0;
+}
+
+static void buf_add(vfr_buf_t *buf, const void *data, size_t len) {
+    if(buf->n + len > buf->cap) {
+        buf->cap = buf->n + len > buf->cap*2 ? buf->n + len : buf->cap*2;
+        if((buf->data = realloc(buf->data, buf->cap)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buf->data + buf->n, data, len);
+    buf->n += len;
+}
+
+// parses the style/filter/output options shared by render and tiles
+// (argv[*i]). returns 1 if handled, 0 if not a shared option, -1 if bad.
+static int parse_shared_opt(int argc, char **argv, int *i, vfr_style_t *style,
+        vfr_render_opts_t *opts, char **luafilenm) {
+    char *end;
+    unsigned long long ullval;
+    int ival;
+    double dval;
+    if(!strcmp(argv[*i], "-st")) {
+        if(++(*i) >= argc) return -1;
+        ullval = strtoull(argv[*i], &end, 16);
+        if(ullval == 0 && end == argv[*i]) {
+            return -1;
+        } else if(ullval == ULLONG_MAX && errno) {
+            return -1;
+        } else if(*end) {
+            return -1;
+        } else {
+            style->stroke = ullval;
+        }
+    } else if(!strcmp(argv[*i], "-fl")) {
+        if(++(*i) >= argc) return -1;
+        ullval = strtoull(argv[*i], &end, 16);
+        if(ullval == 0 && end == argv[*i]) {
+            return -1;
+        } else if(ullval == ULLONG_MAX && errno) {
+            return -1;
+        } else if(*end) {
+            return -1;
+        } else {
+            style->fill = ullval;
+        }
+    } else if(!strcmp(argv[*i], "-sz")) {
+        if(++(*i) >= argc) return -1;
+        ival = atoi(argv[*i]);
+        style->size = ival;
+    } else if(!strcmp(argv[*i], "-lua")) {
+        if(++(*i) >= argc) return -1;
+        *luafilenm = argv[*i];
+    } else if(!strcmp(argv[*i], "-simplify")) {
+        if(++(*i) >= argc) return -1;
+        dval = strtod(argv[*i], &end);
+        if(end == argv[*i] || *end || dval < 0.0) {
+            return -1;
+        }
+        style->simplify = dval;
+    } else if(!strcmp(argv[*i], "-subpx")) {
+        if(++(*i) >= argc || parse_subpx(argv[*i], &style->subpixel)) {
+            return -1;
+        }
+    } else if(!strcmp(argv[*i], "-format")) {
+        if(++(*i) >= argc || parse_format(argv[*i], &opts->format)) {
+            return -1;
+        }
+    } else if(!strcmp(argv[*i], "-where")) {
+        if(++(*i) >= argc) return -1;
+        opts->where = argv[*i];
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static void vfr_style_defaults(vfr_style_t *style) {
+    vfr_style_t dflt = {
+        0xffffff, 100, NULL, 0.0, 1.0, // fill, fopacity, fill pattern, pattern rotate, pattern scale  
+        0x000000, 100, 1, // stroke, sopacity, size
+        VFRPLACE_NONE, NULL, 0xffffff, 100, NULL, NULL, // label placement, field, color, text, fontdesc
+        0, 0, 0, 0, 0x01000000, 0, -1, // flags, xoff, yoff, halo rad, halo fill, label rot, label w
+        0.0, VFRSUBPX_DRAW, // simplify, sub-pixel features
+        0.0, VFRHALO_HULL // label priority, halo mode
+    };
+    *style = dflt;
+}
+
+static char* vfr_strdup(const char *str) {
+    char *dup;
+    if(str == NULL) return NULL;
+    if((dup = strdup(str)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return dup;
+}
+
+// deep copy (dst gets its own strings)
+static void vfr_style_copy(vfr_style_t *dst, vfr_style_t *src) {
+    *dst = *src;
+    dst->hatch_pattern = vfr_strdup(src->hatch_pattern);
+    dst->label_field = vfr_strdup(src->label_field);
+    dst->label_text = vfr_strdup(src->label_text);
+    dst->label_fontdesc = vfr_strdup(src->label_fontdesc);
+}
+
+static void vfr_style_free(vfr_style_t *style) {
+    free(style->hatch_pattern);
+    free(style->label_field);
+    free(style->label_text);
+    free(style->label_fontdesc);
+    style->hatch_pattern = style->label_field = NULL;
+    style->label_text = style->label_fontdesc = NULL;
+}
+
+// parses "minx,miny,maxx,maxy" into ext
+static int parse_bbox(const char *str, OGREnvelope *ext) {
+    double minx, miny, maxx, maxy;
+    char trail;
+    if(sscanf(str, "%lf,%lf,%lf,%lf%c", &minx, &miny, &maxx, &maxy, &trail) != 4) {
+        fprintf(stderr, "invalid bbox '%s' (expected minx,miny,maxx,maxy)\n", str);
+        return 1;
+    }
+    if(minx >= maxx || miny >= maxy) {
+        fprintf(stderr, "invalid bbox '%s' (empty extent)\n", str);
+        return 1;
+    }
+    ext->MinX = minx;
+    ext->MinY = miny;
+    ext->MaxX = maxx;
+    ext->MaxY = maxy;
+    return 0;
+}
+
+// reads all points of a linestring/ring into pts (in pixel coordinates)
+static int vfr_geom_to_px(OGRGeometryH geom, OGREnvelope *ext, double pxw, double pxh,
+        vfr_coords_t *pts) {
+    int pcount = OGR_G_GetPointCount(geom);
+    vfr_coords_reserve(pts, pcount);
+    pts->n = 0;
+    if(!pcount) return 0;
+    pts->n = OGR_G_GetPoints(geom, pts->xy, 2*sizeof(double),
+        pts->xy+1, 2*sizeof(double), NULL, 0);
+    // px = (x - MinX)/pxw, py = (MaxY - y)/pxh
+    vfr_px_transform(pts->xy, pts->n, ext->MinX, ext->MaxY, 1.0/pxw, -1.0/pxh);
+    return pts->n;
+}
+
+static void vfr_coords_reserve(vfr_coords_t *pts, int n) {
+    if(n <= pts->cap) return;
+    pts->cap = n > pts->cap*2 ? n : pts->cap*2;
+    pts->xy = realloc(pts->xy, 2*pts->cap*sizeof(double));
+    pts->keep = realloc(pts->keep, pts->cap);
+    pts->stack = realloc(pts->stack, 2*pts->cap*sizeof(int));
+    if(pts->xy == NULL || pts->keep == NULL || pts->stack == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+// squared distance from point p to segment a-b
+static double seg_dist_sq(double *p, double *a, double *b) {
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+    double x = a[0], y = a[1], t;
+    if(dx != 0.0 || dy != 0.0) {
+        t = ((p[0] - a[0])*dx + (p[1] - a[1])*dy)/(dx*dx + dy*dy);
+        if(t > 1.0) {
+            x = b[0];
+            y = b[1];
+        } else if(t > 0.0) {
+            x += dx*t;
+            y += dy*t;
+        }
+    }
+    dx = p[0] - x;
+    dy = p[1] - y;
+    return dx*dx + dy*dy;
+}
+
+// which side of a-b c is on (0 if on the line)
+static int seg_side(double *a, double *b, double *c) {
+    double d = (b[0] - a[0])*(c[1] - a[1]) - (b[1] - a[1])*(c[0] - a[0]);
+    return (d > 0.0) - (d < 0.0);
+}
+
+// is c (on the line through a-b) between a and b?
+static int seg_spans(double *a, double *b, double *c) {
+    return c[0] >= fmin(a[0], b[0]) && c[0] <= fmax(a[0], b[0]) &&
+        c[1] >= fmin(a[1], b[1]) && c[1] <= fmax(a[1], b[1]);
+}
+
+// do segments a-b and c-d cross or touch? ones that just share an end
+// (neighbouring edges) don't count.
+static int segs_meet(double *a, double *b, double *c, double *d) {
+    int s1, s2, s3, s4;
+    if((a[0] == c[0] && a[1] == c[1]) || (a[0] == d[0] && a[1] == d[1]) ||
+            (b[0] == c[0] && b[1] == c[1]) || (b[0] == d[0] && b[1] == d[1])) {
+        return 0;
+    }
+    s1 = seg_side(a, b, c);
+    s2 = seg_side(a, b, d);
+    s3 = seg_side(c, d, a);
+    s4 = seg_side(c, d, b);
+    if(s1*s2 < 0 && s3*s4 < 0) return 1;
+    return (!s1 && seg_spans(a, b, c)) || (!s2 && seg_spans(a, b, d)) ||
+        (!s3 && seg_spans(c, d, a)) || (!s4 && seg_spans(c, d, b));
+}
+
+static int ring_edge_cmp(const void *a, const void *b) {
+    const vfr_edge_t *ea = a, *eb = b;
+    return ea->minx < eb->minx ? -1 : (ea->minx > eb->minx);
+}
+
+// does the ring cross or touch itself, or enclose no area? edges are
+// sorted by x, so only ones whose x ranges overlap are tested.
+static int ring_invalid(vfr_coords_t *pts) {
+    int i, j, m = 0, n = pts->n;
+    double *xy = pts->xy, *a, *b, area = 0.0;
+    vfr_edges_t *e = &g_edges;
+
+    for(i=0; i<n; i++) {
+        a = &xy[2*i];
+        b = &xy[2*((i+1) % n)];
+        area += a[0]*b[1] - b[0]*a[1];
+    }
+    if(area == 0.0) return 1;
+    if(n > e->cap) {
+        e->cap = n > e->cap*2 ? n : e->cap*2;
+        e->items = realloc(e->items, e->cap*sizeof(vfr_edge_t));
+        if(e->items == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    for(i=0; i<n; i++) {
+        a = &xy[2*i];
+        b = &xy[2*((i+1) % n)];
+        if(a[0] == b[0] && a[1] == b[1]) continue; // (the closing point)
+        e->items[m].i = i;
+        e->items[m].minx = fmin(a[0], b[0]);
+        e->items[m].maxx = fmax(a[0], b[0]);
+        m++;
+    }
+    qsort(e->items, m, sizeof(vfr_edge_t), ring_edge_cmp);
+    for(i=0; i<m; i++) {
+        a = &xy[2*e->items[i].i];
+        for(j=i+1; j<m && e->items[j].minx <= e->items[i].maxx; j++) {
+            b = &xy[2*e->items[j].i];
+            if(segs_meet(a, &xy[2*((e->items[i].i+1) % n)],
+                    b, &xy[2*((e->items[j].i+1) % n)])) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// drops vertices that are within tol px of the simplified line (radial
+// distance pass, then douglas-peucker). endpoints are always kept, so
+// closed rings stay closed. closed rings are copied to tmp first and put
+// back as they were if simplifying them leaves less than a triangle, a
+// ring that crosses itself or one w/o area. (rings can still end up
+// crossing other rings, so tol should stay around a pixel.)
+static int vfr_simplify_coords(vfr_coords_t *pts, double tol, int closed,
+        vfr_coords_t *tmp) {
+    int i, n, first, last, idx, sp;
+    double sqtol = tol*tol, d, maxd, dx, dy;
+    double *xy = pts->xy;
+
+    if(tol <= 0.0 || pts->n < 3) return pts->n;
+
+    if(closed) {
+        vfr_coords_reserve(tmp, pts->n);
+        memcpy(tmp->xy, xy, 2*pts->n*sizeof(double));
+        tmp->n = pts->n;
+    }
+
+    // radial distance
+    n = 1;
+    for(i=1; i<pts->n-1; i++) {
+        dx = xy[2*i] - xy[2*(n-1)];
+        dy = xy[2*i+1] - xy[2*(n-1)+1];
+        if(dx*dx + dy*dy >= sqtol) {
+            xy[2*n] = xy[2*i];
+            xy[2*n+1] = xy[2*i+1];
+            n++;
+        }
+    }
+    xy[2*n] = xy[2*(pts->n-1)];
+    xy[2*n+1] = xy[2*(pts->n-1)+1];
+    n++;
+
+    // douglas-peucker (w/ explicit stack)
+    memset(pts->keep, 0, n);
+    pts->keep[0] = pts->keep[n-1] = 1;
+    sp = 0;
+    pts->stack[sp++] = 0;
+    pts->stack[sp++] = n-1;
+    while(sp) {
+        last = pts->stack[--sp];
+        first = pts->stack[--sp];
+        maxd = sqtol;
+        idx = -1;
+        for(i=first+1; i<last; i++) {
+            d = seg_dist_sq(&xy[2*i], &xy[2*first], &xy[2*last]);
+            if(d > maxd) {
+                maxd = d;
+                idx = i;
+            }
+        }
+        if(idx >= 0) {
+            pts->keep[idx] = 1;
+            pts->stack[sp++] = first;
+            pts->stack[sp++] = idx;
+            pts->stack[sp++] = idx;
+            pts->stack[sp++] = last;
+        }
+    }
+    for(i=0, idx=0; i<n; i++) {
+        if(!pts->keep[i]) continue;
+        xy[2*idx] = xy[2*i];
+        xy[2*idx+1] = xy[2*i+1];
+        idx++;
+    }
+    pts->n = idx;
+    if(closed && pts->n < tmp->n && (pts->n < 4 || ring_invalid(pts))) {
+        memcpy(xy, tmp->xy, 2*tmp->n*sizeof(double));
+        pts->n = tmp->n;
+    }
+    return pts->n;
+}
+
+// reverses a ring unless it already runs clockwise (cw) or
+// counterclockwise (!cw) on screen
+static void vfr_orient_coords(vfr_coords_t *pts, int cw) {
+    int i, j;
+    double *xy = pts->xy, area = 0.0, t;
+    for(i=0, j=pts->n-1; i<pts->n; j=i++) {
+        area += xy[2*j]*xy[2*i+1] - xy[2*i]*xy[2*j+1];
+    }
+    // y points down, so positive area is clockwise
+    if(area == 0.0 || (area > 0.0) == (cw != 0)) return;
+    for(i=0, j=pts->n-1; i<j; i++, j--) {
+        t = xy[2*i]; xy[2*i] = xy[2*j]; xy[2*j] = t;
+        t = xy[2*i+1]; xy[2*i+1] = xy[2*j+1]; xy[2*j+1] = t;
+    }
+}
+
+// canvas bounds (in px), grown by margin px on each side
+static void vfr_clip_rect(OGREnvelope *ext, double pxw, double pxh, double margin,
+        OGREnvelope *clip) {
+    clip->MinX = -margin;
+    clip->MinY = -margin;
+    clip->MaxX = (ext->MaxX - ext->MinX)/pxw + margin;
+    clip->MaxY = (ext->MaxY - ext->MinY)/pxh + margin;
+}
+
+// one sutherland-hodgman pass: keeps the part of src on the inside of
+// the line coord = bound (coord 0 = x, 1 = y; keep >= bound if lo)
+static void clip_ring_pass(vfr_coords_t *src, vfr_coords_t *dst, int coord,
+        double bound, int lo) {
+    int i, n = 0, curin, previn;
+    double *cur, *prev, t;
+    vfr_coords_reserve(dst, 2*src->n+1);
+    prev = &src->xy[2*(src->n-1)];
+    previn = lo ? prev[coord] >= bound : prev[coord] <= bound;
+    for(i=0; i<src->n; i++) {
+        cur = &src->xy[2*i];
+        curin = lo ? cur[coord] >= bound : cur[coord] <= bound;
+        if(curin != previn) {
+            t = (bound - prev[coord])/(cur[coord] - prev[coord]);
+            dst->xy[2*n] = prev[0] + t*(cur[0] - prev[0]);
+            dst->xy[2*n+1] = prev[1] + t*(cur[1] - prev[1]);
+            dst->xy[2*n+coord] = bound;
+            n++;
+        }
+        if(curin) {
+            dst->xy[2*n] = cur[0];
+            dst->xy[2*n+1] = cur[1];
+            n++;
+        }
+        prev = cur;
+        previn = curin;
+    }
+    dst->n = n;
+}
+
+// clips a ring (in px) to clip, using tmp as scratch. edges that end up
+// along the clip bounds lie outside the canvas (by the margin).
+static int vfr_clip_ring(vfr_coords_t *pts, vfr_coords_t *tmp, OGREnvelope *clip) {
+    int i, inside = 1;
+    for(i=0; i<pts->n && inside; i++) {
+        inside = pts->xy[2*i] >= clip->MinX && pts->xy[2*i] <= clip->MaxX &&
+            pts->xy[2*i+1] >= clip->MinY && pts->xy[2*i+1] <= clip->MaxY;
+    }
+    if(inside) return pts->n;
+    clip_ring_pass(pts, tmp, 0, clip->MinX, 1);
+    if(tmp->n) clip_ring_pass(tmp, pts, 0, clip->MaxX, 0); else pts->n = 0;
+    if(pts->n) clip_ring_pass(pts, tmp, 1, clip->MinY, 1); else tmp->n = 0;
+    if(tmp->n) clip_ring_pass(tmp, pts, 1, clip->MaxY, 0); else pts->n = 0;
+    return pts->n;
+}
+
+// liang-barsky: clips segment (x0,y0)-(x1,y1) to clip. returns 0 if
+// nothing is left, else the params of the visible part in t0, t1
+static int clip_segment(double x0, double y0, double x1, double y1, OGREnvelope *clip,
+        double *t0, double *t1) {
+    double p[4], q[4], r;
     int i;
-    int layercount = OGR_DS_GetLayerCount(ds);
-    OGRLayerH layer;
-    OGREnvelope lext = {};
-    for(i=0; i<layercount; i++) {
-        layer = OGR_DS_GetLayer(ds, i);
-        OGR_L_GetExtent(layer, &lext, 1); // arg 3 is bForce (exp. but nec.)
-        if(i == 0 || lext.MinX < ext->MinX) {
-            ext->MinX = lext.MinX;
+    p[0] = -(x1 - x0); q[0] = x0 - clip->MinX;
+    p[1] = x1 - x0;    q[1] = clip->MaxX - x0;
+    p[2] = -(y1 - y0); q[2] = y0 - clip->MinY;
+    p[3] = y1 - y0;    q[3] = clip->MaxY - y0;
+    *t0 = 0.0;
+    *t1 = 1.0;
+    for(i=0; i<4; i++) {
+        if(p[i] == 0.0) {
+            if(q[i] < 0.0) return 0;
+            continue;
         }
-        if(i == 0 || lext.MinY < ext->MinY) {
-            ext->MinY = lext.MinY;
+        r = q[i]/p[i];
+        if(p[i] < 0.0) {
+            if(r > *t1) return 0;
+            if(r > *t0) *t0 = r;
+        } else {
+            if(r < *t0) return 0;
+            if(r < *t1) *t1 = r;
         }
-        if(i == 0 || lext.MaxX > ext->MaxX) {
-            ext->MaxX = lext.MaxX;
+    }
+    return 1;
+}
+
+// like vfr_path_coords, but only the parts of the line inside clip
+static void vfr_path_clipped_line(cairo_t *cr, vfr_coords_t *pts, OGREnvelope *clip) {
+    int i, pen = 0; // pen = 1 if the current point is the segment start
+    double *a, *b, t0, t1;
+    for(i=1; i<pts->n; i++) {
+        a = &pts->xy[2*(i-1)];
+        b = &pts->xy[2*i];
+        if(!clip_segment(a[0], a[1], b[0], b[1], clip, &t0, &t1)) {
+            pen = 0;
+            continue;
         }
-        if(i == 0 || lext.MaxY > ext->MaxY) {
-            ext->MaxY = lext.MaxY;
+        if(!pen || t0 > 0.0) {
+            cairo_move_to(cr, a[0] + t0*(b[0] - a[0]), a[1] + t0*(b[1] - a[1]));
         }
+        cairo_line_to(cr, a[0] + t1*(b[0] - a[0]), a[1] + t1*(b[1] - a[1]));
+        pen = t1 >= 1.0;
+    }
+}
+
+// xy[i] = (xy[i] - off)*scale, for n interleaved (x, y) pairs
+static void vfr_px_transform(double *xy, int n, double offx, double offy, double sx, double sy) {
+    int i = 0;
+#if defined(__AVX__)
+    __m256d off4 = _mm256_set_pd(offy, offx, offy, offx);
+    __m256d scl4 = _mm256_set_pd(sy, sx, sy, sx);
+    __m256d v;
+    for(; i+1 < n; i += 2) {
+        v = _mm256_loadu_pd(&xy[2*i]);
+        v = _mm256_mul_pd(_mm256_sub_pd(v, off4), scl4);
+        _mm256_storeu_pd(&xy[2*i], v);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128d off2 = _mm_set_pd(offy, offx);
+    __m128d scl2 = _mm_set_pd(sy, sx);
+    __m128d v2;
+    for(; i < n; i++) {
+        v2 = _mm_loadu_pd(&xy[2*i]);
+        v2 = _mm_mul_pd(_mm_sub_pd(v2, off2), scl2);
+        _mm_storeu_pd(&xy[2*i], v2);
+    }
+#endif
+    for(; i < n; i++) {
+        xy[2*i] = (xy[2*i] - offx)*sx;
+        xy[2*i+1] = (xy[2*i+1] - offy)*sy;
+    }
+}
+
+// appends pts to the current path as one subpath
+static void vfr_path_coords(cairo_t *cr, vfr_coords_t *pts) {
+    int i;
+    if(!pts->n) return;
+    cairo_move_to(cr, pts->xy[0], pts->xy[1]);
+    for(i=1; i<pts->n; i++) {
+        cairo_line_to(cr, pts->xy[2*i], pts->xy[2*i+1]);
+    }
+}
+
+static int parse_format(const char *str, vfr_format_t *format) {
+    if(!strcmp(str, VFRFORMAT_SVG_S)) {
+        *format = VFRFORMAT_SVG;
+    } else if(!strcmp(str, VFRFORMAT_PNG_S)) {
+        *format = VFRFORMAT_PNG;
+    } else if(!strcmp(str, VFRFORMAT_PNG24_S)) {
+        *format = VFRFORMAT_PNG24;
+    } else if(!strcmp(str, VFRFORMAT_TIFF_S)) {
+        *format = VFRFORMAT_TIFF;
+    } else {
+        fprintf(stderr, "invalid format '%s' (expected svg, png, png24 or tiff)\n", str);
+        return 1;
+    }
+    return 0;
+}
+
+// png for *.png, tiff for *.tif(f), svg otherwise
+static vfr_format_t format_from_filenm(const char *filenm) {
+    const char *dot = strrchr(filenm, '.');
+    if(dot != NULL && !strcasecmp(dot, ".png")) {
+        return VFRFORMAT_PNG;
+    } else if(dot != NULL && (!strcasecmp(dot, ".tif") || !strcasecmp(dot, ".tiff"))) {
+        return VFRFORMAT_TIFF;
+    }
+    return VFRFORMAT_SVG;
+}
+
+static int parse_subpx(const char *str, vfr_subpx_t *mode) {
+    if(!strcmp(str, VFRSUBPX_DOT_S)) {
+        *mode = VFRSUBPX_DOT;
+    } else if(!strcmp(str, VFRSUBPX_CULL_S)) {
+        *mode = VFRSUBPX_CULL;
+    } else if(!strcmp(str, VFRSUBPX_DRAW_S)) {
+        *mode = VFRSUBPX_DRAW;
+    } else {
+        fprintf(stderr, "invalid sub-pixel mode '%s' (expected dot, cull or draw)\n", str);
+        return 1;
+    }
+    return 0;
+}
+
+static int parse_halo(const char *str, vfr_halo_t *mode) {
+    if(!strcmp(str, VFRHALO_HULL_S)) {
+        *mode = VFRHALO_HULL;
+    } else if(!strcmp(str, VFRHALO_OUTLINE_S)) {
+        *mode = VFRHALO_OUTLINE;
+    } else {
+        fprintf(stderr, "invalid label halo '%s' (expected hull or outline)\n", str);
+        return 1;
     }
     return 0;
 }
 
+// adds a pixel-sized square where the envelope falls
+static void vfr_draw_subpx(cairo_t *cr, OGREnvelope *genv, OGREnvelope *ext,
+        double pxw, double pxh, vfr_style_t *style, int poly) {
+    double pxx = ((genv->MinX + genv->MaxX)/2.0 - ext->MinX)/pxw;
+    double pxy = (ext->MaxY - (genv->MinY + genv->MaxY)/2.0)/pxh;
+    vfr_batch_begin(cr, style, poly ? VFRBATCH_PDOT : VFRBATCH_LDOT);
+    cairo_rectangle(cr, floor(pxx), floor(pxy), 1.0, 1.0);
+}
+
 static int vfr_draw_geom(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom, OGREnvelope *ext,
         double pxw, double pxh, vfr_style_t *style) {
 
     OGRGeometryH geom2;
+    OGREnvelope genv;
+    OGRwkbGeometryType gtype = wkbFlatten(OGR_G_GetGeometryType(geom));
+    double margin = style->size + 1.0; // in px, enough for strokes/point radii
 
     int g, gcount;
     //fprintf(stderr, "rendering %s\n", OGR_G_GetGeometryName(geom));
+
+    if(OGR_G_IsEmpty(geom)) return 0;
+
+    // skip features entirely off the canvas
+    OGR_G_GetEnvelope(geom, &genv);
+    if(genv.MaxX < ext->MinX - margin*pxw || genv.MinX > ext->MaxX + margin*pxw ||
+            genv.MaxY < ext->MinY - margin*pxh || genv.MinY > ext->MaxY + margin*pxh) {
+        return 0;
+    }
+
+    // features smaller than a pixel are dropped or drawn as a dot
+    if(gtype != wkbPoint && gtype != wkbGeometryCollection &&
+            style->subpixel != VFRSUBPX_DRAW) {
+        if((genv.MaxX - genv.MinX) < pxw && (genv.MaxY - genv.MinY) < pxh) {
+            if(style->subpixel == VFRSUBPX_DOT) {
+                g_subpx_dotted++;
+                vfr_draw_subpx(cr, &genv, ext, pxw, pxh, style,
+                    gtype == wkbPolygon || gtype == wkbMultiPolygon);
+                if(VFRENV_MEETS(&genv, ext)) g_shown_count++;
+            } else {
+                g_subpx_culled++;
+            }
+            return 0;
+        }
+    }
+    // counted for -noempty only if inside the canvas, not just in the
+    // margin read around tiles and bands
+    if(gtype != wkbGeometryCollection && VFRENV_MEETS(&genv, ext)) {
+        g_shown_count++;
+    }
     
-    switch(wkbFlatten(OGR_G_GetGeometryType(geom))) {
+    switch(gtype) {
         case wkbPoint:
             vfr_draw_point(cr, geom, ext, pxw, pxh, style);
             break;
@@ -906,337 +4998,1041 @@ static int vfr_draw_geom(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom, OGREnv
     return 0;
 }
 
+// do a and b paint shapes the same way?
+static int vfr_style_paint_eq(vfr_style_t *a, vfr_style_t *b) {
+    if(a->fill != b->fill || a->fill_opacity != b->fill_opacity ||
+            a->stroke != b->stroke || a->stroke_opacity != b->stroke_opacity ||
+            a->size != b->size) {
+        return 0;
+    }
+    if(a->hatch_pattern == NULL || b->hatch_pattern == NULL) {
+        return a->hatch_pattern == b->hatch_pattern;
+    }
+    return !strcmp(a->hatch_pattern, b->hatch_pattern) &&
+        a->hatch_rotate == b->hatch_rotate && a->hatch_scale == b->hatch_scale;
+}
+
+// can shapes of this kind and style share a path and look the same as
+// painted one by one? not if they're see-through (overlaps wouldn't add
+// up) or both filled and stroked (a later fill should cover an earlier
+// outline).
+static int vfr_batch_mergeable(vfr_style_t *style, vfr_batch_kind_t kind) {
+    int fill = style->fill <= 0xffffff, stroke = style->stroke <= 0xffffff;
+    switch(kind) {
+        case VFRBATCH_POLY:
+        case VFRBATCH_POINT:
+            if(fill && stroke) return 0;
+            return fill ? style->fill_opacity >= 100 : style->stroke_opacity >= 100;
+        case VFRBATCH_PDOT:
+            if(fill) return style->fill_opacity >= 100;
+            return style->stroke_opacity >= 100;
+        case VFRBATCH_LINE:
+        case VFRBATCH_LDOT:
+            return style->stroke_opacity >= 100;
+        default:
+            return 0;
+    }
+}
+
+// starts adding shapes of the given kind and style to the current path,
+// first painting what's pending if it was added w/ a different style (or
+// can't be merged)
+static void vfr_batch_begin(cairo_t *cr, vfr_style_t *style, vfr_batch_kind_t kind) {
+    vfr_batch_t *b = &g_batch;
+    b->features++;
+    if(b->kind == kind && vfr_style_paint_eq(&b->style, style) &&
+            vfr_batch_mergeable(style, kind)) {
+        return;
+    }
+    vfr_batch_flush(cr);
+    b->kind = kind;
+    b->style.fill = style->fill;
+    b->style.fill_opacity = style->fill_opacity;
+    b->style.stroke = style->stroke;
+    b->style.stroke_opacity = style->stroke_opacity;
+    b->style.size = style->size;
+    b->style.hatch_rotate = style->hatch_rotate;
+    b->style.hatch_scale = style->hatch_scale;
+    // the style's strings are freed as features are styled, so copy
+    free(b->style.hatch_pattern);
+    b->style.hatch_pattern = NULL;
+    if(style->hatch_pattern != NULL) {
+        b->style.hatch_pattern = strdup(style->hatch_pattern);
+        if(b->style.hatch_pattern == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+}
+
+// fills and/or strokes the pending path
+static void vfr_batch_flush(cairo_t *cr) {
+    vfr_batch_t *b = &g_batch;
+    vfr_style_t *style = &b->style;
+    cairo_pattern_t* hatchpat = NULL;
+    uint64_t color;
+    int opacity;
+
+    switch(b->kind) {
+        case VFRBATCH_NONE:
+            return;
+        case VFRBATCH_POLY:
+        case VFRBATCH_POINT:
+            if(style->fill <= 0xffffff) {
+                if(b->kind == VFRBATCH_POLY) {
+                    hatchpat = cached_fill_pattern(style);
+                }
+                if(hatchpat != NULL) {
+                    cairo_set_source(cr, hatchpat);
+                } else {
+                    cairo_set_source_rgba(cr, 
+                            vfr_color_compextr(style->fill, 'r'), 
+                            vfr_color_compextr(style->fill, 'g'), 
+                            vfr_color_compextr(style->fill, 'b'),
+                            ((float)style->fill_opacity)/100.0);
+                }
+                cairo_fill_preserve(cr);
+            }
+            if(style->stroke <= 0xffffff) {
+                cairo_set_source_rgba(cr, 
+                        vfr_color_compextr(style->stroke, 'r'), 
+                        vfr_color_compextr(style->stroke, 'g'), 
+                        vfr_color_compextr(style->stroke, 'b'),
+                        ((float)style->stroke_opacity)/100.0); 
+                cairo_set_line_width(cr, style->size);
+                cairo_stroke_preserve(cr);
+            }
+            break;
+        case VFRBATCH_LINE:
+            cairo_set_line_width(cr, style->size);
+            cairo_set_source_rgba(cr,
+                    vfr_color_compextr(style->stroke, 'r'),
+                    vfr_color_compextr(style->stroke, 'g'),
+                    vfr_color_compextr(style->stroke, 'b'),
+                    ((float)style->stroke_opacity)/100.0);
+            cairo_stroke_preserve(cr);
+            break;
+        case VFRBATCH_PDOT:
+        case VFRBATCH_LDOT:
+            color = style->stroke;
+            opacity = style->stroke_opacity;
+            if(b->kind == VFRBATCH_PDOT && style->fill <= 0xffffff) {
+                color = style->fill;
+                opacity = style->fill_opacity;
+            }
+            if(color <= 0xffffff) {
+                cairo_set_source_rgba(cr,
+                        vfr_color_compextr(color, 'r'),
+                        vfr_color_compextr(color, 'g'),
+                        vfr_color_compextr(color, 'b'),
+                        ((float)opacity)/100.0);
+                cairo_fill_preserve(cr);
+            }
+            break;
+    }
+    cairo_new_path(cr);
+    b->kind = VFRBATCH_NONE;
+    b->runs++;
+}
+
 static int vfr_draw_point(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext,
         double pxw, double pxh, vfr_style_t *style) {
     double x, y, z;
     OGR_G_GetPoint(geom, 0, &x, &y, &z);
     double pxx = (x - ext->MinX)/pxw;
     double pxy = (ext->MaxY - y)/pxh;
+    vfr_batch_begin(cr, style, VFRBATCH_POINT);
+    cairo_new_sub_path(cr);
     cairo_arc(cr, pxx, pxy, style->size, 0, 2*M_PI);
-    if(style->fill <= 0xffffff) {
-        cairo_set_source_rgba(cr, 
-                vfr_color_compextr(style->fill, 'r'), 
-                vfr_color_compextr(style->fill, 'g'), 
-                vfr_color_compextr(style->fill, 'b'),
-                ((float)style->fill_opacity)/100.0);
-        if(style->stroke <= 0xffffff) {
-            cairo_fill_preserve(cr);
-        } else {
-            cairo_fill(cr);
-        }
-    }
-    if(style->stroke <= 0xffffff) {
-        cairo_set_source_rgba(cr, 
-                vfr_color_compextr(style->stroke, 'r'),
-                vfr_color_compextr(style->stroke, 'g'),
-                vfr_color_compextr(style->stroke, 'b'),
-                ((float)style->stroke_opacity)/100.0);
-        cairo_set_line_width(cr, style->size);
-        cairo_stroke(cr);
-    }
+    cairo_close_path(cr);
     return 0;
 }
 
 static int vfr_draw_linestring(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext, 
         double pxw, double pxh, vfr_style_t *style) {
-    int pcount = OGR_G_GetPointCount(geom);
-    if(!pcount) return 0;
-    double x, y, z, pxx, pxy;
-    int i;
-    cairo_set_line_width(cr, style->size);
-    cairo_set_source_rgba(cr,
-            vfr_color_compextr(style->stroke, 'r'),
-            vfr_color_compextr(style->stroke, 'g'),
-            vfr_color_compextr(style->stroke, 'b'),
-            ((float)style->stroke_opacity)/100.0);
-    for(i = 0; i < pcount; i++) {
-        OGR_G_GetPoint(geom, i, &x, &y, &z);
-        pxx = (x - ext->MinX)/pxw;
-        pxy = (ext->MaxY - y)/pxh;
-        if(!i) {
-            cairo_move_to(cr, pxx, pxy);
+    OGREnvelope clip;
+    if(vfr_geom_to_px(geom, ext, pxw, pxh, &g_coords) < 2) return 0;
+    vfr_simplify_coords(&g_coords, style->simplify, 0, NULL);
+    vfr_clip_rect(ext, pxw, pxh, style->size + 1.0, &clip);
+    vfr_batch_begin(cr, style, VFRBATCH_LINE);
+    vfr_path_clipped_line(cr, &g_coords, &clip);
+    return 0;
+}
+
+// traces the exterior and interior rings of a polygon. exteriors are
+// made clockwise and holes counterclockwise, so the (nonzero winding)
+// fill leaves holes open while overlapping features in a batch still
+// fill as a union.
+static int vfr_draw_polygon(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext, 
+        double pxw, double pxh, vfr_style_t *style) {
+
+    OGRGeometryH geom2;
+    OGREnvelope clip;
+    int r, rcount = OGR_G_GetGeometryCount(geom);
+
+    if(!rcount) return 0;
+    vfr_clip_rect(ext, pxw, pxh, style->size + 1.0, &clip);
+    vfr_batch_begin(cr, style, VFRBATCH_POLY);
+    for(r=0; r<rcount; r++) {
+        geom2 = OGR_G_GetGeometryRef(geom, r);
+        if(vfr_geom_to_px(geom2, ext, pxw, pxh, &g_coords) < 3 ||
+                vfr_clip_ring(&g_coords, &g_clipbuf, &clip) < 3) {
+            if(!r) return 0; // no exterior, no holes
             continue;
         }
-        cairo_line_to(cr, pxx, pxy);
+        vfr_simplify_coords(&g_coords, style->simplify, 1, &g_clipbuf);
+        vfr_orient_coords(&g_coords, r == 0);
+        vfr_path_coords(cr, &g_coords);
+        cairo_close_path(cr);
     }
-    cairo_stroke(cr);
     return 0;
 }
 
-static int vfr_draw_polygon(cairo_t *cr, OGRGeometryH geom, OGREnvelope *ext, 
-        double pxw, double pxh, vfr_style_t *style) {
 
-    OGRGeometryH geom2 = OGR_G_GetGeometryRef(geom, 0);
-    int p, ptcount = OGR_G_GetPointCount(geom2);
-    double x, y, z, pxx, pxy;
-    cairo_pattern_t* hatchpat = NULL;
+// works out where (and whether) a feature's label goes and queues it
+// for placement. nothing is drawn until vfr_place_labels.
+static int vfr_queue_label(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom,
+        OGREnvelope *ext, double pxw, double pxh, vfr_style_t *style) {
     
-    for(p=0; p<ptcount; p++) {
-        OGR_G_GetPoint(geom2, p, &x, &y, &z);
-        pxx = (x - ext->MinX)/pxw;
-        pxy = (ext->MaxY - y)/pxh;
-        if(!p) {
-            cairo_move_to(cr, pxx, pxy);
+    if(!style->label_place) return 0;
+    
+    //fprintf(stderr, "label feature #%ld\n", OGR_F_GetFID(ftr));
+
+    vfr_outline_t *outline = NULL;
+    int fieldidx;
+    const char *text = NULL;
+    OGRGeometryH centroid;
+    OGREnvelope envelope;
+    double x, y, z, pxx, pxy, wrap_width, radius;
+    int i;
+    vfr_label_t lbl;
+
+    if(style->label_text != NULL) {
+        text = style->label_text;
+    } else if(style->label_field) {
+        fieldidx = OGR_F_GetFieldIndex(ftr, style->label_field);
+        if(fieldidx < 0) {
+            fprintf(stderr, "invalid label field name '%s'\n", style->label_field);
+            return -1;
+        } else if(OGR_Fld_IsIgnored(OGR_F_GetFieldDefnRef(ftr, fieldidx))) {
+            // (not in vfr_fields, so never read)
+            if(g_label_unread != OGR_F_GetDefnRef(ftr)) {
+                g_label_unread = OGR_F_GetDefnRef(ftr);
+                fprintf(stderr, "label field '%s' isn't read: add it to vfr_fields\n",
+                    style->label_field);
+            }
         } else {
-            cairo_line_to(cr, pxx, pxy);
+            text = OGR_F_GetFieldAsString(ftr, fieldidx);
         }
     }
-    OGR_G_GetPoint(geom2, 0, &x, &y, &z);
-    pxx = (x - ext->MinX)/pxw;
-    pxy = (ext->MaxY - y)/pxh;
-    cairo_line_to(cr, pxx, pxy);
-    if(style->fill <= 0xffffff) {
-        hatchpat = make_fill_pattern(style);
-        if(hatchpat != NULL) {
-            cairo_set_source(cr, hatchpat);
-        } else {
-            cairo_set_source_rgba(cr, 
-                    vfr_color_compextr(style->fill, 'r'), 
-                    vfr_color_compextr(style->fill, 'g'), 
-                    vfr_color_compextr(style->fill, 'b'),
-                    ((float)style->fill_opacity)/100.0);
+    if(text == NULL || !*text) return 0;
+
+    memset(&lbl, 0, sizeof(lbl));
+    lbl.kind = VFRLBL_LAYOUT;
+    lbl.fill = style->label_fill;
+    lbl.opacity = style->label_opacity;
+    lbl.halo_fill = style->label_halo_fill;
+    lbl.halo_size = style->label_halo_size;
+    lbl.halo_mode = style->label_halo;
+    lbl.priority = style->label_priority;
+    lbl.overlap = (style->label_flags & VFRLABEL_OVRLAP) != 0;
+
+    // position
+    switch(wkbFlatten(OGR_G_GetGeometryType(geom))) {
+        case wkbPoint:
+            outline = cached_outline(cr, text, style->label_fontdesc, -1, 0);
+            OGR_G_GetPoint(geom, 0, &x, &y, &z);
+            lbl.x = (x - ext->MinX)/pxw + style->size/2.0;
+            lbl.y = (ext->MaxY - y)/pxh;
+            break;
+        case wkbLineString:
+        case wkbMultiLineString:
+            // set aside until the layer's read, so parts can be joined.
+            // x/y hold the offsets till then.
+            lbl.outline = cached_outline(cr, text, style->label_fontdesc, -1, VFROUTLINE_LINE);
+            lbl.x = style->label_xoffset;
+            lbl.y = style->label_yoffset;
+            if(wkbFlatten(OGR_G_GetGeometryType(geom)) == wkbLineString) {
+                if(vfr_geom_to_px(geom, ext, pxw, pxh, &g_coords)) {
+                    vfr_lines_add(&g_lines, &g_coords, &lbl);
+                }
+            } else {
+                for(i=0; i<OGR_G_GetGeometryCount(geom); i++) {
+                    if(vfr_geom_to_px(OGR_G_GetGeometryRef(geom, i), ext, pxw, pxh, &g_coords)) {
+                        vfr_lines_add(&g_lines, &g_coords, &lbl);
+                    }
+                }
+            }
+            return 0;
+        case wkbPolygon:
+        case wkbMultiPolygon:
+            if(style->label_place == VFRPLACE_INSIDE) {
+                if(!vfr_pole_anchor(ftr, geom, ext, pxw, pxh, &pxx, &pxy, &radius)) break;
+                // wrap to fit the largest circle inside
+                if(style->label_width > 0) {
+                    wrap_width = style->label_width/pxw*PANGO_SCALE;
+                } else {
+                    wrap_width = 2.0*radius*PANGO_SCALE;
+                }
+                if(wrap_width < PANGO_SCALE) wrap_width = -1;
+                outline = cached_outline(cr, text, style->label_fontdesc, wrap_width,
+                    VFROUTLINE_CENTER|VFROUTLINE_WRAP);
+                lbl.x = pxx - outline->lyow/PANGO_SCALE/2.0 + style->label_xoffset;
+                lbl.y = pxy - outline->lyoh/PANGO_SCALE/2.0 + style->label_yoffset;
+                break;
+            }
+            // else centroid
+        default:
+            centroid = OGR_G_CreateGeometry(wkbPoint);
+            if(OGR_G_Centroid(geom, centroid) == OGRERR_FAILURE) {
+                fprintf(stderr, "could not get centroid\n");
+            }
+
+            if(style->label_width > 0) {
+                wrap_width = style->label_width/pxw*PANGO_SCALE;
+            } else {
+                OGR_G_GetEnvelope(geom, &envelope); 
+                wrap_width = (envelope.MaxX-envelope.MinX)/pxw*PANGO_SCALE;
+            }
+
+            OGR_G_GetPoint(centroid, 0, &x, &y, &z);
+            OGR_G_DestroyGeometry(centroid);
+            pxx = (x - ext->MinX)/pxw;
+            pxx -= (wrap_width/PANGO_SCALE)/2.0;
+            pxy = (ext->MaxY - y)/pxh;
+            pxx += style->label_xoffset;
+            pxy += style->label_yoffset;
+
+            outline = cached_outline(cr, text, style->label_fontdesc, wrap_width,
+                VFROUTLINE_CENTER|VFROUTLINE_WRAP);
+            pxy -= outline->lyoh/PANGO_SCALE/2.0;
+            lbl.x = pxx;
+            lbl.y = pxy;
+            break;
+    }
+
+    if(outline == NULL) return 0;
+    lbl.outline = outline;
+
+    vfr_label_box(&lbl);
+    vfr_labels_push(&g_labels, &lbl);
+    
+    return 0;
+}
+
+// draws a placed label. text along a path is filled from its cached
+// outline; other text is shown as text (so it stays text in svg and gets
+// hinted glyphs), w/ the outline only used for its halo.
+static int vfr_draw_label(cairo_t *cr, vfr_label_t *lbl) {
+
+    cairo_path_t *plyopath = NULL;
+
+    cached_context(cr); // (so the layout matches cr)
+    cairo_new_path(cr);
+    if(lbl->kind == VFRLBL_PATH) {
+        cairo_append_path(cr, outline_path(cr, lbl->outline));
+        plyopath = cairo_copy_path_flat(cr);
+        cairo_new_path(cr);
+        // put layout points on path
+        transform_label_points(plyopath, &lbl->path);
+    } else if(lbl->halo_fill <= 0xffffff) {
+        outline_path(cr, lbl->outline);
+        cairo_save(cr);
+        cairo_translate(cr, lbl->x, lbl->y);
+        cairo_append_path(cr, lbl->outline->path);
+        cairo_restore(cr);
+        plyopath = cairo_copy_path_flat(cr);
+        cairo_new_path(cr);
+    }
+    if(lbl->halo_fill <= 0xffffff) {
+        make_label_halo(cr, plyopath, lbl);
+    }
+    cairo_set_source_rgba(cr,
+        vfr_color_compextr(lbl->fill, 'r'),
+        vfr_color_compextr(lbl->fill, 'g'),
+        vfr_color_compextr(lbl->fill, 'b'),
+        ((float)lbl->opacity)/100.0);
+    cairo_new_path(cr);
+    if(lbl->kind == VFRLBL_PATH) {
+        cairo_append_path(cr, plyopath);
+        cairo_fill(cr);
+    } else {
+        cairo_move_to(cr, lbl->x, lbl->y);
+        pango_cairo_show_layout(cr, lbl->outline->layout);
+        cairo_new_path(cr);
+    }
+    if(plyopath != NULL) cairo_path_destroy(plyopath);
+    
+    return 0;
+}
+
+// box (incl. halo) for collision tests
+static void vfr_label_box(vfr_label_t *lbl) {
+    int i;
+    double halo = lbl->halo_fill <= 0xffffff ? lbl->halo_size : 0.0;
+    vfr_outline_t *outline = lbl->outline;
+    if(lbl->kind == VFRLBL_PATH) {
+        // the text runs along the path, at most its height away from it
+        lbl->box.MinX = lbl->box.MaxX = lbl->path.xy[0];
+        lbl->box.MinY = lbl->box.MaxY = lbl->path.xy[1];
+        for(i=1; i<lbl->path.n; i++) {
+            if(lbl->path.xy[2*i] < lbl->box.MinX) lbl->box.MinX = lbl->path.xy[2*i];
+            if(lbl->path.xy[2*i] > lbl->box.MaxX) lbl->box.MaxX = lbl->path.xy[2*i];
+            if(lbl->path.xy[2*i+1] < lbl->box.MinY) lbl->box.MinY = lbl->path.xy[2*i+1];
+            if(lbl->path.xy[2*i+1] > lbl->box.MaxY) lbl->box.MaxY = lbl->path.xy[2*i+1];
         }
-        if(style->stroke <= 0xffffff) {
-            cairo_fill_preserve(cr);
-        } else {
-            cairo_fill(cr);
+        halo += (double)outline->lyoh/PANGO_SCALE;
+        lbl->box.MinX -= halo;
+        lbl->box.MinY -= halo;
+        lbl->box.MaxX += halo;
+        lbl->box.MaxY += halo;
+    } else {
+        lbl->box.MinX = lbl->x + outline->rect.x - halo;
+        lbl->box.MinY = lbl->y + outline->rect.y - halo;
+        lbl->box.MaxX = lbl->x + outline->rect.x + outline->rect.width + halo;
+        lbl->box.MaxY = lbl->y + outline->rect.y + outline->rect.height + halo;
+    }
+}
+
+// keeps a line (part) to be labelled once the layer is read
+static void vfr_lines_add(vfr_lines_t *lines, vfr_coords_t *pts, vfr_label_t *tmpl) {
+    vfr_linepiece_t *piece;
+    if(pts->n < 2) return;
+    if(lines->n + pts->n > lines->cap) {
+        lines->cap = lines->n + pts->n > lines->cap*2 ? lines->n + pts->n : lines->cap*2;
+        lines->xy = realloc(lines->xy, 2*lines->cap*sizeof(double));
+    }
+    if(lines->npieces == lines->piececap) {
+        lines->piececap = lines->piececap ? lines->piececap*2 : 256;
+        lines->pieces = realloc(lines->pieces, lines->piececap*sizeof(vfr_linepiece_t));
+    }
+    if(lines->xy == NULL || lines->pieces == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    piece = &lines->pieces[lines->npieces++];
+    piece->tmpl = *tmpl;
+    piece->start = lines->n;
+    piece->n = pts->n;
+    piece->used = 0;
+    memcpy(lines->xy + 2*lines->n, pts->xy, 2*pts->n*sizeof(double));
+    lines->n += pts->n;
+}
+
+static unsigned long line_end_hash(vfr_outline_t *outline, long long qx, long long qy) {
+    return ((unsigned long)qx*73856093UL) ^ ((unsigned long)qy*19349663UL) ^
+        ((unsigned long)(uintptr_t)outline >> 4);
+}
+
+// unused piece w/ the same text and an end at pt, or -1. *tail is set
+// if it's the piece's last point that matched.
+static int line_end_find(vfr_lines_t *lines, vfr_outline_t *outline, double *pt, int *tail) {
+    int k;
+    long long qx = llround(pt[0]*VFRLINE_SNAP), qy = llround(pt[1]*VFRLINE_SNAP);
+    vfr_lineend_t *end;
+    k = lines->buckets[line_end_hash(outline, qx, qy) & (lines->nbuckets-1)];
+    for(; k>=0; k=end->next) {
+        end = &lines->ends[k];
+        if(end->qx == qx && end->qy == qy && end->outline == outline &&
+                !lines->pieces[end->piece].used) {
+            *tail = end->tail;
+            return end->piece;
+        }
+    }
+    return -1;
+}
+
+// first (tail = 0) or last point of a piece
+static double* line_end_pt(vfr_lines_t *lines, int piece, int tail) {
+    vfr_linepiece_t *p = &lines->pieces[piece];
+    return &lines->xy[2*(p->start + (tail ? p->n-1 : 0))];
+}
+
+// joins the layer's line pieces that share an end point and label text
+// into chains, and queues labels along each chain
+static void vfr_queue_lines(cairo_t *cr, vfr_lines_t *lines) {
+    int i, k, e, p, q, tail, nbuckets, first, last, rev, nchain, step;
+    double *pt, *src, tmp;
+    vfr_linepiece_t *piece;
+    vfr_lineend_t *end;
+    vfr_outline_t *outline;
+    vfr_coords_t *pts = &g_coords;
+
+    if(!lines->npieces) return;
+
+    // hash every piece's ends
+    for(nbuckets=1024; nbuckets < 4*lines->npieces; nbuckets*=2);
+    if(nbuckets > lines->nbuckets) {
+        lines->buckets = realloc(lines->buckets, nbuckets*sizeof(int));
+        lines->nbuckets = nbuckets;
+    }
+    lines->ends = realloc(lines->ends, 2*lines->npieces*sizeof(vfr_lineend_t));
+    lines->chain = realloc(lines->chain, (2*lines->npieces+1)*sizeof(int));
+    if(lines->buckets == NULL || lines->ends == NULL || lines->chain == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(lines->buckets, 0xff, lines->nbuckets*sizeof(int)); // -1
+    for(i=0, e=0; i<lines->npieces; i++) {
+        for(tail=0; tail<2; tail++, e++) {
+            pt = line_end_pt(lines, i, tail);
+            end = &lines->ends[e];
+            end->outline = lines->pieces[i].tmpl.outline;
+            end->qx = llround(pt[0]*VFRLINE_SNAP);
+            end->qy = llround(pt[1]*VFRLINE_SNAP);
+            end->piece = i;
+            end->tail = tail;
+            k = line_end_hash(end->outline, end->qx, end->qy) & (lines->nbuckets-1);
+            end->next = lines->buckets[k];
+            lines->buckets[k] = e;
+        }
+    }
+
+    for(i=0; i<lines->npieces; i++) {
+        if(lines->pieces[i].used) continue;
+        outline = lines->pieces[i].tmpl.outline;
+        lines->pieces[i].used = 1;
+        // chain holds piece*2 (+1 if reversed). walk forward from the
+        // piece's last point, then back from its first.
+        first = last = lines->npieces;
+        lines->chain[first] = i*2;
+        pt = line_end_pt(lines, i, 1);
+        while((q = line_end_find(lines, outline, pt, &tail)) >= 0) {
+            lines->pieces[q].used = 1;
+            lines->chain[++last] = q*2 + tail; // joined at its last point: reverse
+            pt = line_end_pt(lines, q, !tail);
+        }
+        pt = line_end_pt(lines, i, 0);
+        while((q = line_end_find(lines, outline, pt, &tail)) >= 0) {
+            lines->pieces[q].used = 1;
+            lines->chain[--first] = q*2 + !tail; // joined at its first point: reverse
+            pt = line_end_pt(lines, q, !tail);
+        }
+
+        // copy the chain's points, dropping the shared ones
+        for(k=first, nchain=0; k<=last; k++) {
+            nchain += lines->pieces[lines->chain[k]/2].n;
+        }
+        vfr_coords_reserve(pts, nchain);
+        pts->n = 0;
+        for(k=first; k<=last; k++) {
+            p = lines->chain[k]/2;
+            rev = lines->chain[k]%2;
+            piece = &lines->pieces[p];
+            src = &lines->xy[2*piece->start];
+            for(e=(k==first ? 0 : 1); e<piece->n; e++) {
+                q = rev ? piece->n-1-e : e;
+                pts->xy[2*pts->n] = src[2*q];
+                pts->xy[2*pts->n+1] = src[2*q+1];
+                pts->n++;
+            }
+        }
+        // read left to right
+        if(pts->xy[2*(pts->n-1)] < pts->xy[0]) {
+            for(k=0, step=pts->n-1; k<step; k++, step--) {
+                pt = &pts->xy[2*k];
+                src = &pts->xy[2*step];
+                tmp = pt[0]; pt[0] = src[0]; src[0] = tmp;
+                tmp = pt[1]; pt[1] = src[1]; src[1] = tmp;
+            }
+        }
+        vfr_queue_chain(cr, pts, &lines->pieces[i].tmpl);
+    }
+
+    lines->n = lines->npieces = 0;
+}
+
+// queues one or a few labels along a chain, or one across its middle
+// if it's too short for the text
+static void vfr_queue_chain(cairo_t *cr, vfr_coords_t *pts, vfr_label_t *tmpl) {
+    int k, nlabels, j;
+    double lblwidth, s, rat, cx, cy, *a;
+    vfr_label_t lbl;
+    vfr_outline_t *outline = tmpl->outline, *flat;
+
+    parametrize_coords(pts, &g_linepath);
+    lblwidth = (double)outline->lyow/PANGO_SCALE;
+    if(g_linepath.n >= 2 && lblwidth <= g_linepath.length) {
+        nlabels = g_linepath.length/(lblwidth*VFRLINE_REPEAT);
+        if(nlabels < 1) nlabels = 1;
+        if(nlabels > VFRLINE_MAXLABELS) nlabels = VFRLINE_MAXLABELS;
+        for(k=0; k<nlabels; k++) {
+            lbl = *tmpl;
+            lbl.kind = VFRLBL_PATH;
+            memset(&lbl.path, 0, sizeof(lbl.path));
+            if(!get_linear_label_path(&g_linepath, lblwidth, (k+0.5)/nlabels, &lbl.path)) {
+                paramd_free(&lbl.path);
+                continue;
+            }
+            vfr_label_box(&lbl);
+            vfr_labels_push(&g_labels, &lbl);
+        }
+        return;
+    }
+    if(!g_linepath.n) return;
+
+    // horizontal, centered on the middle of the line
+    if(g_linepath.n >= 2) {
+        s = g_linepath.length/2.0;
+        j = paramd_segment(&g_linepath, s);
+        a = &g_linepath.xy[2*j];
+        rat = (s - g_linepath.cum[j])/(g_linepath.cum[j+1] - g_linepath.cum[j]);
+        cx = a[0] + rat*(a[2] - a[0]);
+        cy = a[1] + rat*(a[3] - a[1]);
+    } else {
+        cx = g_linepath.xy[0];
+        cy = g_linepath.xy[1];
+    }
+    flat = cached_outline(cr, outline->text, outline->fontdesc, -1, VFROUTLINE_CENTER);
+    lbl = *tmpl;
+    lbl.outline = flat;
+    lbl.kind = VFRLBL_LAYOUT;
+    lbl.x = cx - flat->lyow/PANGO_SCALE/2.0 + tmpl->x;
+    lbl.y = cy - flat->lyoh/PANGO_SCALE/2.0 + tmpl->y;
+    vfr_label_box(&lbl);
+    vfr_labels_push(&g_labels, &lbl);
+}
+
+static void vfr_labels_push(vfr_labels_t *labels, vfr_label_t *lbl) {
+    if(labels->n == labels->cap) {
+        labels->cap = labels->cap ? labels->cap*2 : 256;
+        labels->items = realloc(labels->items, labels->cap*sizeof(vfr_label_t));
+        if(labels->items == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    lbl->seq = labels->n;
+    labels->items[labels->n++] = *lbl;
+}
+
+static void vfr_labels_clear(vfr_labels_t *labels) {
+    int i;
+    for(i=0; i<labels->n; i++) {
+        paramd_free(&labels->items[i].path);
+    }
+    labels->n = 0;
+}
+
+// higher priority first, then in feature order
+static int label_cmp(const void *a, const void *b) {
+    const vfr_label_t *la = a, *lb = b;
+    if(la->priority != lb->priority) {
+        return la->priority > lb->priority ? -1 : 1;
+    }
+    return la->seq < lb->seq ? -1 : (la->seq > lb->seq);
+}
+
+// range of grid cells (clamped to the grid) under box. 0 if none.
+static int label_grid_range(vfr_label_grid_t *grid, OGREnvelope *box,
+        int *c0, int *r0, int *c1, int *r1) {
+    *c0 = floor(box->MinX/VFRLABEL_CELL);
+    *r0 = floor(box->MinY/VFRLABEL_CELL);
+    *c1 = floor(box->MaxX/VFRLABEL_CELL);
+    *r1 = floor(box->MaxY/VFRLABEL_CELL);
+    if(*c1 < 0 || *r1 < 0 || *c0 >= grid->cols || *r0 >= grid->rows) return 0;
+    if(*c0 < 0) *c0 = 0;
+    if(*r0 < 0) *r0 = 0;
+    if(*c1 >= grid->cols) *c1 = grid->cols-1;
+    if(*r1 >= grid->rows) *r1 = grid->rows-1;
+    return 1;
+}
+
+// does box overlap a box already in the grid?
+static int label_grid_hit(vfr_label_grid_t *grid, OGREnvelope *box) {
+    int c, r, c0, r0, c1, r1, k;
+    vfr_label_cell_t *cell;
+    OGREnvelope *other;
+    if(!label_grid_range(grid, box, &c0, &r0, &c1, &r1)) return 0;
+    for(r=r0; r<=r1; r++) {
+        for(c=c0; c<=c1; c++) {
+            cell = &grid->cells[r*grid->cols+c];
+            for(k=0; k<cell->n; k++) {
+                other = &grid->boxes[cell->items[k]];
+                if(box->MinX < other->MaxX && box->MaxX > other->MinX &&
+                        box->MinY < other->MaxY && box->MaxY > other->MinY) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static void label_grid_add(vfr_label_grid_t *grid, OGREnvelope *box) {
+    int c, r, c0, r0, c1, r1;
+    vfr_label_cell_t *cell;
+    int idx = grid->nboxes++;
+    grid->boxes[idx] = *box;
+    if(!label_grid_range(grid, box, &c0, &r0, &c1, &r1)) return;
+    for(r=r0; r<=r1; r++) {
+        for(c=c0; c<=c1; c++) {
+            cell = &grid->cells[r*grid->cols+c];
+            if(cell->n == cell->cap) {
+                cell->cap = cell->cap ? cell->cap*2 : 4;
+                cell->items = realloc(cell->items, cell->cap*sizeof(int));
+                if(cell->items == NULL) {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+            }
+            cell->items[cell->n++] = idx;
+        }
+    }
+}
+
+// draws the queued labels in priority order, skipping any that would
+// overlap one already drawn (unless flagged to overlap). labels are tested
+// against a uniform grid of placed boxes, so this stays near-linear.
+// returns the number of labels drawn.
+static long vfr_place_labels(cairo_t *cr, int iw, int ih) {
+    vfr_labels_t *labels = &g_labels;
+    vfr_label_grid_t grid;
+    vfr_label_t *lbl;
+    long i, placed = 0;
+
+    if(!labels->n) return 0;
+    qsort(labels->items, labels->n, sizeof(vfr_label_t), label_cmp);
+
+    grid.cols = iw/VFRLABEL_CELL + 1;
+    grid.rows = ih/VFRLABEL_CELL + 1;
+    grid.cells = calloc(grid.cols*grid.rows, sizeof(vfr_label_cell_t));
+    grid.boxes = malloc(labels->n*sizeof(OGREnvelope));
+    grid.nboxes = 0;
+    if(grid.cells == NULL || grid.boxes == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for(i=0; i<labels->n; i++) {
+        lbl = &labels->items[i];
+        if(lbl->box.MaxX < 0 || lbl->box.MaxY < 0 || lbl->box.MinX > iw || lbl->box.MinY > ih) {
+            continue; // off the canvas
+        }
+        if(!lbl->overlap && label_grid_hit(&grid, &lbl->box)) {
+            continue;
+        }
+        label_grid_add(&grid, &lbl->box);
+        vfr_draw_label(cr, lbl);
+        placed++;
+    }
+
+    for(i=0; i<grid.cols*grid.rows; i++) {
+        free(grid.cells[i].items);
+    }
+    free(grid.cells);
+    free(grid.boxes);
+    return placed;
+}
+
+// adds geom's rings (polygon or multipolygon), in px, to rings
+static int pole_rings(OGRGeometryH geom, OGREnvelope *ext, double pxw, double pxh,
+        vfr_rings_t *rings) {
+    int i, j, nparts, nrings;
+    OGRGeometryH part, ring;
+    OGRwkbGeometryType gtype = wkbFlatten(OGR_G_GetGeometryType(geom));
+
+    nparts = gtype == wkbMultiPolygon ? OGR_G_GetGeometryCount(geom) : 1;
+    for(i=0; i<nparts; i++) {
+        part = gtype == wkbMultiPolygon ? OGR_G_GetGeometryRef(geom, i) : geom;
+        nrings = OGR_G_GetGeometryCount(part);
+        for(j=0; j<nrings; j++) {
+            ring = OGR_G_GetGeometryRef(part, j);
+            if(vfr_geom_to_px(ring, ext, pxw, pxh, &g_coords) < 3) continue;
+            if(rings->n + g_coords.n > rings->cap) {
+                rings->cap = rings->n + g_coords.n > rings->cap*2 ?
+                    rings->n + g_coords.n : rings->cap*2;
+                rings->xy = realloc(rings->xy, 2*rings->cap*sizeof(double));
+            }
+            if(rings->nrings == rings->ringcap) {
+                rings->ringcap = rings->ringcap ? rings->ringcap*2 : 16;
+                rings->ends = realloc(rings->ends, rings->ringcap*sizeof(int));
+            }
+            if(rings->xy == NULL || rings->ends == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            memcpy(rings->xy + 2*rings->n, g_coords.xy, 2*g_coords.n*sizeof(double));
+            rings->n += g_coords.n;
+            rings->ends[rings->nrings++] = rings->n;
+        }
+    }
+    return rings->nrings;
+}
+
+// distance from (x, y) to the nearest ring edge; negative outside
+static double pole_dist(vfr_rings_t *rings, double x, double y) {
+    int r, i, j, start = 0, inside = 0;
+    double p[2] = {x, y}, *a, *b, d, mind = INFINITY;
+    for(r=0; r<rings->nrings; r++) {
+        for(i=start, j=rings->ends[r]-1; i<rings->ends[r]; j=i++) {
+            a = &rings->xy[2*i];
+            b = &rings->xy[2*j];
+            if((a[1] > y) != (b[1] > y) &&
+                    x < (b[0] - a[0])*(y - a[1])/(b[1] - a[1]) + a[0]) {
+                inside = !inside;
+            }
+            d = seg_dist_sq(p, a, b);
+            if(d < mind) mind = d;
         }
+        start = rings->ends[r];
     }
-    if(hatchpat != NULL) {
-        cairo_pattern_destroy(hatchpat);
+    return (inside ? 1.0 : -1.0)*sqrt(mind);
+}
+
+// adds the cell centered at (x, y), h px from center to edge, to the heap
+static void pole_push(vfr_poleheap_t *heap, vfr_rings_t *rings, double x, double y, double h) {
+    int i, parent;
+    vfr_polecell_t cell, tmp;
+    cell.x = x;
+    cell.y = y;
+    cell.h = h;
+    cell.d = pole_dist(rings, x, y);
+    cell.max = cell.d + h*M_SQRT2; // best distance possible in the cell
+    if(heap->n == heap->cap) {
+        heap->cap = heap->cap ? heap->cap*2 : 256;
+        heap->cells = realloc(heap->cells, heap->cap*sizeof(vfr_polecell_t));
+        if(heap->cells == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
     }
-    if(style->stroke <= 0xffffff) {
-        cairo_set_source_rgba(cr, 
-                vfr_color_compextr(style->stroke, 'r'), 
-                vfr_color_compextr(style->stroke, 'g'), 
-                vfr_color_compextr(style->stroke, 'b'),
-                ((float)style->stroke_opacity)/100.0); 
-        cairo_set_line_width(cr, style->size);
-        cairo_stroke(cr);
+    i = heap->n++;
+    heap->cells[i] = cell;
+    while(i > 0) {
+        parent = (i-1)/2;
+        if(heap->cells[parent].max >= heap->cells[i].max) break;
+        tmp = heap->cells[parent];
+        heap->cells[parent] = heap->cells[i];
+        heap->cells[i] = tmp;
+        i = parent;
     }
-    return 0;
 }
 
+// removes the cell w/ the greatest potential distance from the heap
+static vfr_polecell_t pole_pop(vfr_poleheap_t *heap) {
+    int i = 0, l, r, big;
+    vfr_polecell_t top = heap->cells[0], tmp;
+    heap->cells[0] = heap->cells[--heap->n];
+    while(1) {
+        l = 2*i+1;
+        r = l+1;
+        big = i;
+        if(l < heap->n && heap->cells[l].max > heap->cells[big].max) big = l;
+        if(r < heap->n && heap->cells[r].max > heap->cells[big].max) big = r;
+        if(big == i) break;
+        tmp = heap->cells[big];
+        heap->cells[big] = heap->cells[i];
+        heap->cells[i] = tmp;
+        i = big;
+    }
+    return top;
+}
 
-static int vfr_draw_label(cairo_t *cr, OGRFeatureH ftr, OGRGeometryH geom,
-        OGREnvelope *ext, double pxw, double pxh, vfr_style_t *style) {
-    
-    if(!style->label_place) return 0;
-    
-    //fprintf(stderr, "label feature #%ld\n", OGR_F_GetFID(ftr));
+// pole of inaccessibility (the point inside furthest from any edge) of
+// rings, to within precision px. quadtree search over cells, most
+// promising first, as in mapbox's polylabel.
+static int polylabel(vfr_rings_t *rings, double precision, double *px, double *py, double *pr) {
+    int i, r, start;
+    double minx, miny, maxx, maxy, w, h, size, x, y, f, area, cx, cy, *a, *b;
+    vfr_poleheap_t *heap = &g_poleheap;
+    vfr_polecell_t best, cell;
 
-    PangoFontDescription *fdesc;
-    PangoLayout *plyo;
-    int i, pcount, fieldidx;
-    OGRGeometryH centroid;
-    OGREnvelope envelope;
-    cairo_path_t *ftrpath, *lblpath, *plyopath;
-    PangoLayoutLine *line;
-    double x, y, z, pxx, pxy, wrap_width;
-    int lyow, lyoh;
-    paramd_path_t paramd_ftrpath, paramd_lblpath;
-    param_t* params;
-    double pathlen, lblwidth;
+    if(!rings->n) return 0;
+    minx = maxx = rings->xy[0];
+    miny = maxy = rings->xy[1];
+    for(i=1; i<rings->n; i++) {
+        x = rings->xy[2*i];
+        y = rings->xy[2*i+1];
+        if(x < minx) minx = x;
+        if(x > maxx) maxx = x;
+        if(y < miny) miny = y;
+        if(y > maxy) maxy = y;
+    }
+    w = maxx - minx;
+    h = maxy - miny;
+    size = w < h ? w : h;
+    if(size <= 0.0) {
+        *px = minx;
+        *py = miny;
+        *pr = 0.0;
+        return 1;
+    }
 
-    cairo_set_source_rgba(cr,
-            vfr_color_compextr(style->label_fill, 'r'),
-            vfr_color_compextr(style->label_fill, 'g'),
-            vfr_color_compextr(style->label_fill, 'b'),
-            ((float)style->label_opacity)/100.0);
+    heap->n = 0;
+    for(x=minx; x<maxx; x+=size) {
+        for(y=miny; y<maxy; y+=size) {
+            pole_push(heap, rings, x + size/2.0, y + size/2.0, size/2.0);
+        }
+    }
 
-    // layout
-    plyo = pango_cairo_create_layout(cr);
-    if(style->label_text != NULL) {
-        pango_layout_set_text(plyo, style->label_text, -1);
-    } else if(style->label_field) {
-        fieldidx = OGR_F_GetFieldIndex(ftr, style->label_field);
-        if(fieldidx < 0) {
-            fprintf(stderr, "invalid label field name '%s'\n", style->label_field);
-            return -1;
-        } else {
-            pango_layout_set_text(plyo, OGR_F_GetFieldAsString(ftr, fieldidx), -1);
+    // start w/ the centroid, or the bbox center if that's better
+    area = cx = cy = 0.0;
+    for(r=0, start=0; r<rings->nrings; start=rings->ends[r++]) {
+        for(i=start; i<rings->ends[r]; i++) {
+            a = &rings->xy[2*i];
+            b = &rings->xy[2*(i+1 < rings->ends[r] ? i+1 : start)];
+            f = a[0]*b[1] - b[0]*a[1];
+            cx += (a[0] + b[0])*f;
+            cy += (a[1] + b[1])*f;
+            area += f*3.0;
         }
     }
-    if(style->label_fontdesc == NULL) {
-        fdesc = pango_font_description_from_string(VFRDEFAULT_FONTDESC);
+    if(area != 0.0) {
+        best.x = cx/area;
+        best.y = cy/area;
     } else {
-        fdesc = pango_font_description_from_string(style->label_fontdesc);
+        best.x = rings->xy[0];
+        best.y = rings->xy[1];
     }
-    pango_layout_set_font_description(plyo, fdesc);
-
-    // position
-    switch(wkbFlatten(OGR_G_GetGeometryType(geom))) {
-        case wkbPoint:
-            OGR_G_GetPoint(geom, 0, &x, &y, &z);
-            pxx = (x - ext->MinX)/pxw;
-            pxx += style->size/2.0;
-            pxy = (ext->MaxY - y)/pxh;
-            pango_cairo_layout_path(cr, plyo);
-            plyopath = cairo_copy_path_flat(cr);
-            if(style->label_halo_fill <= 0xffffff) {
-                make_label_halo(cr, plyopath, style);
-            }
-            cairo_path_destroy(plyopath);
-            cairo_set_source_rgba(cr,
-                vfr_color_compextr(style->label_fill, 'r'),
-                vfr_color_compextr(style->label_fill, 'g'),
-                vfr_color_compextr(style->label_fill, 'b'),
-                ((float)style->label_opacity)/100.0);
-            cairo_move_to(cr, pxx, pxy);
-            pango_cairo_show_layout(cr, plyo);
-            break;
-        case wkbMultiLineString:
-            fprintf(stderr, "multilinestring labelling not implemented\n");
-            break;
-        case wkbLineString:
-            // trace line path
-            cairo_new_path(cr);
-            pcount = OGR_G_GetPointCount(geom);
-            if(!pcount) return 0;
-            for(i = 0; i < pcount; i++) {
-                OGR_G_GetPoint(geom, i, &x, &y, &z);
-                pxx = (x - ext->MinX)/pxw;
-                pxy = (ext->MaxY - y)/pxh;
-                if(!i) {
-                    cairo_move_to(cr, pxx, pxy);
-                    continue;
-                } else {
-                    cairo_line_to(cr, pxx, pxy);
-                }
-            }
-            // save and copy line path
-            cairo_save(cr);
-            ftrpath = cairo_copy_path_flat(cr);
-            // parametrize path
-            params = parametrize_path(ftrpath, &pathlen);
-            paramd_ftrpath.params = params;
-            paramd_ftrpath.path = ftrpath;
-            paramd_ftrpath.length = pathlen;
-            // get middle segments as new path (.5 = midpoint)
-            pango_layout_get_size(plyo, &lyow, &lyoh);
-            lblwidth = (double)lyow/PANGO_SCALE;
-            lblpath = get_linear_label_path(cr, &paramd_ftrpath, lblwidth, 0.5);
-            cairo_path_destroy(ftrpath);
-            ftrpath = NULL;
-            paramd_ftrpath.path = NULL;
-            free(params);
-            paramd_ftrpath.params = NULL;
-            if(lblpath) {
-                params = parametrize_path(lblpath, &pathlen);
-                paramd_lblpath.params = params;
-                paramd_lblpath.path = lblpath;
-                paramd_lblpath.length = pathlen;
-                // get layout path
-                line = pango_layout_get_line_readonly(plyo, 0);
-                pxx = (&lblpath->data[0])[1].point.x;
-                pxy = (&lblpath->data[0])[1].point.y;
-                cairo_move_to(cr, pxx, pxy);
-                cairo_new_path(cr);
-                pango_cairo_layout_line_path(cr, line);
-                plyopath = cairo_copy_path_flat(cr);
-                cairo_new_path(cr);
-                // put layout points on path
-                transform_label_points(plyopath, &paramd_lblpath);
-                if(style->label_halo_fill <= 0xffffff) {
-                    make_label_halo(cr, plyopath, style);
-                }
-                cairo_set_source_rgba(cr,
-                    vfr_color_compextr(style->label_fill, 'r'),
-                    vfr_color_compextr(style->label_fill, 'g'),
-                    vfr_color_compextr(style->label_fill, 'b'),
-                    ((float)style->label_opacity)/100.0);
-                cairo_append_path(cr, plyopath);
-                cairo_path_destroy(plyopath);
-                plyopath = NULL;
-                cairo_fill(cr);
-            } else {
-                centroid = OGR_G_CreateGeometry(wkbPoint);
-                if(OGR_G_Centroid(geom, centroid) == OGRERR_FAILURE) {
-                    fprintf(stderr, "could not get centroid\n");
-                }
+    best.d = pole_dist(rings, best.x, best.y);
+    best.h = 0.0;
+    cell.x = minx + w/2.0;
+    cell.y = miny + h/2.0;
+    cell.d = pole_dist(rings, cell.x, cell.y);
+    if(cell.d > best.d) best = cell;
 
-                if(style->label_width > 0) {
-                    wrap_width = style->label_width/pxw*PANGO_SCALE;
-                } else {
-                    OGR_G_GetEnvelope(geom, &envelope); 
-                    wrap_width = (envelope.MaxX-envelope.MinX)/pxw*PANGO_SCALE;
-                }
+    while(heap->n) {
+        cell = pole_pop(heap);
+        if(cell.d > best.d) best = cell;
+        if(cell.max - best.d <= precision) continue;
+        h = cell.h/2.0;
+        pole_push(heap, rings, cell.x - h, cell.y - h, h);
+        pole_push(heap, rings, cell.x + h, cell.y - h, h);
+        pole_push(heap, rings, cell.x - h, cell.y + h, h);
+        pole_push(heap, rings, cell.x + h, cell.y + h, h);
+    }
+    *px = best.x;
+    *py = best.y;
+    *pr = best.d > 0.0 ? best.d : 0.0;
+    return 1;
+}
 
-                OGR_G_GetPoint(centroid, 0, &x, &y, &z);
-                pxx = (x - ext->MinX)/pxw;
-                pxx -= (wrap_width/PANGO_SCALE)/2.0;
-                pxy = (ext->MaxY - y)/pxh;
-
-                pango_layout_set_alignment(plyo, PANGO_ALIGN_CENTER);
-                pango_layout_set_width(plyo, -1);
-                pango_layout_get_size(plyo, &lyow, &lyoh);
-                pxy -= lyoh/PANGO_SCALE/2.0;
-                cairo_move_to(cr, pxx, pxy);
-                pango_cairo_layout_path(cr, plyo);
-                plyopath = cairo_copy_path_flat(cr);
-                if(style->label_halo_fill <= 0xffffff) {
-                    make_label_halo(cr, plyopath, style);
-                }
-                cairo_set_source_rgba(cr,
-                    vfr_color_compextr(style->label_fill, 'r'),
-                    vfr_color_compextr(style->label_fill, 'g'),
-                    vfr_color_compextr(style->label_fill, 'b'),
-                    ((float)style->label_opacity)/100.0);
-                cairo_path_destroy(plyopath);
-                pxx += style->label_xoffset;
-                pxy += style->label_yoffset;
-                cairo_move_to(cr, pxx, pxy);
-                pango_cairo_show_layout(cr, plyo);
-            }
-            break;
-        case wkbPolygon:
-        default:
-            centroid = OGR_G_CreateGeometry(wkbPoint);
-            if(OGR_G_Centroid(geom, centroid) == OGRERR_FAILURE) {
-                fprintf(stderr, "could not get centroid\n");
-            }
+// label anchor (px) and inscribed radius (px) for a polygon feature.
+// kept per feature (in map units), so tiles sharing a feature at the
+// same zoom only search once.
+static int vfr_pole_anchor(OGRFeatureH ftr, OGRGeometryH geom, OGREnvelope *ext,
+        double pxw, double pxh, double *px, double *py, double *pr) {
+    long i, nbuckets;
+    unsigned long hash;
+    long fid = OGR_F_GetFID(ftr);
+    OGRFeatureDefnH defn = OGR_F_GetDefnRef(ftr);
+    double precision = VFRPOLE_PRECISION*pxw;
+    vfr_pole_cache_t *c = &g_poles;
+    vfr_pole_t *p, *next, **buckets;
+    vfr_rings_t *rings = &g_rings;
 
-            if(style->label_width > 0) {
-                wrap_width = style->label_width/pxw*PANGO_SCALE;
-            } else {
-                OGR_G_GetEnvelope(geom, &envelope); 
-                wrap_width = (envelope.MaxX-envelope.MinX)/pxw*PANGO_SCALE;
+    hash = ((unsigned long)fid*2654435761UL) ^ ((unsigned long)(uintptr_t)defn >> 4);
+    if(fid != OGRNullFID && c->nbuckets) {
+        for(p=c->buckets[hash & (c->nbuckets-1)]; p!=NULL; p=p->next) {
+            if(p->fid == fid && p->defn == defn && p->precision <= precision) {
+                *px = (p->x - ext->MinX)/pxw;
+                *py = (ext->MaxY - p->y)/pxh;
+                *pr = p->r/pxw;
+                return 1;
             }
+        }
+    }
 
-            OGR_G_GetPoint(centroid, 0, &x, &y, &z);
-            pxx = (x - ext->MinX)/pxw;
-            pxx -= (wrap_width/PANGO_SCALE)/2.0;
-            pxy = (ext->MaxY - y)/pxh;
-            pxx += style->label_xoffset;
-            pxy += style->label_yoffset;
+    rings->n = rings->nrings = 0;
+    if(!pole_rings(geom, ext, pxw, pxh, rings)) return 0;
+    if(!polylabel(rings, VFRPOLE_PRECISION, px, py, pr)) return 0;
+    if(fid == OGRNullFID) return 1;
 
-            pango_layout_set_alignment(plyo, PANGO_ALIGN_CENTER);
-            pango_layout_set_width(plyo, wrap_width);
-            pango_layout_set_wrap(plyo, PANGO_WRAP_WORD_CHAR);
-            pango_layout_get_size(plyo, &lyow, &lyoh);
-            pxy -= lyoh/PANGO_SCALE/2.0;
-            cairo_move_to(cr, pxx, pxy);
-            pango_cairo_layout_path(cr, plyo);
-            plyopath = cairo_copy_path_flat(cr);
-            if(style->label_halo_fill <= 0xffffff) {
-                make_label_halo(cr, plyopath, style);
+    // remember it
+    for(p=c->nbuckets ? c->buckets[hash & (c->nbuckets-1)] : NULL; p!=NULL; p=p->next) {
+        if(p->fid == fid && p->defn == defn) break;
+    }
+    if(p == NULL) {
+        if(c->n >= c->nbuckets) {
+            nbuckets = c->nbuckets ? c->nbuckets*2 : 1024;
+            buckets = calloc(nbuckets, sizeof(vfr_pole_t*));
+            if(buckets == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
             }
-            cairo_set_source_rgba(cr,
-                vfr_color_compextr(style->label_fill, 'r'),
-                vfr_color_compextr(style->label_fill, 'g'),
-                vfr_color_compextr(style->label_fill, 'b'),
-                ((float)style->label_opacity)/100.0);
-            cairo_path_destroy(plyopath);
-            cairo_move_to(cr, pxx, pxy);
-            pango_cairo_show_layout(cr, plyo);
-            break;
+            for(i=0; i<c->nbuckets; i++) {
+                for(p=c->buckets[i]; p!=NULL; p=next) {
+                    next = p->next;
+                    p->next = buckets[p->hash & (nbuckets-1)];
+                    buckets[p->hash & (nbuckets-1)] = p;
+                }
+            }
+            free(c->buckets);
+            c->buckets = buckets;
+            c->nbuckets = nbuckets;
+        }
+        if((p = malloc(sizeof(vfr_pole_t))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        p->hash = hash;
+        p->fid = fid;
+        p->defn = defn;
+        p->next = c->buckets[hash & (c->nbuckets-1)];
+        c->buckets[hash & (c->nbuckets-1)] = p;
+        c->n++;
     }
-   
-    pango_font_description_free(fdesc);
-    
-    g_object_unref(plyo);
-    
-    return 0;
+    p->x = ext->MinX + *px*pxw;
+    p->y = ext->MaxY - *py*pxh;
+    p->r = *pr*pxw;
+    p->precision = precision;
+    return 1;
+}
+
+// forgets cached anchors (call before closing the datasource they're from)
+static void clear_pole_cache(void) {
+    long i;
+    vfr_pole_t *p, *next;
+    vfr_pole_cache_t *c = &g_poles;
+    for(i=0; i<c->nbuckets; i++) {
+        for(p=c->buckets[i]; p!=NULL; p=next) {
+            next = p->next;
+            free(p);
+        }
+        c->buckets[i] = NULL;
+    }
+    c->n = 0;
+}
+
+// frees this thread's scratch buffers and caches (call as a worker ends,
+// they're only reused by the thread that made them)
+static void free_scratch(void) {
+    clear_fill_patterns();
+    clear_outline_cache();
+    clear_font_cache();
+    clear_pole_cache();
+    vfr_labels_clear(&g_labels);
+    free(g_coords.xy);
+    free(g_coords.keep);
+    free(g_coords.stack);
+    memset(&g_coords, 0, sizeof(g_coords));
+    free(g_clipbuf.xy);
+    free(g_clipbuf.keep);
+    free(g_clipbuf.stack);
+    memset(&g_clipbuf, 0, sizeof(g_clipbuf));
+    free(g_edges.items);
+    memset(&g_edges, 0, sizeof(g_edges));
+    paramd_free(&g_linepath);
+    free(g_labels.items);
+    memset(&g_labels, 0, sizeof(g_labels));
+    free(g_rings.xy);
+    free(g_rings.ends);
+    memset(&g_rings, 0, sizeof(g_rings));
+    free(g_lines.xy);
+    free(g_lines.pieces);
+    free(g_lines.ends);
+    free(g_lines.buckets);
+    free(g_lines.chain);
+    memset(&g_lines, 0, sizeof(g_lines));
+    free(g_poleheap.cells);
+    memset(&g_poleheap, 0, sizeof(g_poleheap));
+    free(g_fonts.entries);
+    memset(&g_fonts, 0, sizeof(g_fonts));
+    free(g_outlines.buckets);
+    memset(&g_outlines, 0, sizeof(g_outlines));
+    free(g_poles.buckets);
+    memset(&g_poles, 0, sizeof(g_poles));
 }
 
 static double vfr_color_compextr(uint64_t color, char c) {
@@ -1260,110 +6056,115 @@ static double vfr_color_compextr(uint64_t color, char c) {
     return comp;
 }
 
-static double euclid_dist(cairo_path_data_t *pt1, cairo_path_data_t *pt2) {
-    double dx, dy;
-    dx = pt2->point.x - pt1->point.x;
-    dy = pt2->point.y - pt1->point.y;
-    return sqrt(dx*dx + dy*dy);    
-}
-
-static param_t* parametrize_path(cairo_path_t *path, double *plen) {
-    
-    int i;
-    cairo_path_data_t *pdat, lastmove, curpt;
-    param_t *params;
-
-    params = malloc(path->num_data*sizeof(param_t));
-    if(!params) {
+// makes sure pp has room for n vertices
+static void paramd_reserve(paramd_path_t *pp, int n) {
+    if(n <= pp->cap) return;
+    pp->cap = n > pp->cap*2 ? n : pp->cap*2;
+    pp->xy = realloc(pp->xy, 2*pp->cap*sizeof(double));
+    pp->cum = realloc(pp->cum, pp->cap*sizeof(double));
+    if(pp->xy == NULL || pp->cum == NULL) {
         fprintf(stderr, "out of memory\n");
         exit(1);
     }
-
-    *plen = 0.0;
-    
-    for(i=0; i < path->num_data; i += path->data[i].header.length) {
-        pdat = &path->data[i];
-        params[i] = 0.0;
-        switch(pdat->header.type) {
-            case CAIRO_PATH_MOVE_TO:
-                lastmove = pdat[1];
-                curpt = pdat[1];
-                break;
-            case CAIRO_PATH_CLOSE_PATH:
-                // close path by simulating line_to to
-                // most recent move_to
-                pdat = (&lastmove-1);
-            case CAIRO_PATH_LINE_TO:
-                params[i] = euclid_dist(&curpt, &pdat[1]);
-                *plen += params[i];
-                curpt = pdat[1];
-                break;
-            case CAIRO_PATH_CURVE_TO:
-            default:
-                fprintf(stderr, "labelling on curves not supported\n");
-                exit(1);
-                break;
-        }
-    }
-
-    return params;
 }
 
-static cairo_path_t* get_linear_label_path(cairo_t *cr, paramd_path_t *parpath, double txtwidth, double placeat) {
-
-    int i,j;
-    cairo_path_t *src, *path;
-    cairo_path_data_t curpt, nxtpt;
-    param_t *params;
-    double plen, dx, dy, rat, stx, sty, enx, eny;
+static void paramd_free(paramd_path_t *pp) {
+    free(pp->xy);
+    free(pp->cum);
+    memset(pp, 0, sizeof(paramd_path_t));
+}
 
-    if(txtwidth > parpath->length) {
-        return NULL;
+// appends a vertex, skipping repeats so no segment has zero length
+static void paramd_add(paramd_path_t *pp, double x, double y) {
+    double dx, dy;
+    if(pp->n) {
+        dx = x - pp->xy[2*(pp->n-1)];
+        dy = y - pp->xy[2*(pp->n-1)+1];
+        if(dx == 0.0 && dy == 0.0) return;
+        paramd_reserve(pp, pp->n+1);
+        pp->cum[pp->n] = pp->cum[pp->n-1] + sqrt(dx*dx + dy*dy);
+    } else {
+        paramd_reserve(pp, 1);
+        pp->cum[0] = 0.0;
     }
+    pp->xy[2*pp->n] = x;
+    pp->xy[2*pp->n+1] = y;
+    pp->n++;
+    pp->length = pp->cum[pp->n-1];
+}
 
-    src = parpath->path;
-    params = parpath->params;
-    plen = parpath->length*placeat;
-
-    cairo_save(cr);
-    cairo_new_path(cr);
-
-    // walk to beginning of label region
-    for(i=0; i<src->num_data && ((plen-params[i])>(txtwidth/2.0)); 
-            i += src->data[i].header.length) {
-        plen -= params[i];
-        curpt = (&src->data[i])[1];
+// builds the cumulative arc-length table for a line
+static void parametrize_coords(vfr_coords_t *pts, paramd_path_t *pp) {
+    int i;
+    pp->n = 0;
+    pp->length = 0.0;
+    pp->cursor = 0;
+    paramd_reserve(pp, pts->n);
+    for(i=0; i<pts->n; i++) {
+        paramd_add(pp, pts->xy[2*i], pts->xy[2*i+1]);
     }
-    nxtpt = (&src->data[i])[1];
-    dx = nxtpt.point.x - curpt.point.x;
-    dy = nxtpt.point.y - curpt.point.y;
-    rat = (plen-txtwidth/2.0)/params[i];
-    stx = curpt.point.x+rat*dx;
-    sty = curpt.point.y+rat*dy;
-    cairo_move_to(cr, stx, sty);
-    plen += txtwidth/2.0;
+}
 
-    // walk to end of label region
-    for(j=i; j<src->num_data && ((plen-params[j])>0.0);
-            j += src->data[j].header.length) {
-        plen -= params[j];
-        curpt = (&src->data[j])[1];
-        cairo_line_to(cr, curpt.point.x, curpt.point.y);
+// segment (0..n-2) holding arc length s. starts from the last segment
+// found, since glyph points mostly come in increasing order; falls back
+// to a binary search for longer jumps.
+static int paramd_segment(paramd_path_t *pp, double s) {
+    int j = pp->cursor, lo, hi, mid, k;
+    for(k=0; k<4; k++) {
+        if(j > 0 && s < pp->cum[j]) {
+            j--;
+        } else if(j < pp->n-2 && s >= pp->cum[j+1]) {
+            j++;
+        } else {
+            pp->cursor = j;
+            return j;
+        }
     }
-    nxtpt = (&src->data[j])[1];
-    rat = plen/params[j];
-    dx = nxtpt.point.x - curpt.point.x;
-    dy = nxtpt.point.y - curpt.point.y;
-
-    enx = curpt.point.x+rat*dx;
-    eny = curpt.point.y+rat*dy;
-    cairo_line_to(cr, enx, eny);
+    lo = 0;
+    hi = pp->n-2;
+    while(lo < hi) {
+        mid = (lo+hi+1)/2;
+        if(pp->cum[mid] <= s) {
+            lo = mid;
+        } else {
+            hi = mid-1;
+        }
+    }
+    pp->cursor = lo;
+    return lo;
+}
 
-    path = cairo_copy_path_flat(cr);
+// copies the stretch of src that is txtwidth long and centered at
+// placeat (0-1) of its length into dst. 0 if src is too short.
+static int get_linear_label_path(paramd_path_t *src, double txtwidth, double placeat,
+        paramd_path_t *dst) {
+    int i, j;
+    double s0, s1, rat;
 
-    cairo_restore(cr);
+    dst->n = 0;
+    dst->length = 0.0;
+    dst->cursor = 0;
+    if(src->n < 2 || txtwidth > src->length) {
+        return 0;
+    }
+    s0 = src->length*placeat - txtwidth/2.0;
+    if(s0 < 0.0) s0 = 0.0;
+    s1 = s0 + txtwidth;
+    if(s1 > src->length) s1 = src->length;
 
-    return path;
+    src->cursor = 0;
+    i = paramd_segment(src, s0);
+    j = paramd_segment(src, s1);
+    rat = (s0 - src->cum[i])/(src->cum[i+1] - src->cum[i]);
+    paramd_add(dst, src->xy[2*i] + rat*(src->xy[2*i+2] - src->xy[2*i]),
+        src->xy[2*i+1] + rat*(src->xy[2*i+3] - src->xy[2*i+1]));
+    for(i=i+1; i<=j; i++) {
+        paramd_add(dst, src->xy[2*i], src->xy[2*i+1]);
+    }
+    rat = (s1 - src->cum[j])/(src->cum[j+1] - src->cum[j]);
+    paramd_add(dst, src->xy[2*j] + rat*(src->xy[2*j+2] - src->xy[2*j]),
+        src->xy[2*j+1] + rat*(src->xy[2*j+3] - src->xy[2*j+1]));
+    return dst->n >= 2;
 }
 
 static void transform_label_points(cairo_path_t *lyopath, paramd_path_t *paramd_lblpath) {
@@ -1372,6 +6173,7 @@ static void transform_label_points(cairo_path_t *lyopath, paramd_path_t *paramd_
     int i;
     double *xptr, *yptr;
 
+    paramd_lblpath->cursor = 0;
     for(i=0; i<lyopath->num_data;
             i+=lyopath->data[i].header.length) {
         // walk segments...
@@ -1403,78 +6205,31 @@ static void transform_label_points(cairo_path_t *lyopath, paramd_path_t *paramd_
 
 static void transform_label_point(paramd_path_t *paramd_lblpath, double *xptr, double *yptr) {
 
-    int i;
-    double rat, x=*xptr, y=*yptr, dx, dy;
-    cairo_path_data_t *pdat, lastmoveto, curpt;
-    cairo_path_t *lblpath;
-    param_t *params;
-
-    lblpath = paramd_lblpath->path;
-    params = paramd_lblpath->params;
-
-    for (i=0; i + lblpath->data[i].header.length < lblpath->num_data &&
-            (x > params[i] ||
-             lblpath->data[i].header.type == CAIRO_PATH_MOVE_TO);
-            i += lblpath->data[i].header.length) {
-        x -= params[i];
-        pdat = &lblpath->data[i];
-        switch (pdat->header.type) {
-            case CAIRO_PATH_MOVE_TO:
-                curpt = pdat[1];
-                lastmoveto = pdat[1];
-                break;
-            case CAIRO_PATH_LINE_TO:
-                curpt = pdat[1];
-                break;
-            case CAIRO_PATH_CURVE_TO:
-                curpt = pdat[3];
-                break;
-            case CAIRO_PATH_CLOSE_PATH:
-                break;
-            default:
-                fprintf(stderr, "invalid path data type\n");
-                exit(1);
-                break;
-        }
-    }
+    int j;
+    double rat, x=*xptr, y=*yptr, dx, dy, seglen, *a;
 
-    pdat = &lblpath->data[i];
+    // modelled on Behdad Esfahbod's technique in cairo examples:
+    // https://github.com/phuang/pango/blob/master/examples/cairotwisted.c
+    // http://mces.blogspot.com/2008/11/text-on-path-with-cairo.html)
 
-    switch (pdat->header.type) {
-        case CAIRO_PATH_MOVE_TO:
-            break;
-        case CAIRO_PATH_CLOSE_PATH:
-            pdat = (&lastmoveto) - 1;
-        case CAIRO_PATH_LINE_TO:
-
-            // modelled on Behdad Esfahbod's technique in cairo examples:
-            // https://github.com/phuang/pango/blob/master/examples/cairotwisted.c
-            // http://mces.blogspot.com/2008/11/text-on-path-with-cairo.html)
-            
-            rat = x/params[i];
-
-            /* Line polynomial */
-            *xptr = curpt.point.x*(1-rat)+pdat[1].point.x*rat;
-            *yptr = curpt.point.y*(1-rat)+pdat[1].point.y*rat;
-
-            /* Line gradient */
-            dx = -(curpt.point.x-pdat[1].point.x);
-            dy = -(curpt.point.y-pdat[1].point.y);
-
-            /*optimization for: ratio = the_y / sqrt (dx * dx + dy * dy);*/
-            rat = y/params[i];
-            *xptr += -dy*rat;
-            *yptr +=  dx*rat;
-            break;
-        case CAIRO_PATH_CURVE_TO:
-            fprintf(stderr, "labelling curves not supported\n");
-            exit(1);
-            break;
-        default:
-            fprintf(stderr, "invalid path data type\n");
-            exit(1);
-            break;
-    }
+    j = paramd_segment(paramd_lblpath, x);
+    a = &paramd_lblpath->xy[2*j];
+    seglen = paramd_lblpath->cum[j+1] - paramd_lblpath->cum[j];
+    x -= paramd_lblpath->cum[j];
+    rat = x/seglen;
+
+    /* Line polynomial */
+    *xptr = a[0]*(1-rat)+a[2]*rat;
+    *yptr = a[1]*(1-rat)+a[3]*rat;
+
+    /* Line gradient */
+    dx = a[2]-a[0];
+    dy = a[3]-a[1];
+
+    /*optimization for: ratio = the_y / sqrt (dx * dx + dy * dy);*/
+    rat = y/seglen;
+    *xptr += -dy*rat;
+    *yptr +=  dx*rat;
 
     return;
 }
@@ -1528,6 +6283,257 @@ cairo_pattern_t* make_fill_pattern(vfr_style_t* style) {
     return hatchpat;
 }
 
+// make_fill_pattern, but each distinct pattern is made once per render
+// and reused (so svg output gets one definition for it, not one per use).
+// the cache keeps the reference; don't destroy the result.
+static cairo_pattern_t* cached_fill_pattern(vfr_style_t *style) {
+    int i;
+    vfr_pattern_t *p;
+    vfr_pattern_cache_t *c = &g_patterns;
+
+    if(!style->hatch_pattern || !strcmp(style->hatch_pattern, VFRHATCH_NONE_S)) {
+        return NULL;
+    }
+    for(i=0; i<c->n; i++) {
+        p = &c->entries[i];
+        if(p->fill == style->fill && p->fill_opacity == style->fill_opacity &&
+                p->hatch_scale == style->hatch_scale &&
+                p->hatch_rotate == style->hatch_rotate &&
+                !strcmp(p->hatch_pattern, style->hatch_pattern)) {
+            return p->pattern;
+        }
+    }
+    if(c->n == c->cap) {
+        c->cap = c->cap ? c->cap*2 : 8;
+        c->entries = realloc(c->entries, c->cap*sizeof(vfr_pattern_t));
+        if(c->entries == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    p = &c->entries[c->n++];
+    p->hatch_pattern = vfr_strdup(style->hatch_pattern);
+    p->fill = style->fill;
+    p->fill_opacity = style->fill_opacity;
+    p->hatch_scale = style->hatch_scale;
+    p->hatch_rotate = style->hatch_rotate;
+    p->pattern = make_fill_pattern(style); // NULL for unknown patterns
+    return p->pattern;
+}
+
+static void clear_fill_patterns(void) {
+    int i;
+    vfr_pattern_cache_t *c = &g_patterns;
+    for(i=0; i<c->n; i++) {
+        free(c->entries[i].hatch_pattern);
+        if(c->entries[i].pattern != NULL) {
+            cairo_pattern_destroy(c->entries[i].pattern);
+        }
+    }
+    // (called once the render's fills are painted)
+    free(c->entries);
+    c->entries = NULL;
+    c->n = c->cap = 0;
+}
+
+// gets the context all cached layouts share, set up for cr
+static PangoContext* cached_context(cairo_t *cr) {
+    int i;
+    vfr_font_cache_t *c = &g_fonts;
+
+    if(c->context == NULL) {
+        c->context = pango_cairo_create_context(cr);
+        c->cr = cr;
+    } else if(c->cr != cr) {
+        // a different cr may have another transform or font options
+        pango_cairo_update_context(cr, c->context);
+        for(i=0; i<c->n; i++) {
+            pango_layout_context_changed(c->entries[i].layout);
+        }
+        c->cr = cr;
+    }
+    return c->context;
+}
+
+// gets a layout for fontdesc (NULL for the default), reset to left-aligned
+// w/ no width. the layout belongs to the cache: set its text, don't free it.
+static PangoLayout* cached_layout(cairo_t *cr, const char *fontdesc) {
+    int i;
+    vfr_font_t *f;
+    vfr_font_cache_t *c = &g_fonts;
+
+    if(fontdesc == NULL) fontdesc = VFRDEFAULT_FONTDESC;
+    cached_context(cr);
+    f = NULL;
+    if(c->last < c->n && !strcmp(c->entries[c->last].fontdesc, fontdesc)) {
+        f = &c->entries[c->last];
+    } else {
+        for(i=0; i<c->n; i++) {
+            if(!strcmp(c->entries[i].fontdesc, fontdesc)) {
+                f = &c->entries[i];
+                c->last = i;
+                break;
+            }
+        }
+    }
+    if(f == NULL) {
+        if(c->n == c->cap) {
+            c->cap = c->cap ? c->cap*2 : 8;
+            c->entries = realloc(c->entries, c->cap*sizeof(vfr_font_t));
+            if(c->entries == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        c->last = c->n;
+        f = &c->entries[c->n++];
+        f->fontdesc = vfr_strdup(fontdesc);
+        f->desc = pango_font_description_from_string(fontdesc);
+        f->layout = pango_layout_new(c->context);
+        pango_layout_set_font_description(f->layout, f->desc);
+    }
+    pango_layout_set_width(f->layout, -1);
+    pango_layout_set_wrap(f->layout, PANGO_WRAP_WORD);
+    pango_layout_set_alignment(f->layout, PANGO_ALIGN_LEFT);
+    return f->layout;
+}
+
+static void clear_font_cache(void) {
+    int i;
+    vfr_font_cache_t *c = &g_fonts;
+    for(i=0; i<c->n; i++) {
+        free(c->entries[i].fontdesc);
+        pango_font_description_free(c->entries[i].desc);
+        g_object_unref(c->entries[i].layout);
+    }
+    c->n = c->last = 0;
+    if(c->context != NULL) {
+        g_object_unref(c->context);
+        c->context = NULL;
+    }
+    c->cr = NULL;
+}
+
+static unsigned long outline_hash(const char *text, const char *fontdesc, int width, int flags) {
+    unsigned long h = 2166136261UL; // fnv-1a
+    const unsigned char *c;
+    for(c=(const unsigned char *)text; *c; c++) h = (h ^ *c)*16777619UL;
+    h = (h ^ 0xff)*16777619UL;
+    for(c=(const unsigned char *)fontdesc; *c; c++) h = (h ^ *c)*16777619UL;
+    h = (h ^ (unsigned long)width)*16777619UL;
+    h = (h ^ (unsigned long)flags)*16777619UL;
+    return h;
+}
+
+// gets text laid out at the origin, shaping it only the first time a
+// (text, font, width, flags) combination is seen. its flattened outline
+// is made by outline_path, only for labels that need one.
+static vfr_outline_t* cached_outline(cairo_t *cr, const char *text, const char *fontdesc,
+        int width, int flags) {
+    long i, nbuckets;
+    unsigned long h;
+    vfr_outline_t *o, *next, **buckets;
+    vfr_outline_cache_t *c = &g_outlines;
+    PangoLayout *plyo;
+
+    if(fontdesc == NULL) fontdesc = VFRDEFAULT_FONTDESC;
+    h = outline_hash(text, fontdesc, width, flags);
+    if(c->nbuckets) {
+        for(o=c->buckets[h & (c->nbuckets-1)]; o!=NULL; o=o->next) {
+            if(o->hash == h && o->width == width && o->flags == flags &&
+                    !strcmp(o->text, text) && !strcmp(o->fontdesc, fontdesc)) {
+                return o;
+            }
+        }
+    }
+    if(c->n >= c->nbuckets) {
+        // grow (power of 2) and rehash
+        nbuckets = c->nbuckets ? c->nbuckets*2 : 1024;
+        buckets = calloc(nbuckets, sizeof(vfr_outline_t*));
+        if(buckets == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for(i=0; i<c->nbuckets; i++) {
+            for(o=c->buckets[i]; o!=NULL; o=next) {
+                next = o->next;
+                o->next = buckets[o->hash & (nbuckets-1)];
+                buckets[o->hash & (nbuckets-1)] = o;
+            }
+        }
+        free(c->buckets);
+        c->buckets = buckets;
+        c->nbuckets = nbuckets;
+    }
+    if((o = malloc(sizeof(vfr_outline_t))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    o->hash = h;
+    o->text = vfr_strdup(text);
+    o->fontdesc = vfr_strdup(fontdesc);
+    o->width = width;
+    o->flags = flags;
+    o->path = NULL;
+    // shape it
+    plyo = o->layout = outline_layout(cr, o);
+    pango_layout_get_size(plyo, &o->lyow, &o->lyoh);
+    pango_layout_get_pixel_extents(plyo, NULL, &o->rect);
+    o->next = c->buckets[h & (c->nbuckets-1)];
+    c->buckets[h & (c->nbuckets-1)] = o;
+    c->n++;
+    return o;
+}
+
+// lays out o's text, width and flags in a layout of its own, kept w/ o
+static PangoLayout* outline_layout(cairo_t *cr, vfr_outline_t *o) {
+    PangoLayout *plyo = pango_layout_copy(cached_layout(cr, o->fontdesc));
+    pango_layout_set_text(plyo, o->text, -1);
+    pango_layout_set_width(plyo, o->width);
+    if(o->flags & VFROUTLINE_WRAP) {
+        pango_layout_set_wrap(plyo, PANGO_WRAP_WORD_CHAR);
+    }
+    if(o->flags & VFROUTLINE_CENTER) {
+        pango_layout_set_alignment(plyo, PANGO_ALIGN_CENTER);
+    }
+    return plyo;
+}
+
+// o's flattened outline at the origin, made the first time it's asked
+// for. VFROUTLINE_LINE outlines hold just the first line, w/ its baseline
+// at y=0. (clears cr's path)
+static cairo_path_t* outline_path(cairo_t *cr, vfr_outline_t *o) {
+    if(o->path != NULL) return o->path;
+    cairo_new_path(cr);
+    if(o->flags & VFROUTLINE_LINE) {
+        pango_cairo_layout_line_path(cr, pango_layout_get_line_readonly(o->layout, 0));
+    } else {
+        cairo_move_to(cr, 0.0, 0.0);
+        pango_cairo_layout_path(cr, o->layout);
+    }
+    o->path = cairo_copy_path_flat(cr);
+    cairo_new_path(cr);
+    return o->path;
+}
+
+static void clear_outline_cache(void) {
+    long i;
+    vfr_outline_t *o, *next;
+    vfr_outline_cache_t *c = &g_outlines;
+    for(i=0; i<c->nbuckets; i++) {
+        for(o=c->buckets[i]; o!=NULL; o=next) {
+            next = o->next;
+            free(o->text);
+            free(o->fontdesc);
+            g_object_unref(o->layout);
+            if(o->path != NULL) cairo_path_destroy(o->path);
+            free(o);
+        }
+        c->buckets[i] = NULL;
+    }
+    c->n = 0;
+}
+
 /*int spline_knots(int knotsnum, double *tx, double *ty, double *cpx, double *cpy) {
 
     // modelled on https://www.particleincell.com/wp-content/uploads/2012/06/bezier-spline.js
@@ -1622,76 +6628,97 @@ void point_on_bezier(
     return;
 }
 
-OGRGeometryH path_convex_hull(cairo_path_t *path) {
-    int i;
-    double x, y, p0x, p0y, p1x, p1y, p2x, p2y, p3x, p3y;
-    double bx, by;
-    cairo_path_data_t *pdat;
+static int hull_pt_cmp(const void *a, const void *b) {
+    const double *pa = a, *pb = b;
+    if(pa[0] != pb[0]) return pa[0] < pb[0] ? -1 : 1;
+    if(pa[1] != pb[1]) return pa[1] < pb[1] ? -1 : 1;
+    return 0;
+}
+
+#define HULL_CROSS(o, a, b) (((a)[0]-(o)[0])*((b)[1]-(o)[1]) - ((a)[1]-(o)[1])*((b)[0]-(o)[0]))
 
-    OGRGeometryH pgeom = OGR_G_CreateGeometry(wkbLineString);
-    OGRGeometryH hgeom;
+// convex hull of the path's points (monotone chain), into hull. pts is
+// scratch. returns the number of hull points.
+static int path_convex_hull(cairo_path_t *path, vfr_coords_t *pts, vfr_coords_t *hull) {
+    int i, k, t, n = 0;
+    double x = 0.0, y = 0.0, bx, by;
+    double *xy, *h;
+    cairo_path_data_t *pdat;
 
+    vfr_coords_reserve(pts, path->num_data*2);
+    xy = pts->xy;
     for(i=0; i<path->num_data; i+=path->data[i].header.length) {
         pdat = &path->data[i];
         switch(pdat->header.type) {
             case CAIRO_PATH_MOVE_TO:
-                break;
             case CAIRO_PATH_LINE_TO:
-                x = pdat[1].point.x;
-                y = pdat[1].point.y;
-                OGR_G_AddPoint_2D(pgeom, x, y);
+                x = xy[n*2] = pdat[1].point.x;
+                y = xy[n*2+1] = pdat[1].point.y;
+                n++;
                 break;
             case CAIRO_PATH_CURVE_TO:
-                p0x = x;
-                p0y = y;
-                p1x = pdat[1].point.x;
-                p1y = pdat[1].point.y;
-                p2x = pdat[2].point.x;
-                p2y = pdat[2].point.y;
-                p3x = pdat[3].point.x;
-                p3y = pdat[3].point.y;
-                point_on_bezier(p0x, p0y, p1x, p1y, p2x, p2y, p3x, p3y, 0.5, &bx, &by);
-                OGR_G_AddPoint_2D(pgeom, bx, by);
-                x = p3x;
-                y = p3y;
-                OGR_G_AddPoint_2D(pgeom, x, y);
+                point_on_bezier(x, y, pdat[1].point.x, pdat[1].point.y,
+                    pdat[2].point.x, pdat[2].point.y,
+                    pdat[3].point.x, pdat[3].point.y, 0.5, &bx, &by);
+                xy[n*2] = bx;
+                xy[n*2+1] = by;
+                n++;
+                x = xy[n*2] = pdat[3].point.x;
+                y = xy[n*2+1] = pdat[3].point.y;
+                n++;
                 break;
             case CAIRO_PATH_CLOSE_PATH:
             default:
                 break;
         }
     }
-    hgeom = OGR_G_ConvexHull(pgeom);
-    OGR_G_DestroyGeometry(pgeom);
-    return hgeom;
+    pts->n = n;
+    hull->n = 0;
+    if(n < 3) return 0;
+    qsort(xy, n, 2*sizeof(double), hull_pt_cmp);
+
+    vfr_coords_reserve(hull, 2*n);
+    h = hull->xy;
+    k = 0;
+    // lower, then upper hull
+    for(i=0; i<n; i++) {
+        while(k >= 2 && HULL_CROSS(&h[(k-2)*2], &h[(k-1)*2], &xy[i*2]) <= 0) k--;
+        h[k*2] = xy[i*2];
+        h[k*2+1] = xy[i*2+1];
+        k++;
+    }
+    for(i=n-2, t=k+1; i>=0; i--) {
+        while(k >= t && HULL_CROSS(&h[(k-2)*2], &h[(k-1)*2], &xy[i*2]) <= 0) k--;
+        h[k*2] = xy[i*2];
+        h[k*2+1] = xy[i*2+1];
+        k++;
+    }
+    hull->n = k-1; // last point repeats the first
+    return hull->n;
 }
 
-void make_label_halo(cairo_t *cr, cairo_path_t *plyopath, vfr_style_t *style) {
-        int i, hullptnum;
-        double x, y;
-        OGRGeometryH hullgeom = path_convex_hull(plyopath);
-        if(!OGR_G_IsEmpty(hullgeom)) {
-            OGRGeometryH hullext = OGR_G_GetGeometryRef(hullgeom, 0);
-            hullptnum = OGR_G_GetPointCount(hullext);
-            cairo_new_path(cr);
-            x = OGR_G_GetX(hullext, 0);
-            y = OGR_G_GetY(hullext, 0);
-            cairo_move_to(cr, x, y);
-            for(i=1; i<hullptnum; i++) {
-                x = OGR_G_GetX(hullext, i);
-                y = OGR_G_GetY(hullext, i);
-                cairo_line_to(cr, x, y);
-            }
+void make_label_halo(cairo_t *cr, cairo_path_t *plyopath, vfr_label_t *lbl) {
+        cairo_save(cr);
+        cairo_set_source_rgba(cr,
+            vfr_color_compextr(lbl->halo_fill, 'r'),
+            vfr_color_compextr(lbl->halo_fill, 'g'),
+            vfr_color_compextr(lbl->halo_fill, 'b'),
+            ((float)lbl->opacity)/100.0);
+        cairo_new_path(cr);
+        if(lbl->halo_mode == VFRHALO_OUTLINE) {
+            // the fill covers the inner half of the stroke
+            cairo_append_path(cr, plyopath);
+            cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+            cairo_set_line_width(cr, lbl->halo_size*2.0);
+            cairo_stroke(cr);
+        } else if(path_convex_hull(plyopath, &g_coords, &g_clipbuf) >= 3) {
+            // (scratch buffers are free once shapes are drawn)
+            vfr_path_coords(cr, &g_clipbuf);
             cairo_close_path(cr);
-            cairo_set_source_rgba(cr,
-                vfr_color_compextr(style->label_halo_fill, 'r'),
-                vfr_color_compextr(style->label_halo_fill, 'g'),
-                vfr_color_compextr(style->label_halo_fill, 'b'),
-                ((float)style->label_opacity)/100.0);
             cairo_fill_preserve(cr);
-            cairo_set_line_width(cr, style->label_halo_size);
+            cairo_set_line_width(cr, lbl->halo_size);
             cairo_stroke(cr);
         }
-        OGR_G_DestroyGeometry(hullgeom);
+        cairo_restore(cr);
         return;
 }